@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef ANALYZE_HEADER
+#define ANALYZE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct CodeInfo CodeInfo;
+
+/* per-byte flags describing the code */
+enum insn_flag {
+	INSN_START = 0x1, /* an instruction starts here */
+	INSN_TARGET = 0x2, /* a direct branch lands here */
+	INSN_LEADER = 0x4, /* a basic block starts here */
+	INSN_ENTRY = 0x8 /* a direct call lands here */
+};
+
+/*
+ * Decode code, discover its direct branch targets and basic blocks, and
+ * bound how far the stack grows inside a block. Returns NULL if the code
+ * fails verification: a byte that is not an opcode, an immediate running
+ * past the end, or a branch that doesn't land on an instruction.
+ */
+CodeInfo* analyze_code(const uint8_t *code, size_t size);
+
+/*
+ * Like analyze_code, but look in dir for a result saved by an earlier run,
+ * keyed by a hash of the code and the engine version, and map it instead
+ * of redoing the work. New results are saved to dir.
+ */
+CodeInfo* load_code_info(const uint8_t *code, size_t size, const char *dir);
+
+/*
+ * Have make_reg_code, relink_code and make_profile go through
+ * load_code_info with dir, or analyze_code again every time if dir is
+ * NULL, as it starts out. dir must outlive its use; set it before
+ * starting threads that could make any of those.
+ */
+void set_code_info_dir(const char *dir);
+
+void free_code_info(CodeInfo *info);
+
+/* 1 if info was mapped from a file load_code_info saved earlier */
+int code_info_cached(CodeInfo *info);
+
+/* one insn_flag set per code byte */
+const uint8_t* code_info_flags(CodeInfo *info);
+
+/* the most bytes any basic block can push beyond its entry depth */
+size_t code_info_max_growth(CodeInfo *info);
+
+#endif
@@ -0,0 +1,58 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CHANNEL_HEADER
+#define CHANNEL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * A bounded, lock-free queue of fixed-size messages that any number of
+ * threads may send to and receive from. Guests reach a channel through
+ * the id it is attached under with SEND and RECV.
+ */
+typedef struct Channel Channel;
+
+/* capacity is rounded up to a power of two, and at least 2 */
+Channel* make_channel(size_t capacity, size_t msg_size);
+void free_channel(Channel *c);
+
+size_t channel_msg_size(Channel *c);
+
+/* copy one message in or out; -1 if the channel is full or empty */
+int channel_send(Channel *c, const void *msg);
+int channel_recv(Channel *c, void *msg);
+
+/* like channel_send and channel_recv, but sleep until they can succeed */
+void channel_send_wait(Channel *c, const void *msg);
+void channel_recv_wait(Channel *c, void *msg);
+
+/* make c the channel that vm's SEND and RECV name by id */
+int vm_attach_channel(VM *vm, uint8_t id, Channel *c);
+
+/*
+ * sleep until the SEND, RECV, IN or OUT that returned VM_BLOCKED could
+ * succeed, then return the pc it left off at, to resume with
+ * run_vm(vm, NULL, pc)
+ */
+size_t vm_wait(VM *vm);
+
+#endif
@@ -0,0 +1,56 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef COMPACT_HEADER
+#define COMPACT_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The compact encoding uses the opcodes from vm.h with two differences:
+ *
+ *   - PUSH_u16, PUSH_u32 and PUSH_u64 take an unsigned LEB128 immediate
+ *     instead of a fixed number of big-endian bytes
+ *   - CJMP, CJMPIF and CCALL take a signed LEB128 displacement, relative to
+ *     the address of the branch opcode itself, instead of popping a target
+ *
+ * Every other instruction keeps its vm.h form, except that inline branch
+ * targets (of the _rel and _abs opcodes, FCALL, SPAWN and the like) are
+ * relocated to the address their instruction translates to, so they must
+ * name the start of one. Translation moves instructions around, so pcmap
+ * can be used to relocate addresses computed at run time.
+ */
+enum compact_opcode {
+	CJMP = 0xAD, /* unconditional branch */
+	CJMPIF = 0xAE, /* conditional branch */
+	CCALL = 0xAF
+};
+
+/*
+ * Translates size bytes of compact code into the form run_vm executes.
+ * Returns a malloc'd buffer, storing its length in code_size, or NULL if src
+ * is malformed. If pcmap is not NULL it must hold size + 1 entries and
+ * receives the translated address of each compact address (or (size_t)-1 if
+ * the address is not the start of an instruction).
+ */
+uint8_t* load_compact(const uint8_t *src, size_t size, size_t *code_size,
+	size_t *pcmap);
+
+#endif
@@ -0,0 +1,78 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef DEBUG_HEADER
+#define DEBUG_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * A debugger owns a copy of some code that it patches with TRAP opcodes
+ * at breakpoints. VMs attached to it run the copy, and a TRAP calls back
+ * to the host before running the instruction it covers, so code without
+ * breakpoints runs exactly as fast as it does undebugged. A VM that steps
+ * switches to a second copy with every instruction patched, so others
+ * sharing the debugger are unaffected. Children from SPAWN and clones
+ * inherit their parent's debugger.
+ */
+typedef struct Debugger Debugger;
+
+/* what the callback wants done once it returns */
+enum debug_action {
+	DEBUG_CONTINUE = 0, /* run on to the next breakpoint */
+	DEBUG_STEP = 1, /* stop again at the next instruction */
+	DEBUG_STOP = 2 /* return VM_BREAK from run_vm, with pc at the trap */
+};
+
+/* called with vm->pc at the instruction about to run */
+typedef int (*debug_fn)(VM *vm, size_t pc, void *arg);
+
+Debugger* make_debugger(const uint8_t *code, size_t size, debug_fn fn,
+	void *arg);
+
+/* detach every VM from d before freeing it */
+void free_debugger(Debugger *d);
+
+/* the patched code, for run_vm calls that pass code in */
+uint8_t* debugger_code(Debugger *d);
+
+/* run vm on d's code, or back on the original code if d is NULL */
+void vm_debug(VM *vm, Debugger *d, uint8_t *original);
+
+/*
+ * Set or clear a breakpoint on the instruction at pc. These patch the
+ * shared code, so no VM may be running it at the time.
+ */
+int set_breakpoint(Debugger *d, size_t pc);
+int clear_breakpoint(Debugger *d, size_t pc);
+
+/* registers, and the live stack bytes, for the callback to inspect */
+struct vm_regs {
+	size_t pc;
+	size_t sp;
+	size_t fp;
+	size_t csp;
+};
+
+void vm_get_regs(VM *vm, struct vm_regs *regs);
+const uint8_t* vm_stack(VM *vm, size_t *sp);
+
+#endif
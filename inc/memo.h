@@ -0,0 +1,55 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef MEMO_HEADER
+#define MEMO_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * A bounded cache of the results of functions marked with PURE, keyed
+ * by the function and its argument bytes. Any number of VMs, on any
+ * threads, may share one, even running different code: keys name the
+ * code and, for VMs made from a CodeSlot, its version.
+ */
+typedef struct Memo Memo;
+
+/* the most arg and result bytes a call may have to be cached */
+#define MEMO_ARGS 64
+#define MEMO_VALUE 16
+
+struct memo_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions; /* results dropped to make room for newer ones */
+};
+
+/* entries is rounded up to a power of two, and at least 4 */
+Memo* make_memo(size_t entries);
+void free_memo(Memo *m);
+
+void memo_clear(Memo *m);
+void memo_stats(Memo *m, struct memo_stats *stats);
+
+/* make vm's PURE functions use m, or run every call if m is NULL */
+void vm_attach_memo(VM *vm, Memo *m);
+
+#endif
@@ -0,0 +1,116 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef MODULE_HEADER
+#define MODULE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * A module file is a header, a section table and the sections, with every
+ * integer stored big-endian like bytecode immediates:
+ *
+ *   header:  magic "STKRMOD\0", u32 version, u32 flags, u64 checksum,
+ *            u32 section count, u32 reserved
+ *   section: u32 type, u32 reserved, u64 offset, u64 size, u64 checksum
+ *
+ * The header's checksum is hash64 of the section count through the end of
+ * the section table, and each section's is hash64 of its bytes, so a
+ * section is only read when it's used: the symbols, strings and try table
+ * on load, the code and data when first asked for. The symbol
+ * section is an array of (u64 pc, u32 flags, u32 name offset) entries
+ * naming NUL-terminated strings in the string section. The try section
+ * is an array of (u64 start, u64 end, u64 handler, u64 depth) entries,
+ * as in struct try_entry.
+ */
+#define MODULE_VERSION 2
+
+enum module_flag {
+	MODULE_COMPACT = 0x1 /* code uses the encoding from compact.h */
+};
+
+enum section_type {
+	SECTION_CODE = 1,
+	SECTION_DATA = 2, /* initial env contents */
+	SECTION_SYMBOLS = 3,
+	SECTION_STRINGS = 4,
+	SECTION_TRY = 5
+};
+
+enum symbol_flag {
+	SYMBOL_ENTRY = 0x1 /* exported entry point */
+};
+
+struct symbol {
+	const char *name;
+	size_t pc;
+	uint32_t flags;
+};
+
+/* everything write_module needs to produce a module file */
+struct module_desc {
+	uint32_t flags;
+
+	const uint8_t *code;
+	size_t code_size;
+
+	const uint8_t *data;
+	size_t data_size;
+
+	const struct symbol *symbols;
+	size_t symbol_count;
+
+	const struct try_entry *tries;
+	size_t try_count;
+};
+
+typedef struct Module Module;
+
+int write_module(const char *path, const struct module_desc *desc);
+
+/*
+ * Map the module at path read-only and verify its header and the sections
+ * it reads. Unless the code is compact, module_code returns a pointer
+ * straight into the mapping, and only pages the code in to verify it the
+ * first time.
+ */
+Module* load_module(const char *path);
+
+void free_module(Module *m);
+
+/* NULL if the code section is corrupt */
+uint8_t* module_code(Module *m, size_t *size);
+
+const struct symbol* module_symbols(Module *m, size_t *count);
+
+/* find the entry point called name, returning 0 on success */
+int module_entry(Module *m, const char *name, size_t *pc);
+
+const struct try_entry* module_tries(Module *m, size_t *count);
+
+/*
+ * make a VM running m's code with the data section copied into its env,
+ * catching exceptions with m's try table. NULL if the code or data is
+ * corrupt.
+ */
+VM* make_module_vm(Module *m, size_t stack_size, size_t env_size);
+
+#endif
@@ -0,0 +1,40 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef POOL_HEADER
+#define POOL_HEADER
+
+#include <stddef.h>
+#include <vm.h>
+
+/*
+ * Worker threads that run the children guests SPAWN. Without a pool, a
+ * VM runs each child to completion as it is spawned.
+ */
+typedef struct Pool Pool;
+
+Pool* make_pool(size_t threads);
+
+/* waits for queued children, so every VM using pool must be done first */
+void free_pool(Pool *pool);
+
+/* run vm's children, and theirs, on pool */
+void vm_attach_pool(VM *vm, Pool *pool);
+
+#endif
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef PORT_HEADER
+#define PORT_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vm.h>
+
+/*
+ * A port is a byte ring with one writer and one reader, split into
+ * records by a delimiter byte, or PORT_RAW to hand the reader whatever
+ * is buffered. Guests read records with IN and write them with OUT,
+ * and the host moves data in and out in bulk. Attaching one port to a
+ * VM's OUT and another's IN pipes the first into the second.
+ */
+typedef struct Port Port;
+
+#define PORT_RAW (-1)
+
+Port* make_port(size_t capacity, int delim);
+
+/* a closed port reading the file at path through a read-only mapping */
+Port* map_port(const char *path, int delim);
+
+void free_port(Port *p);
+
+/* the writer is done: IN hands out what is left, then end of stream */
+void port_close(Port *p);
+
+/* copy up to len bytes in or out, returning how many were copied */
+size_t port_write(Port *p, const void *buf, size_t len);
+size_t port_read(Port *p, void *buf, size_t len);
+
+/*
+ * fill the free space from fd with one readv, closing the port at end
+ * of file, or write all buffered data to fd with one writev. Both
+ * return what read and write would, port_fill failing with EAGAIN if
+ * the port is full or mapped.
+ */
+ssize_t port_fill(Port *p, int fd);
+ssize_t port_drain(Port *p, int fd);
+
+/*
+ * make p the port that vm's IN and OUT name by id. SPAWNed children and
+ * clones don't inherit vm's ports, which would give p more than one end.
+ */
+int vm_attach_port(VM *vm, uint8_t id, Port *p);
+
+#endif
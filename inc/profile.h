@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef PROFILE_HEADER
+#define PROFILE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <debug.h>
+
+/*
+ * A profile counts how often each basic block of some code runs. It is
+ * a debugger with a breakpoint on every block, so attach VMs to it with
+ * vm_debug(vm, profile_debugger(p), code) for a training run; code run
+ * normally pays nothing for profiling having been built in.
+ */
+typedef struct Profile Profile;
+
+/*
+ * NULL if the code fails analyze_code's verification, done through the
+ * cache if set_code_info_dir set one, as relink_code's is
+ */
+Profile* make_profile(const uint8_t *code, size_t size);
+void free_profile(Profile *p);
+
+Debugger* profile_debugger(Profile *p);
+
+/*
+ * One count per code byte: how many times the block starting there
+ * ran, so a function's entry block counts its calls. Bytes that don't
+ * start a block are 0.
+ */
+const uint64_t* profile_counts(Profile *p);
+
+/*
+ * Lay code out again hot-first using counts from a profile of it: the
+ * blocks of the hottest functions first, each function's blocks chained
+ * along their hottest fall-throughs, and blocks that never ran last.
+ * The block at 0 stays first. Branches are retargeted and jumps added or
+ * dropped wherever a fall-through moved.
+ *
+ * Returns a malloc'd buffer, storing its length in code_size, or NULL if
+ * the code fails verification or branches to addresses it computes,
+ * which can't be relocated. If pcmap is not NULL it must hold size + 1
+ * entries and receives the new address of each instruction (or
+ * (size_t)-1 for bytes that don't start one), for relocating entry
+ * points. Try ranges don't stay in one piece, so relink code without.
+ * The jumps added are _rel ones, so code using only _rel branches can
+ * still be loaded anywhere.
+ */
+uint8_t* relink_code(const uint8_t *code, size_t size,
+	const uint64_t *counts, size_t *code_size, size_t *pcmap);
+
+#endif
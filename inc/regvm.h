@@ -0,0 +1,65 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef REGVM_HEADER
+#define REGVM_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+
+/*
+ * Code translated for a register engine. Inside each basic block, values
+ * a stack machine would push and pop live in virtual registers instead,
+ * constants fold into the operations using them, and env cells with
+ * constant addresses are read and written directly. The stack only
+ * holds the block's values again where the block ends, calls, returns,
+ * or meets an opcode the engine leaves to run_vm.
+ *
+ * Translations don't change, so VMs on any thread may share one.
+ */
+typedef struct RegCode RegCode;
+
+/*
+ * NULL if the code fails analyze_code's verification, done through the
+ * cache if set_code_info_dir set one. code must outlive the translation,
+ * which only runs VMs whose code is this same buffer.
+ */
+RegCode* make_reg_code(const uint8_t *code, size_t size);
+void free_reg_code(RegCode *rc);
+
+/*
+ * Run like run_vm(vm, NULL, pc), returning the same status with the VM
+ * left in the same state. A run that meets an opcode the engine doesn't
+ * translate, or that would fault, finishes on run_vm from that
+ * instruction. So does one reaching an address that doesn't start a
+ * basic block, including pc. The whole run is left to run_vm when the
+ * VM's code isn't what rc was made from, as after a reload, or when a
+ * debugger is attached, so its breakpoints are honoured.
+ */
+int run_reg(VM *vm, RegCode *rc, size_t pc);
+
+/*
+ * vm_call, running the function on the register engine. A suspended call
+ * is resumed with vm_call_resume.
+ */
+int reg_call(VM *vm, RegCode *rc, size_t pc, const uint8_t *args,
+	uint8_t nargs, uint64_t *result);
+
+#endif
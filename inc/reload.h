@@ -0,0 +1,72 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef RELOAD_HEADER
+#define RELOAD_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <module.h>
+#include <vm.h>
+
+/*
+ * A Code is one immutable, reference-counted version of a program. A
+ * CodeSlot holds the latest version: publishing a new one never waits
+ * for VMs still running an old one, which is freed once the last VM or
+ * frame using it lets go.
+ */
+typedef struct Code Code;
+typedef struct CodeSlot CodeSlot;
+
+/*
+ * take over m, whose entry points name the functions to call. NULL,
+ * leaving m to the caller, if its code is corrupt.
+ */
+Code* make_code(Module *m);
+
+void code_ref(Code *c);
+void code_unref(Code *c);
+
+/* 1 for the first version published to a slot, then counting up */
+uint64_t code_version(Code *c);
+
+CodeSlot* make_code_slot(Code *c);
+
+/* VMs made from slot keep their version but must be freed first */
+void free_code_slot(CodeSlot *slot);
+
+/* make c the latest version, taking over the caller's reference */
+void publish_code(CodeSlot *slot, Code *c);
+
+/* the latest version, with a reference the caller must drop */
+Code* acquire_code(CodeSlot *slot);
+
+/* make a VM running the latest version in slot */
+VM* make_slot_vm(CodeSlot *slot, size_t stack_size, size_t env_size);
+
+/*
+ * Call the entry point name as vm_call does. When vm has no frames,
+ * coroutines, SPAWNed children or suspended call in flight, and no
+ * debugger attached, it first moves to the latest version in its slot;
+ * otherwise the call runs on the version it is already using.
+ */
+int vm_call_latest(VM *vm, const char *name, const uint8_t *args,
+	uint8_t nargs, uint64_t *result);
+
+#endif
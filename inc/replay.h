@@ -0,0 +1,66 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef REPLAY_HEADER
+#define REPLAY_HEADER
+
+#include <vm.h>
+
+/*
+ * A log of the SYSCALLs some VMs made: each one's number, arguments and
+ * result, and the env bytes that changed across it when an argument
+ * pointed into env. Recording runs the calls as usual; replaying runs
+ * none and serves the logged results and env bytes instead, so a run
+ * repeats exactly without its files, sockets or clocks.
+ *
+ * Each VM's SYSCALLs are kept apart in the log, so VMs sharing it across
+ * threads or a pool replay in whatever order they're scheduled. Children
+ * from SPAWN and clones use their parent's log; that only finds their
+ * calls again if the VMs are attached in the order they were recorded
+ * in and each makes its children and clones in the same order too.
+ *
+ * Recording a call with an argument pointing into env copies and
+ * compares env from the lowest such argument to its end, since there's
+ * no telling how much of it the kernel writes. That costs time in
+ * proportion to how much env follows the buffer, so keep buffers for
+ * SYSCALLs towards the end of a big env.
+ */
+typedef struct SyscallLog SyscallLog;
+
+/* record to a new file at path */
+SyscallLog* record_syscalls(const char *path);
+
+/* replay the log recorded to path */
+SyscallLog* replay_syscalls(const char *path);
+
+/*
+ * Detach every VM from log before closing it. Returns -1 if a
+ * recording couldn't all be written.
+ */
+int close_syscall_log(SyscallLog *log);
+
+/*
+ * make vm's SYSCALLs go through log, or straight to the kernel if log
+ * is NULL, starting vm's own stream of records. A replayed SYSCALL
+ * faults once the run stops matching the log: a different number or
+ * argument count, or the VM's records ran out.
+ */
+void vm_attach_syscall_log(VM *vm, SyscallLog *log);
+
+#endif
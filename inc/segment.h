@@ -0,0 +1,53 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef SEGMENT_HEADER
+#define SEGMENT_HEADER
+
+#include <stddef.h>
+#include <vm.h>
+
+/*
+ * A segment is shared memory that can be bound into the env of VMs in
+ * different processes. Named segments use POSIX shared memory; anonymous
+ * ones are memfds whose descriptor is passed on by fork or over a socket.
+ * Guests coordinate through the XADD_* and CAS_* opcodes.
+ */
+typedef struct Segment Segment;
+
+/* create a segment of size bytes; name may be NULL for an anonymous one */
+Segment* make_segment(const char *name, size_t size);
+
+/* map an existing named segment, or one shared as a descriptor */
+Segment* open_segment(const char *name);
+Segment* open_segment_fd(int fd);
+
+/* unmap s; named segments persist until unlink_segment */
+void free_segment(Segment *s);
+
+int unlink_segment(const char *name);
+
+int segment_fd(Segment *s);
+void* segment_base(Segment *s);
+size_t segment_size(Segment *s);
+
+/* bind s into vm's env at addr, as vm_bind_env does */
+int vm_attach_segment(VM *vm, size_t addr, Segment *s, int flags);
+
+#endif
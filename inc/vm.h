@@ -25,12 +25,144 @@
 
 typedef struct VM VM;
 
+/* what made run_vm return */
+enum vm_status {
+	VM_HALT = 0, /* executed HALT */
+	VM_RETURN = 1, /* returned from the function vm_call invoked */
+	VM_FAULT = 2, /* accessed env outside of env and its windows */
+	VM_BLOCKED = 3, /* SEND, RECV, IN or OUT would block; see vm_wait */
+	VM_EXCEPTION = 4, /* nothing caught a THROW; see vm_exception */
+	VM_BREAK = 5 /* a debugger callback asked to stop; see debug.h */
+};
+
+/*
+ * what a handler catches when run_vm faults rather than a guest THROWs;
+ * uncaught, they still make run_vm return VM_FAULT
+ */
+#define VM_ERR_FAULT UINT64_C(0xFFFFFFFFFFFFFFFF) /* bad env access and such */
+#define VM_ERR_DIV UINT64_C(0xFFFFFFFFFFFFFFFE) /* DIV_* or MOD_* by zero */
+
+/*
+ * A handler for exceptions thrown from code in [start, end) of the frame
+ * that is running it. The handler runs in that frame with the stack
+ * depth bytes above its fp, and the thrown u64 pushed on top. Entries are
+ * searched in order, so inner regions must come before outer ones.
+ */
+struct try_entry {
+	size_t start;
+	size_t end;
+	size_t handler;
+	size_t depth;
+};
+
+/* access allowed through a window bound by vm_bind_env */
+enum env_flag {
+	VM_ENV_READ = 0x1,
+	VM_ENV_WRITE = 0x2
+};
+
+/* element types for the SORT family, named like the opcode suffixes */
+enum elem_type {
+	TYPE_u8 = 0,
+	TYPE_i8 = 1,
+	TYPE_u16 = 2,
+	TYPE_i16 = 3,
+	TYPE_u32 = 4,
+	TYPE_i32 = 5,
+	TYPE_u64 = 6,
+	TYPE_i64 = 7,
+	TYPE_f = 8,
+	TYPE_d = 9
+};
+
 VM* make_vm(uint8_t *code, size_t stack_size, size_t env_size);
 
 void free_vm(VM *vm);
 
 int run_vm(VM *vm, uint8_t *code, size_t pc);
 
+/* use entries, which must outlive vm like its code, to catch exceptions */
+void vm_set_try_table(VM *vm, const struct try_entry *entries, size_t count);
+
+/* the value thrown when run_vm returned VM_EXCEPTION or VM_FAULT */
+uint64_t vm_exception(VM *vm);
+
+/*
+ * Typed access to the data stack, using the same byte layout as the
+ * PUSH_* opcodes. Each returns 0, or -1 if the stack would over or
+ * underflow.
+ */
+int vm_push_u8(VM *vm, uint8_t v);
+int vm_push_u16(VM *vm, uint16_t v);
+int vm_push_u32(VM *vm, uint32_t v);
+int vm_push_u64(VM *vm, uint64_t v);
+int vm_push_f(VM *vm, float v);
+int vm_push_d(VM *vm, double v);
+
+int vm_pop_u8(VM *vm, uint8_t *v);
+int vm_pop_u16(VM *vm, uint16_t *v);
+int vm_pop_u32(VM *vm, uint32_t *v);
+int vm_pop_u64(VM *vm, uint64_t *v);
+int vm_pop_f(VM *vm, float *v);
+int vm_pop_d(VM *vm, double *v);
+
+/* copy between env[addr] and buf, returning -1 if out of bounds */
+int vm_env_read(VM *vm, size_t addr, void *buf, size_t len);
+int vm_env_write(VM *vm, size_t addr, const void *buf, size_t len);
+
+/*
+ * Make env addresses [addr, addr + len) refer to the caller's buf, so
+ * LOAD_* and STORE_* work on it in place. addr must be at least the env
+ * size given to make_vm and windows may not overlap. buf must outlive the
+ * binding; it is not part of snapshots but is shared with clones.
+ */
+int vm_bind_env(VM *vm, size_t addr, void *buf, size_t len, int flags);
+
+int vm_unbind_env(VM *vm, size_t addr);
+
+/*
+ * Call the guest function at pc with nargs argument bytes, as CALL_* or
+ * FCALL would, and return once it returns. Any of the RET opcodes, FRET or
+ * RETN may end the call. If result is not NULL, up to 8 of the returned
+ * bytes are popped into it; the rest are left on the stack. Returns the
+ * vm_status from running the function, or -1 if the stack is too small or
+ * a call is suspended. A call that faults, throws or halts is dropped,
+ * leaving the stack as it was before the call.
+ *
+ * A call that returns VM_BLOCKED or VM_BREAK is suspended instead, with
+ * its frame left in place: finish it with vm_call_resume, from the pc
+ * vm_wait returns or the debugger reports.
+ */
+int vm_call(VM *vm, size_t pc, const uint8_t *args, uint8_t nargs,
+	uint64_t *result);
+
+/* resume the suspended call at pc, as vm_call would; -1 if none is */
+int vm_call_resume(VM *vm, size_t pc, uint64_t *result);
+
+/*
+ * Write vm's state to a page-aligned image at path. Returns 0 on success.
+ * The code itself is not saved: it is supplied again to vm_restore. Fails
+ * while vm has unfinished coroutines, children it hasn't joined or PURE
+ * calls waiting on their results.
+ */
+int vm_snapshot(VM *vm, const char *path);
+
+/*
+ * Map the image at path copy-on-write into a new VM running code, so the
+ * env and stack are paged in on demand and shared between every VM restored
+ * from the same image until written.
+ */
+VM* vm_restore(const char *path, uint8_t *code);
+
+/*
+ * Make a copy of vm that shares its env and stack pages copy-on-write, and
+ * its code read-only. The first clone after vm has run copies its state
+ * into an in-memory image once; later clones only map that image. The
+ * clone shares vm's windows and channels but starts with no ports. Returns
+ * NULL while vm has unfinished coroutines or children it hasn't joined.
+ */
+VM* vm_clone(VM *vm);
+
 enum opcode {
 	ADD_u8 = 0x01, /* add uint8_t */
 	ADD_i8 = 0x02, /* add int8_t */
@@ -223,7 +355,168 @@ enum opcode {
 
 	HALT = 0xAB,
 
-	SYSCALL = 0xAC
+	SYSCALL = 0xAC,
+
+	/* 0xAD - 0xAF are reserved for the compact encoding, see compact.h */
+
+	/*
+	 * direct branches: the target is a 4-byte big-endian immediate instead
+	 * of being popped. _rel targets are signed displacements from the
+	 * address of the branch opcode, _abs targets are absolute addresses.
+	 */
+	JMP_rel = 0xB0,
+	JMPIF_rel = 0xB1,
+	CALL_rel = 0xB2,
+	JMP_abs = 0xB3,
+	JMPIF_abs = 0xB4,
+	CALL_abs = 0xB5,
+
+	/*
+	 * calls that keep the return address and caller fp on a separate
+	 * control stack. FCALL and TCALL take a 4-byte displacement like
+	 * CALL_rel, TCALL reusing the current frame for its callee. FRET takes
+	 * a 1-byte immediate: the number of result bytes to return.
+	 */
+	FCALL = 0xB6,
+	FRET = 0xB7,
+	TCALL = 0xB8,
+
+	/* return the top n bytes, n being a 1-byte immediate */
+	RETN = 0xB9,
+
+	/* like ARG, but push the wide arg ending at the addressed byte */
+	ARG_u16 = 0xBA,
+	ARG_u32 = 0xBB,
+	ARG_u64 = 0xBC,
+
+	/*
+	 * atomic operations on naturally aligned, native-endian env values.
+	 * The address is a u64 on top of the stack, with the operands below.
+	 * XCHG, XADD and CAS push the old value; CAS then pushes 1 if it
+	 * swapped, 0 otherwise. Misaligned addresses fault.
+	 */
+	ALOAD_u8 = 0xBD,
+	ALOAD_u16 = 0xBE,
+	ALOAD_u32 = 0xBF,
+	ALOAD_u64 = 0xC0,
+	ASTORE_u8 = 0xC1,
+	ASTORE_u16 = 0xC2,
+	ASTORE_u32 = 0xC3,
+	ASTORE_u64 = 0xC4,
+	XCHG_u8 = 0xC5,
+	XCHG_u16 = 0xC6,
+	XCHG_u32 = 0xC7,
+	XCHG_u64 = 0xC8,
+	XADD_u8 = 0xC9,
+	XADD_u16 = 0xCA,
+	XADD_u32 = 0xCB,
+	XADD_u64 = 0xCC,
+	CAS_u8 = 0xCD,
+	CAS_u16 = 0xCE,
+	CAS_u32 = 0xCF,
+	CAS_u64 = 0xD0,
+
+	/* order the plain LOADs and STOREs around them */
+	FENCE_acq = 0xD1,
+	FENCE_rel = 0xD2,
+	FENCE = 0xD3,
+
+	/*
+	 * send or receive one message of the channel's size through the env
+	 * address on top of the stack, to or from the channel whose u8 id is
+	 * below it. If that would block, run_vm returns VM_BLOCKED instead.
+	 */
+	SEND = 0xD4,
+	RECV = 0xD5,
+
+	/*
+	 * call the function at the 4-byte absolute immediate on a child VM,
+	 * possibly on another thread, and push a u8 handle to JOIN on. The
+	 * child gets the args and argc below a u64 base and u64 len on top
+	 * of the stack, and sees env[base, base+len) as its whole env, and
+	 * the parent's windows and channels but none of its ports.
+	 */
+	SPAWN = 0xD6,
+
+	/*
+	 * wait for the child whose handle is on top and push its u64 result,
+	 * then throw what the child threw or faulted with, if it did
+	 */
+	JOIN = 0xD7,
+
+	/*
+	 * hash the u64 len bytes on top at the u64 env address below them,
+	 * continuing from a u32 crc or starting from a u64 seed below that
+	 */
+	HASH_crc32c = 0xD8,
+	HASH_u64 = 0xD9,
+
+	/*
+	 * an open-addressing hash table in env, at the u64 address on top.
+	 * HT_INIT lays one out from a u64 capacity (a power of two), a u16
+	 * key size and a u16 value size below the address; it takes 24 bytes
+	 * plus capacity * (1 + key size + value size). The rest take the
+	 * u64 env address of a key below the table's, with HT_INSERT taking
+	 * that of a value in between. HT_INSERT pushes 0 if the table is
+	 * full, HT_LOOKUP the env address of the value or 0, HT_DELETE 1 if
+	 * the key was there.
+	 */
+	HT_INIT = 0xDA,
+	HT_INSERT = 0xDB,
+	HT_LOOKUP = 0xDC,
+	HT_DELETE = 0xDD,
+
+	/*
+	 * operate on the u64 count native-endian elements at a u64 env
+	 * address, both below an elem_type byte on top. SORT sorts them in
+	 * place. SORT_rec sorts records of a u32 size, stably, by the element
+	 * at a u32 offset into each; both go between count and type. Between
+	 * them PARTITION and BSEARCH take the u64 env address of a value:
+	 * PARTITION moves the elements less than it first and BSEARCH finds
+	 * the first not less than it in a sorted array, pushing the u64 index.
+	 * Floats order as < does, except that every NaN is equal to every
+	 * other and greater than +inf.
+	 */
+	SORT = 0xDE,
+	SORT_rec = 0xDF,
+	PARTITION = 0xE0,
+	BSEARCH = 0xE1,
+
+	/*
+	 * coroutines: CORO_NEW makes one that will call the function at the
+	 * 4-byte absolute immediate with the args and argc below a u32 stack
+	 * size on top, and pushes its u32 handle. RESUME runs the coroutine
+	 * whose handle is on top until it YIELDs the u64 on its top, or its
+	 * function returns, then pushes that u64 and a byte that is 1 if it
+	 * yielded or 0 if it returned, after which the handle is freed.
+	 */
+	CORO_NEW = 0xE2,
+	RESUME = 0xE3,
+	YIELD = 0xE4,
+
+	/* throw the u64 on top to the innermost try_entry covering it */
+	THROW = 0xE5,
+
+	/* patched over code by a debugger, never written by hand */
+	TRAP = 0xE6,
+
+	/*
+	 * streaming records through the port whose u8 id is below an env
+	 * address and a u32 length on top. IN reads the next record into at
+	 * most length (nonzero) bytes there, pushing the u32 length it took,
+	 * or 0 at the end of the stream. OUT writes length bytes from there.
+	 * If that would block, run_vm returns VM_BLOCKED instead, OUT having
+	 * written as much as fits and left the rest on the stack.
+	 */
+	IN = 0xE7,
+	OUT = 0xE8,
+
+	/*
+	 * first in a function whose result, the size of the 1-byte immediate,
+	 * only depends on its args: with a memo attached, a call seen before
+	 * returns its result straight away, and others save theirs on return
+	 */
+	PURE = 0xE9
 };
 
 #endif
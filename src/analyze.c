@@ -0,0 +1,290 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <analyze.h>
+#include "vm_internal.h"
+
+
+#define INFO_MAGIC "STKRINF"
+
+/* bump when analyze_code's output changes for the same opcodes */
+#define ANALYSIS_VERSION 1
+
+/* where get_code_info keeps results, if set */
+static const char *info_dir;
+
+struct CodeInfo {
+	uint8_t *flags;
+	size_t size;
+	size_t max_growth;
+
+	/* flags point into this mapping of a cache file, if set */
+	void *map;
+	size_t map_size;
+};
+
+/* cache files are this header followed by the flags; native-endian */
+struct info_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t code_hash;
+	uint64_t code_size;
+	uint64_t max_growth;
+};
+
+/* changes whenever an opcode is added or redescribed */
+static uint64_t engine_version(void)
+{
+	struct opinfo ops[256];
+	int i;
+
+	memset(ops, 0, sizeof(ops));
+	for (i=0; i<256; ++i) describe_op(i, &ops[i]);
+
+	return hash64(ops, sizeof(ops), ANALYSIS_VERSION);
+}
+
+/* mark where instructions start, failing on bad opcodes or immediates */
+static int decode(const uint8_t *code, size_t size, uint8_t *flags)
+{
+	struct opinfo info;
+	size_t pc = 0;
+
+	while (pc < size) {
+		if (describe_op(code[pc], &info) != 0) return -1;
+		if (info.imm >= size - pc) return -1;
+
+		flags[pc] |= INSN_START;
+		pc += 1 + info.imm;
+	}
+
+	return 0;
+}
+
+static int find_blocks(const uint8_t *code, size_t size, uint8_t *flags)
+{
+	struct opinfo info;
+	size_t pc, next, target;
+
+	if (size > 0) flags[0] |= INSN_LEADER;
+
+	for (pc=0; pc<size; pc=next) {
+		describe_op(code[pc], &info);
+		next = pc + 1 + info.imm;
+
+		if (branch_target(code, pc, &info, &target) == 0) {
+			if (target >= size || !(flags[target] & INSN_START)) {
+				return -1;
+			}
+
+			flags[target] |= INSN_TARGET | INSN_LEADER;
+			if (info.flags & OP_CALL) flags[target] |= INSN_ENTRY;
+		}
+
+		if (next < size && (info.flags & (OP_JUMP | OP_COND | OP_CALL
+			| OP_STOP | OP_INDIRECT))) {
+			flags[next] |= INSN_LEADER;
+		}
+	}
+
+	return 0;
+}
+
+/* the stack effect of a block is static up to its first dynamic opcode */
+static size_t max_growth(const uint8_t *code, size_t size,
+	const uint8_t *flags)
+{
+	struct opinfo info;
+	size_t pc = 0, max = 0;
+	long depth = 0;
+	int known = 1;
+
+	while (pc < size) {
+		if (flags[pc] & INSN_LEADER) {
+			depth = 0;
+			known = 1;
+		}
+
+		describe_op(code[pc], &info);
+		if (info.flags & OP_DYNAMIC) known = 0;
+
+		if (known) {
+			depth += info.push - info.pop;
+			if (depth > 0 && (size_t)depth > max) max = depth;
+		}
+
+		pc += 1 + info.imm;
+	}
+
+	return max;
+}
+
+CodeInfo* analyze_code(const uint8_t *code, size_t size)
+{
+	CodeInfo *info = calloc(1, sizeof(CodeInfo));
+	if (info == NULL) return NULL;
+
+	info->size = size;
+	info->flags = calloc(size > 0 ? size : 1, sizeof(uint8_t));
+	if (info->flags == NULL) goto cleanup;
+
+	if (decode(code, size, info->flags) != 0) goto cleanup;
+	if (find_blocks(code, size, info->flags) != 0) goto cleanup;
+
+	info->max_growth = max_growth(code, size, info->flags);
+
+	return info;
+
+cleanup:
+	free_code_info(info);
+
+	return NULL;
+}
+
+static CodeInfo* map_info(const char *path, uint64_t hash, size_t size)
+{
+	struct info_header *h;
+	struct stat st;
+	CodeInfo *info;
+	uint8_t *map;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	if (fstat(fd, &st) != 0
+		|| (size_t)st.st_size != sizeof(*h) + size) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	h = (struct info_header*)map;
+	if (memcmp(h->magic, INFO_MAGIC, sizeof(INFO_MAGIC)) != 0
+		|| h->version != engine_version()
+		|| h->code_hash != hash
+		|| h->code_size != size) goto cleanup;
+
+	info = calloc(1, sizeof(CodeInfo));
+	if (info == NULL) goto cleanup;
+
+	info->flags = map + sizeof(*h);
+	info->size = size;
+	info->max_growth = h->max_growth;
+	info->map = map;
+	info->map_size = st.st_size;
+
+	return info;
+
+cleanup:
+	munmap(map, st.st_size);
+
+	return NULL;
+}
+
+static void save_info(const char *path, CodeInfo *info, uint64_t hash)
+{
+	struct info_header h;
+	uint8_t *buf = malloc(sizeof(h) + info->size);
+	if (buf == NULL) return;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INFO_MAGIC, sizeof(INFO_MAGIC));
+	h.version = engine_version();
+	h.code_hash = hash;
+	h.code_size = info->size;
+	h.max_growth = info->max_growth;
+
+	memcpy(buf, &h, sizeof(h));
+	memcpy(buf + sizeof(h), info->flags, info->size);
+
+	/* the cache is only an optimization, so failing to save is fine */
+	replace_file(path, buf, sizeof(h) + info->size);
+	free(buf);
+}
+
+CodeInfo* load_code_info(const uint8_t *code, size_t size, const char *dir)
+{
+	CodeInfo *info;
+	uint64_t hash = hash64(code, size, 0);
+	uint64_t key = hash64(code, size, engine_version());
+	char *path = malloc(strlen(dir) + sizeof("/0123456789abcdef.info"));
+	if (path == NULL) return NULL;
+
+	sprintf(path, "%s/%08lx%08lx.info", dir,
+		(unsigned long)(key >> 32), (unsigned long)(key & 0xFFFFFFFF));
+
+	info = map_info(path, hash, size);
+	if (info == NULL) {
+		info = analyze_code(code, size);
+		if (info != NULL) save_info(path, info, hash);
+	}
+
+	free(path);
+
+	return info;
+}
+
+void set_code_info_dir(const char *dir)
+{
+	__atomic_store_n(&info_dir, dir, __ATOMIC_RELEASE);
+}
+
+CodeInfo* get_code_info(const uint8_t *code, size_t size)
+{
+	const char *dir = __atomic_load_n(&info_dir, __ATOMIC_ACQUIRE);
+
+	if (dir == NULL) return analyze_code(code, size);
+
+	return load_code_info(code, size, dir);
+}
+
+void free_code_info(CodeInfo *info)
+{
+	if (info->map != NULL) {
+		munmap(info->map, info->map_size);
+	} else {
+		free(info->flags);
+	}
+	free(info);
+}
+
+int code_info_cached(CodeInfo *info)
+{
+	return info->map != NULL;
+}
+
+const uint8_t* code_info_flags(CodeInfo *info)
+{
+	return info->flags;
+}
+
+size_t code_info_max_growth(CodeInfo *info)
+{
+	return info->max_growth;
+}
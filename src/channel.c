@@ -0,0 +1,254 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <channel.h>
+#include "vm_internal.h"
+
+#define CACHE_LINE 64
+
+/*
+ * Vyukov's bounded MPMC queue: every slot has a sequence number that
+ * says whether it is ready for the sender or receiver at a position, so
+ * the two ends only contend on their own counter.
+ */
+struct Channel {
+	size_t tail; /* next position to send to */
+	char pad0[CACHE_LINE - sizeof(size_t)];
+	size_t head; /* next position to receive from */
+	char pad1[CACHE_LINE - sizeof(size_t)];
+
+	/* fixed by make_channel */
+	size_t mask;
+	size_t msg_size;
+	size_t *seqs;
+	uint8_t *msgs;
+	char pad2[CACHE_LINE - 2*sizeof(size_t) - 2*sizeof(void*)];
+
+	/* bumped by sends and receives while anyone sleeps on it */
+	uint32_t event;
+	uint32_t waiters;
+};
+
+static void notify(Channel *c)
+{
+	/*
+	 * order the slot just published before the load of waiters; wait
+	 * orders its count before checking the slots, so either it sees
+	 * the slot or we see it
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->waiters, __ATOMIC_RELAXED) == 0) return;
+
+	__atomic_add_fetch(&c->event, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &c->event, FUTEX_WAKE_PRIVATE, INT32_MAX,
+		NULL, NULL, 0);
+}
+
+static int ready(Channel *c, int send)
+{
+	size_t pos, seq;
+
+	if (send) {
+		pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+		seq = __atomic_load_n(&c->seqs[pos & c->mask], __ATOMIC_ACQUIRE);
+		return seq == pos;
+	}
+
+	pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	seq = __atomic_load_n(&c->seqs[pos & c->mask], __ATOMIC_ACQUIRE);
+	return seq == pos + 1;
+}
+
+/* sleep until a send (or receive) looks like it would succeed */
+static void wait(Channel *c, int send)
+{
+	uint32_t event;
+
+	__atomic_add_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	event = __atomic_load_n(&c->event, __ATOMIC_ACQUIRE);
+
+	if (!ready(c, send)) {
+		syscall(SYS_futex, &c->event, FUTEX_WAIT_PRIVATE, event,
+			NULL, NULL, 0);
+	}
+
+	__atomic_sub_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+Channel* make_channel(size_t capacity, size_t msg_size)
+{
+	Channel *c;
+	size_t i, size = 2;
+
+	if (msg_size == 0) return NULL;
+	while (size < capacity) size <<= 1;
+
+	c = calloc(1, sizeof(Channel));
+	if (c == NULL) return NULL;
+
+	c->seqs = malloc(size * sizeof(size_t));
+	c->msgs = malloc(size * msg_size);
+	if (c->seqs == NULL || c->msgs == NULL) {
+		free_channel(c);
+		return NULL;
+	}
+
+	for (i=0; i<size; ++i) c->seqs[i] = i;
+	c->mask = size - 1;
+	c->msg_size = msg_size;
+
+	return c;
+}
+
+void free_channel(Channel *c)
+{
+	free(c->seqs);
+	free(c->msgs);
+	free(c);
+}
+
+size_t channel_msg_size(Channel *c)
+{
+	return c->msg_size;
+}
+
+int channel_send(Channel *c, const void *msg)
+{
+	size_t seq, pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+
+	while (1) {
+		seq = __atomic_load_n(&c->seqs[pos & c->mask], __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(c->msgs + (pos & c->mask) * c->msg_size, msg, c->msg_size);
+	__atomic_store_n(&c->seqs[pos & c->mask], pos + 1, __ATOMIC_RELEASE);
+	notify(c);
+
+	return 0;
+}
+
+int channel_recv(Channel *c, void *msg)
+{
+	size_t seq, pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+
+	while (1) {
+		seq = __atomic_load_n(&c->seqs[pos & c->mask], __ATOMIC_ACQUIRE);
+
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(msg, c->msgs + (pos & c->mask) * c->msg_size, c->msg_size);
+	__atomic_store_n(&c->seqs[pos & c->mask], pos + c->mask + 1,
+		__ATOMIC_RELEASE);
+	notify(c);
+
+	return 0;
+}
+
+void channel_send_wait(Channel *c, const void *msg)
+{
+	while (channel_send(c, msg) != 0) wait(c, 1);
+}
+
+void channel_recv_wait(Channel *c, void *msg)
+{
+	while (channel_recv(c, msg) != 0) wait(c, 0);
+}
+
+int vm_attach_channel(VM *vm, uint8_t id, Channel *c)
+{
+	Channel **channels;
+
+	if (id >= vm->channel_count) {
+		channels = realloc(vm->channels, (id + 1) * sizeof(Channel*));
+		if (channels == NULL) return -1;
+
+		memset(channels + vm->channel_count, 0,
+			(id + 1 - vm->channel_count) * sizeof(Channel*));
+		vm->channels = channels;
+		vm->channel_count = id + 1;
+	}
+	vm->channels[id] = c;
+
+	return 0;
+}
+
+size_t vm_wait(VM *vm)
+{
+	if (vm->parked != NULL) wait(vm->parked, vm->parked_send);
+	if (vm->parked_port != NULL) port_wait(vm);
+
+	return vm->pc;
+}
+
+int channel_op(VM *vm, int send)
+{
+	size_t sp = vm->sp;
+	uint64_t addr, buf;
+	uint8_t id, *p;
+	Channel *c;
+
+	POP_64(vm, addr, buf);
+	id = POP(vm);
+
+	if (id >= vm->channel_count || vm->channels[id] == NULL) {
+		return VM_FAULT;
+	}
+	c = vm->channels[id];
+
+	p = env_ptr(vm, addr, c->msg_size, !send);
+	if (p == NULL) return VM_FAULT;
+
+	if ((send ? channel_send(c, p) : channel_recv(c, p)) == 0) {
+		vm->parked = NULL;
+		return 0;
+	}
+
+	/* leave the operands and pc on the op, so running again retries it */
+	vm->sp = sp;
+	--vm->pc;
+	vm->parked = c;
+	vm->parked_send = send;
+	vm->parked_port = NULL;
+
+	return VM_BLOCKED;
+}
@@ -0,0 +1,240 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <compact.h>
+#include "vm_internal.h"
+
+
+#define NOPC ((size_t)-1)
+
+/* a translated branch is the _rel opcode followed by a 4-byte displacement */
+#define BRANCH_SIZE 5
+
+static int read_uleb(const uint8_t *src, size_t size, size_t *i, uint64_t *v)
+{
+	uint8_t b;
+	unsigned shift = 0;
+
+	*v = 0;
+	do {
+		if (*i >= size || shift > 63) return -1;
+
+		b = src[(*i)++];
+		/* the tenth byte only holds bit 63 */
+		if (shift == 63 && (b & 0x7E)) return -1;
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	return 0;
+}
+
+static int read_sleb(const uint8_t *src, size_t size, size_t *i, int64_t *v)
+{
+	uint8_t b;
+	uint64_t x = 0;
+	unsigned shift = 0;
+
+	do {
+		if (*i >= size || shift > 63) return -1;
+
+		b = src[(*i)++];
+		x |= (uint64_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	if (shift < 64 && (b & 0x40)) x |= ~(uint64_t)0 << shift;
+	*v = (int64_t)x;
+
+	return 0;
+}
+
+/* number of immediate bytes that follow a PUSH in the executable form */
+static size_t push_width(uint8_t opcode)
+{
+	if (opcode == PUSH_u16) return 2;
+	if (opcode == PUSH_u32) return 4;
+	if (opcode == PUSH_u64) return 8;
+
+	return 0;
+}
+
+static uint8_t branch_opcode(uint8_t opcode)
+{
+	if (opcode == CJMP) return JMP_rel;
+	if (opcode == CJMPIF) return JMPIF_rel;
+
+	return CALL_rel;
+}
+
+static void write_be(uint8_t *dst, uint64_t v, size_t width)
+{
+	size_t i;
+
+	for (i=0; i<width; ++i) dst[i] = (v >> (8*(width - 1 - i))) & 0xFF;
+}
+
+/* first pass: find the translated address of every compact instruction */
+static int map_code(const uint8_t *src, size_t size, size_t *map)
+{
+	size_t i, out = 0;
+	uint64_t imm;
+	int64_t disp;
+
+	for (i=0; i<=size; ++i) map[i] = NOPC;
+
+	i = 0;
+	while (i < size) {
+		uint8_t opcode = src[i];
+		size_t width = push_width(opcode);
+
+		map[i++] = out;
+
+		if (opcode == PUSH_u8) {
+			if (i >= size) return -1;
+
+			++i;
+			out += 2;
+		} else if (width != 0) {
+			if (read_uleb(src, size, &i, &imm) != 0) return -1;
+			if (width < 8 && (imm >> (8*width)) != 0) return -1;
+
+			out += 1 + width;
+		} else if (opcode == CJMP || opcode == CJMPIF || opcode == CCALL) {
+			if (read_sleb(src, size, &i, &disp) != 0) return -1;
+
+			out += BRANCH_SIZE;
+		} else {
+			struct opinfo info;
+
+			if (describe_op(opcode, &info) != 0) return -1;
+			if (size - i < info.imm) return -1;
+
+			i += info.imm;
+			out += 1 + info.imm;
+		}
+	}
+	map[size] = out;
+
+	return 0;
+}
+
+/*
+ * copy the instruction at compact address at to dst, pointing an inline
+ * branch target at the translated address of the instruction it names
+ */
+static int relocate(const uint8_t *src, size_t size, size_t at,
+	const size_t *map, uint8_t *dst)
+{
+	struct opinfo info;
+	size_t target;
+	int64_t imm;
+
+	describe_op(src[at], &info);
+	memcpy(dst, src + at, 1 + info.imm);
+
+	if (branch_target(src, at, &info, &target) != 0) return 0;
+	if (target >= size || map[target] == NOPC) return -1;
+
+	if (info.flags & OP_REL) {
+		imm = (int64_t)map[target] - (int64_t)map[at];
+		if (imm < INT32_MIN || imm > INT32_MAX) return -1;
+	} else {
+		if (map[target] > UINT32_MAX) return -1;
+		imm = (int64_t)map[target];
+	}
+	write_be(dst + 1, (uint64_t)imm & 0xFFFFFFFF, 4);
+
+	return 0;
+}
+
+uint8_t* load_compact(const uint8_t *src, size_t size, size_t *code_size,
+	size_t *pcmap)
+{
+	struct opinfo info;
+	size_t i, out, *map;
+	uint8_t *code = NULL;
+	uint64_t imm;
+	int64_t disp;
+
+	map = pcmap != NULL ? pcmap : malloc((size + 1) * sizeof(size_t));
+	if (map == NULL) return NULL;
+
+	if (map_code(src, size, map) != 0) goto cleanup;
+
+	code = malloc(map[size] > 0 ? map[size] : 1);
+	if (code == NULL) goto cleanup;
+
+	i = 0;
+	out = 0;
+	while (i < size) {
+		size_t at = i;
+		uint8_t opcode = src[i++];
+		size_t width = push_width(opcode);
+
+		if (opcode == PUSH_u8) {
+			code[out++] = opcode;
+			code[out++] = src[i++];
+		} else if (width != 0) {
+			read_uleb(src, size, &i, &imm);
+
+			code[out++] = opcode;
+			write_be(code + out, imm, width);
+			out += width;
+		} else if (opcode == CJMP || opcode == CJMPIF || opcode == CCALL) {
+			size_t target;
+			int64_t rel;
+
+			read_sleb(src, size, &i, &disp);
+
+			target = at + (size_t)disp;
+			if (target >= size || map[target] == NOPC) goto fail;
+
+			rel = (int64_t)map[target] - (int64_t)out;
+			if (rel < INT32_MIN || rel > INT32_MAX) goto fail;
+
+			code[out++] = branch_opcode(opcode);
+			write_be(code + out, (uint64_t)rel & 0xFFFFFFFF, 4);
+			out += 4;
+		} else {
+			if (relocate(src, size, at, map, code + out) != 0) {
+				goto fail;
+			}
+
+			describe_op(opcode, &info);
+			i += info.imm;
+			out += 1 + info.imm;
+		}
+	}
+
+	if (code_size != NULL) *code_size = out;
+	if (pcmap == NULL) free(map);
+
+	return code;
+
+fail:
+	free(code);
+	code = NULL;
+cleanup:
+	if (pcmap == NULL) free(map);
+
+	return code;
+}
@@ -0,0 +1,227 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+/* struct frame's alignment, which C89 can't ask for directly */
+struct frame_align {
+	char c;
+	struct frame f;
+};
+#define FRAME_ALIGN offsetof(struct frame_align, f)
+
+/*
+ * A coroutine is just a context: its own data and control stacks, and
+ * registers. Switching to one saves the VM's registers where the
+ * coroutine will switch back to, and loads its own.
+ */
+struct coro {
+	struct context ctx; /* the coroutine's, while it is suspended */
+	struct context back; /* its resumer's, while it runs */
+	struct coro *caller; /* coroutine that resumed it, or NULL */
+	uint32_t handle;
+};
+
+static void save(VM *vm, struct context *ctx)
+{
+	ctx->stack = vm->stack;
+	ctx->frames = vm->frames;
+	ctx->pc = vm->pc;
+	ctx->sp = vm->sp;
+	ctx->fp = vm->fp;
+	ctx->csp = vm->csp;
+	ctx->stack_size = vm->stack_size;
+}
+
+static void load(VM *vm, const struct context *ctx)
+{
+	vm->stack = ctx->stack;
+	vm->frames = ctx->frames;
+	vm->pc = ctx->pc;
+	vm->sp = ctx->sp;
+	vm->fp = ctx->fp;
+	vm->csp = ctx->csp;
+	vm->stack_size = ctx->stack_size;
+}
+
+/* switch from the coroutine running back to its resumer */
+static void leave(VM *vm, uint64_t val, uint8_t yielded)
+{
+	struct coro *c = vm->coro;
+
+	save(vm, &c->ctx);
+	load(vm, &c->back);
+	vm->coro = c->caller;
+
+	PUSH_64(vm, val);
+	PUSH(vm, yielded);
+}
+
+static void free_coro(VM *vm, struct coro *c)
+{
+	vm->coros[c->handle] = NULL;
+	free(c->ctx.stack);
+	free(c);
+}
+
+int coro_new_op(VM *vm, size_t pc)
+{
+	struct context self;
+	struct coro *c;
+	uint32_t size, buf;
+	uint8_t argc;
+	size_t handle, frames;
+
+	POP_32(vm, size, buf);
+	argc = POP(vm);
+	vm->sp -= argc;
+
+	for (handle=0; handle<vm->coro_count; ++handle) {
+		if (vm->coros[handle] == NULL) break;
+	}
+	if (handle == vm->coro_count) {
+		struct coro **coros;
+		size_t count = vm->coro_count ? 2 * vm->coro_count : 16;
+
+		if (count > UINT32_MAX) return VM_FAULT;
+		coros = realloc(vm->coros, count * sizeof(struct coro*));
+		if (coros == NULL) return VM_FAULT;
+
+		memset(coros + vm->coro_count, 0,
+			(count - vm->coro_count) * sizeof(struct coro*));
+		vm->coros = coros;
+		vm->coro_count = count;
+	}
+
+	c = calloc(1, sizeof(struct coro));
+	if (c == NULL) return VM_FAULT;
+
+	/* the control stack goes after the data stack in one allocation */
+	frames = ((size_t)size + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+	c->ctx.stack = malloc(frames + MAX_FRAMES(size) * sizeof(struct frame));
+	if (c->ctx.stack == NULL) {
+		free(c);
+		return VM_FAULT;
+	}
+	c->ctx.frames = (struct frame*)(c->ctx.stack + frames);
+	c->ctx.stack_size = size;
+	c->ctx.pc = pc;
+	c->handle = handle;
+
+	/* lay out the call on the coroutine's stack, as if it were the VM's */
+	save(vm, &self);
+	load(vm, &c->ctx);
+	if (push_call(vm, self.stack + self.sp, argc, CORO_RETURN) != 0) {
+		load(vm, &self);
+		free(c->ctx.stack);
+		free(c);
+		return VM_FAULT;
+	}
+	save(vm, &c->ctx);
+	load(vm, &self);
+
+	vm->coros[handle] = c;
+	PUSH_32(vm, (uint32_t)handle);
+
+	return 0;
+}
+
+int resume_op(VM *vm)
+{
+	uint32_t handle, buf;
+	struct coro *c, *running;
+
+	POP_32(vm, handle, buf);
+	if (handle >= vm->coro_count || vm->coros[handle] == NULL) {
+		return VM_FAULT;
+	}
+	c = vm->coros[handle];
+
+	/* a coroutine can't resume itself or any coroutine resuming it */
+	for (running=vm->coro; running!=NULL; running=running->caller) {
+		if (running == c) return VM_FAULT;
+	}
+
+	save(vm, &c->back);
+	load(vm, &c->ctx);
+	c->caller = vm->coro;
+	vm->coro = c;
+
+	return 0;
+}
+
+int yield_op(VM *vm)
+{
+	uint64_t val, buf;
+
+	if (vm->coro == NULL) return VM_FAULT;
+
+	POP_64(vm, val, buf);
+	leave(vm, val, 1);
+
+	return 0;
+}
+
+void coro_exit(VM *vm)
+{
+	struct coro *c = vm->coro;
+
+	leave(vm, pop_result(vm, 0), 0);
+	free_coro(vm, c);
+}
+
+void coro_abort(VM *vm)
+{
+	struct coro *c = vm->coro;
+
+	load(vm, &c->back);
+	vm->coro = c->caller;
+	free_coro(vm, c);
+}
+
+int has_coros(VM *vm)
+{
+	size_t i;
+
+	for (i=0; i<vm->coro_count; ++i) {
+		if (vm->coros[i] != NULL) return 1;
+	}
+
+	return 0;
+}
+
+void free_coros(VM *vm)
+{
+	size_t i;
+
+	while (vm->coro != NULL) {
+		load(vm, &vm->coro->back);
+		vm->coro = vm->coro->caller;
+	}
+
+	for (i=0; i<vm->coro_count; ++i) {
+		if (vm->coros[i] != NULL) free_coro(vm, vm->coros[i]);
+	}
+	free(vm->coros);
+	vm->coros = NULL;
+	vm->coro_count = 0;
+}
@@ -0,0 +1,179 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <debug.h>
+#include "vm_internal.h"
+
+
+struct Debugger {
+	uint8_t *code; /* what attached VMs run, with TRAPs patched in */
+	uint8_t *orig; /* the code as given */
+	uint8_t *breaks; /* nonzero where a breakpoint is set */
+	size_t size;
+
+	/* what a stepping VM runs: every instruction start is patched */
+	uint8_t *step;
+
+	debug_fn fn;
+	void *arg;
+};
+
+Debugger* make_debugger(const uint8_t *code, size_t size, debug_fn fn,
+	void *arg)
+{
+	struct opinfo info;
+	size_t at;
+	Debugger *d = calloc(1, sizeof(Debugger));
+	if (d == NULL) return NULL;
+
+	d->code = malloc(size);
+	d->orig = malloc(size);
+	d->step = malloc(size);
+	d->breaks = calloc(size, 1);
+	if (d->code == NULL || d->orig == NULL || d->step == NULL
+		|| d->breaks == NULL) {
+		free_debugger(d);
+		return NULL;
+	}
+
+	memcpy(d->code, code, size);
+	memcpy(d->orig, code, size);
+	memcpy(d->step, code, size);
+	d->size = size;
+
+	for (at=0; at<size; at+=1+info.imm) {
+		if (describe_op(code[at], &info) != 0) break;
+		d->step[at] = TRAP;
+	}
+	d->fn = fn;
+	d->arg = arg;
+
+	return d;
+}
+
+void free_debugger(Debugger *d)
+{
+	free(d->code);
+	free(d->orig);
+	free(d->step);
+	free(d->breaks);
+	free(d);
+}
+
+uint8_t* debugger_code(Debugger *d)
+{
+	return d->code;
+}
+
+void vm_debug(VM *vm, Debugger *d, uint8_t *original)
+{
+	vm->debug = d;
+	vm->code = d != NULL ? d->code : original;
+}
+
+/* is pc where an instruction starts, going by a sweep from the top */
+static int insn_start(Debugger *d, size_t pc)
+{
+	struct opinfo info;
+	size_t at = 0;
+
+	while (at < pc) {
+		if (describe_op(d->orig[at], &info) != 0) return 0;
+		at += 1 + info.imm;
+	}
+
+	return at == pc;
+}
+
+int set_breakpoint(Debugger *d, size_t pc)
+{
+	if (pc >= d->size || !insn_start(d, pc)) return -1;
+
+	d->breaks[pc] = 1;
+	d->code[pc] = TRAP;
+
+	return 0;
+}
+
+int clear_breakpoint(Debugger *d, size_t pc)
+{
+	if (pc >= d->size || !d->breaks[pc]) return -1;
+
+	d->breaks[pc] = 0;
+	d->code[pc] = d->orig[pc];
+
+	return 0;
+}
+
+int trap_op(VM *vm, uint8_t *opcode)
+{
+	Debugger *d = vm->debug;
+	size_t at = vm->pc - 1;
+	int action;
+
+	if (d == NULL || at >= d->size || d->orig[at] == TRAP) return VM_FAULT;
+
+	/* run_vm goes on to run what the trap covers */
+	*opcode = d->orig[at];
+
+	/* resuming from a DEBUG_STOP at this trap */
+	if (vm->resume == at + 1) {
+		vm->resume = 0;
+		return 0;
+	}
+
+	vm->pc = at;
+	action = d->fn(vm, at, d->arg);
+	vm->pc = at + 1;
+
+	/*
+	 * only this VM switches, so others sharing d run on untouched. A
+	 * stop keeps the code it has, so resuming lands on this trap again.
+	 */
+	if (action == DEBUG_STEP) {
+		vm->code = d->step;
+	} else if (action == DEBUG_CONTINUE) {
+		vm->code = d->code;
+	}
+
+	if (action == DEBUG_STOP) {
+		vm->pc = at;
+		vm->resume = at + 1;
+		return VM_BREAK;
+	}
+
+	return 0;
+}
+
+void vm_get_regs(VM *vm, struct vm_regs *regs)
+{
+	regs->pc = vm->pc;
+	regs->sp = vm->sp;
+	regs->fp = vm->fp;
+	regs->csp = vm->csp;
+}
+
+const uint8_t* vm_stack(VM *vm, size_t *sp)
+{
+	*sp = vm->sp;
+
+	return vm->stack;
+}
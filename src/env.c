@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <vm.h>
+#include "vm_internal.h"
+
+
+uint8_t* env_ptr(VM *vm, uint64_t addr, size_t len, int write)
+{
+	struct window *w;
+	size_t i;
+
+	if (addr < vm->env_size) {
+		return len <= vm->env_size - addr ? vm->env + addr : NULL;
+	}
+
+	for (i=0; i<vm->window_count; ++i) {
+		w = &vm->windows[i];
+		if (addr < w->addr || addr - w->addr >= w->len) continue;
+
+		if (len > w->len - (addr - w->addr)) return NULL;
+		if (write && !(w->flags & VM_ENV_WRITE)) return NULL;
+
+		return w->buf + (addr - w->addr);
+	}
+
+	return NULL;
+}
+
+void* atomic_ptr(VM *vm, uint64_t addr, size_t len, int write)
+{
+	uint8_t *p = env_ptr(vm, addr, len, write);
+
+	if (p == NULL || (uintptr_t)p % len != 0) return NULL;
+
+	return p;
+}
+
+int vm_bind_env(VM *vm, size_t addr, void *buf, size_t len, int flags)
+{
+	struct window *windows;
+	size_t i;
+
+	if (len == 0 || addr < vm->env_size || addr + len < addr) return -1;
+
+	for (i=0; i<vm->window_count; ++i) {
+		struct window *w = &vm->windows[i];
+
+		if (addr < w->addr + w->len && w->addr < addr + len) return -1;
+	}
+
+	windows = realloc(vm->windows,
+		(vm->window_count + 1) * sizeof(struct window));
+	if (windows == NULL) return -1;
+
+	windows[vm->window_count].addr = addr;
+	windows[vm->window_count].len = len;
+	windows[vm->window_count].buf = buf;
+	windows[vm->window_count].flags = flags;
+
+	vm->windows = windows;
+	++vm->window_count;
+
+	return 0;
+}
+
+int vm_unbind_env(VM *vm, size_t addr)
+{
+	size_t i;
+
+	for (i=0; i<vm->window_count; ++i) {
+		if (vm->windows[i].addr != addr) continue;
+
+		--vm->window_count;
+		memmove(vm->windows + i, vm->windows + i + 1,
+			(vm->window_count - i) * sizeof(struct window));
+
+		return 0;
+	}
+
+	return -1;
+}
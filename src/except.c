@@ -0,0 +1,96 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include "vm_internal.h"
+
+
+/* read one of the big-endian words a CALL_* header is made of */
+static size_t get_word(const uint8_t *p)
+{
+	uint64_t v = 0;
+	size_t i;
+
+	for (i=0; i<8; ++i) v = v << 8 | p[i];
+
+	return v;
+}
+
+int unwind(VM *vm)
+{
+	const struct try_entry *t;
+	size_t i, fp, ret, pc = vm->pc - 1;
+
+	while (1) {
+		for (i=0; i<vm->try_count; ++i) {
+			t = &vm->tries[i];
+			if (pc < t->start || pc >= t->end) continue;
+
+			vm->sp = vm->fp + t->depth;
+			vm->pc = t->handler;
+			PUSH_64(vm, vm->exception);
+
+			return 0;
+		}
+
+		/* code run_vm was started on directly has no frame to pop */
+		if (vm->fp == 0) return -1;
+
+		/*
+		 * FCALL only reserves the header, so a frame is known to be one
+		 * of its frames by the control stack naming it
+		 */
+		fp = vm->fp;
+		if (vm->csp > 0 && vm->frames[vm->csp-1].self == fp) {
+			--vm->csp;
+			ret = vm->frames[vm->csp].pc;
+			vm->fp = vm->frames[vm->csp].fp;
+		} else {
+			ret = get_word(vm->stack + fp - FRAME_HEADER);
+			vm->fp = get_word(vm->stack + fp - 8);
+		}
+		vm->sp = fp - FRAME_HEADER - 1 - vm->stack[fp - FRAME_HEADER - 1];
+
+		while (MEMO_PENDING(ret)) ret = memo_abandon(vm, ret);
+
+		if (ret == HOST_RETURN) {
+			vm->pc = ret;
+			return -1;
+		}
+
+		/* a coroutine ends, and its resumer throws from RESUME */
+		if (ret == CORO_RETURN) {
+			coro_abort(vm);
+			ret = vm->pc;
+		}
+
+		vm->pc = ret;
+		pc = ret - 1;
+	}
+}
+
+void vm_set_try_table(VM *vm, const struct try_entry *entries, size_t count)
+{
+	vm->tries = entries;
+	vm->try_count = count;
+}
+
+uint64_t vm_exception(VM *vm)
+{
+	return vm->exception;
+}
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vm_internal.h"
+
+
+int replace_file_with(const char *path, int (*fill)(int fd, void *arg),
+	void *arg)
+{
+	int fd, ret = -1;
+	char *tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (tmp == NULL) return -1;
+
+	/* a name of its own, so writers racing on path can't share one */
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) goto cleanup;
+
+	/* mkstemp makes it private; keep what open(..., 0644) gave */
+	ret = fchmod(fd, 0644) == 0 ? fill(fd, arg) : -1;
+	if (close(fd) != 0) ret = -1;
+
+	if (ret == 0) ret = rename(tmp, path);
+	if (ret != 0) unlink(tmp);
+
+cleanup:
+	free(tmp);
+
+	return ret;
+}
+
+struct buffer {
+	const uint8_t *p;
+	size_t len;
+};
+
+static int write_buffer(int fd, void *arg)
+{
+	struct buffer *b = arg;
+	ssize_t n;
+
+	for (; b->len > 0; b->p += n, b->len -= n) {
+		n = write(fd, b->p, b->len);
+		if (n < 0) return -1;
+	}
+
+	return 0;
+}
+
+int replace_file(const char *path, const void *buf, size_t len)
+{
+	struct buffer b;
+
+	b.p = buf;
+	b.len = len;
+
+	return replace_file_with(path, write_buffer, &b);
+}
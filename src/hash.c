@@ -0,0 +1,130 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <string.h>
+#include "vm_internal.h"
+
+
+#define PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME3 UINT64_C(0x165667B19E3779F9)
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* read 8 bytes little-endian so hashes agree across hosts */
+static uint64_t read_64(const uint8_t *p)
+{
+	uint64_t w;
+
+	memcpy(&w, p, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+
+	return w;
+}
+
+/* murmur3's finalizer: every input bit affects every output bit */
+static uint64_t fmix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= UINT64_C(0xFF51AFD7ED558CCD);
+	x ^= x >> 33;
+	x *= UINT64_C(0xC4CEB9FE1A85EC53);
+	x ^= x >> 33;
+
+	return x;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = buf;
+	uint64_t h = seed ^ (len * PRIME1);
+	uint64_t w;
+	size_t i;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		w = read_64(p) * PRIME2;
+		h ^= ROTL(w, 31) * PRIME1;
+		h = ROTL(h, 27) * PRIME1 + PRIME3;
+	}
+
+	w = 0;
+	for (i=0; i<len; ++i) w |= (uint64_t)p[i] << (8*i);
+	h ^= w * PRIME2;
+
+	return fmix64(h);
+}
+
+/* reflected Castagnoli polynomial, as the SSE4.2 crc32 instruction uses */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i=0; i<256; ++i) {
+		crc = i;
+		for (k=0; k<8; ++k) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	while (len--) crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	while (len--) c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+
+	return (uint32_t)c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) return ~crc32c_hw(crc, buf, len);
+#endif
+
+	return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,256 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <vm.h>
+#include "vm_internal.h"
+
+
+#define ROOM(vm, n) ((vm)->stack_size - (vm)->sp >= (size_t)(n))
+
+int vm_push_u8(VM *vm, uint8_t v)
+{
+	if (!ROOM(vm, 1)) return -1;
+
+	PUSH(vm, v);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_push_u16(VM *vm, uint16_t v)
+{
+	if (!ROOM(vm, 2)) return -1;
+
+	PUSH_16(vm, v);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_push_u32(VM *vm, uint32_t v)
+{
+	if (!ROOM(vm, 4)) return -1;
+
+	PUSH_32(vm, v);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_push_u64(VM *vm, uint64_t v)
+{
+	if (!ROOM(vm, 8)) return -1;
+
+	PUSH_64(vm, v);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_push_f(VM *vm, float v)
+{
+	return vm_push_u32(vm, serialize_float(v));
+}
+
+int vm_push_d(VM *vm, double v)
+{
+	return vm_push_u64(vm, serialize_double(v));
+}
+
+int vm_pop_u8(VM *vm, uint8_t *v)
+{
+	if (vm->sp < 1) return -1;
+
+	*v = POP(vm);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_pop_u16(VM *vm, uint16_t *v)
+{
+	uint16_t buf;
+
+	if (vm->sp < 2) return -1;
+
+	POP_16(vm, *v, buf);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_pop_u32(VM *vm, uint32_t *v)
+{
+	uint32_t buf;
+
+	if (vm->sp < 4) return -1;
+
+	POP_32(vm, *v, buf);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_pop_u64(VM *vm, uint64_t *v)
+{
+	uint64_t buf;
+
+	if (vm->sp < 8) return -1;
+
+	POP_64(vm, *v, buf);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int vm_pop_f(VM *vm, float *v)
+{
+	uint32_t x;
+
+	if (vm_pop_u32(vm, &x) != 0) return -1;
+	*v = deserialize_float(x);
+
+	return 0;
+}
+
+int vm_pop_d(VM *vm, double *v)
+{
+	uint64_t x;
+
+	if (vm_pop_u64(vm, &x) != 0) return -1;
+	*v = deserialize_double(x);
+
+	return 0;
+}
+
+int vm_env_read(VM *vm, size_t addr, void *buf, size_t len)
+{
+	uint8_t *p = env_ptr(vm, addr, len, 0);
+	if (p == NULL) return -1;
+
+	memcpy(buf, p, len);
+
+	return 0;
+}
+
+int vm_env_write(VM *vm, size_t addr, const void *buf, size_t len)
+{
+	uint8_t *p = env_ptr(vm, addr, len, 1);
+	if (p == NULL) return -1;
+
+	memcpy(p, buf, len);
+	vm->dirty = 1;
+
+	return 0;
+}
+
+int push_call(VM *vm, const uint8_t *args, uint8_t nargs, size_t ret)
+{
+	if (!ROOM(vm, nargs + 1 + FRAME_HEADER)) return -1;
+
+	if (nargs > 0) memcpy(vm->stack + vm->sp, args, nargs);
+	vm->sp += nargs;
+	PUSH(vm, nargs);
+
+	/*
+	 * write both a CALL_* header and an FCALL control frame, so the
+	 * callee may return with whichever convention it was written for
+	 */
+	PUSH_64(vm, (uint64_t)ret);
+	PUSH_64(vm, vm->fp);
+	vm->frames[vm->csp].pc = ret;
+	vm->frames[vm->csp].fp = vm->fp;
+	vm->frames[vm->csp].self = vm->sp;
+	++vm->csp;
+
+	vm->fp = vm->sp;
+
+	return 0;
+}
+
+uint64_t pop_result(VM *vm, size_t base)
+{
+	uint64_t result = 0;
+	size_t n;
+
+	for (n=0; n<8 && vm->sp > base; ++n) {
+		result |= (uint64_t)POP(vm) << (8*n);
+	}
+
+	return result;
+}
+
+int begin_call(VM *vm, const uint8_t *args, uint8_t nargs,
+	struct host_call *call)
+{
+	if (vm->call_suspended) return -1;
+
+	call->base = vm->sp;
+	call->pc = vm->pc;
+	call->fp = vm->fp;
+	call->csp = vm->csp;
+
+	return push_call(vm, args, nargs, HOST_RETURN);
+}
+
+int end_call(VM *vm, int status, const struct host_call *call,
+	uint64_t *result)
+{
+	/* the callee is still mid-frame, to be finished by vm_call_resume */
+	if (status == VM_BLOCKED || status == VM_BREAK) {
+		vm->call = *call;
+		vm->call_suspended = 1;
+		return status;
+	}
+	vm->call_suspended = 0;
+
+	if (status == VM_RETURN) {
+		if (result != NULL) *result = pop_result(vm, call->base);
+	} else {
+		/* drop whatever the callee left when it stopped */
+		vm->sp = call->base;
+		vm->fp = call->fp;
+	}
+
+	vm->pc = call->pc;
+	vm->csp = call->csp;
+	vm->dirty = 1;
+
+	return status;
+}
+
+int vm_call(VM *vm, size_t pc, const uint8_t *args, uint8_t nargs,
+	uint64_t *result)
+{
+	struct host_call call;
+
+	if (begin_call(vm, args, nargs, &call) != 0) return -1;
+
+	return end_call(vm, run_vm(vm, NULL, pc), &call, result);
+}
+
+int vm_call_resume(VM *vm, size_t pc, uint64_t *result)
+{
+	struct host_call call = vm->call;
+
+	if (!vm->call_suspended) return -1;
+
+	return end_call(vm, run_vm(vm, NULL, pc), &call, result);
+}
@@ -0,0 +1,295 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vm.h>
+#include "vm_internal.h"
+
+
+#define IMAGE_MAGIC "STKRIMG"
+#define IMAGE_VERSION 2
+
+#define ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * An image is this header followed by the control stack, then the env and
+ * the data stack, each starting on a page boundary so they can be mapped in
+ * place. Fields are native-endian: images only move between like hosts.
+ */
+struct image_header {
+	char magic[8];
+	uint64_t version;
+
+	uint64_t pc;
+	uint64_t sp;
+	uint64_t fp;
+	uint64_t csp;
+
+	uint64_t stack_size;
+	uint64_t env_size;
+
+	uint64_t env_off;
+	uint64_t stack_off;
+	uint64_t size; /* of the whole image */
+};
+
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, off);
+		if (n < 0) return -1;
+
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_image(VM *vm, int fd)
+{
+	struct image_header h;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t frames_size = vm->csp * sizeof(struct frame);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	h.version = IMAGE_VERSION;
+	h.pc = vm->pc;
+	h.sp = vm->sp;
+	h.fp = vm->fp;
+	h.csp = vm->csp;
+	h.stack_size = vm->stack_size;
+	h.env_size = vm->env_size;
+	h.env_off = ALIGN(sizeof(h) + frames_size, page);
+	h.stack_off = ALIGN(h.env_off + vm->env_size, page);
+	h.size = ALIGN(h.stack_off + vm->stack_size, page);
+
+	/* only the live part of the stack is written, the rest is a hole */
+	if (ftruncate(fd, h.size) != 0) return -1;
+	if (write_all(fd, &h, sizeof(h), 0) != 0) return -1;
+	if (write_all(fd, vm->frames, frames_size, sizeof(h)) != 0) return -1;
+	if (write_all(fd, vm->env, vm->env_size, h.env_off) != 0) return -1;
+	if (write_all(fd, vm->stack, vm->sp, h.stack_off) != 0) return -1;
+
+	return 0;
+}
+
+/* check that everything h describes lies inside its image */
+static int valid_header(const struct image_header *h)
+{
+	uint64_t frames_end;
+
+	if (h->stack_size > h->size || h->env_size > h->size) return 0;
+	if (h->sp > h->stack_size || h->fp > h->stack_size) return 0;
+	if (h->csp > MAX_FRAMES(h->stack_size)) return 0;
+
+	frames_end = sizeof(*h) + h->csp * sizeof(struct frame);
+
+	return frames_end <= h->env_off
+		&& h->env_off <= h->size
+		&& h->env_size <= h->size - h->env_off
+		&& h->env_off + h->env_size <= h->stack_off
+		&& h->stack_off <= h->size
+		&& h->stack_size <= h->size - h->stack_off;
+}
+
+static VM* map_image(int fd, uint8_t *code)
+{
+	struct image_header *h;
+	struct stat st;
+	uint8_t *map;
+	VM *vm;
+
+	if (fstat(fd, &st) != 0) return NULL;
+	if ((size_t)st.st_size < sizeof(*h)) return NULL;
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return NULL;
+
+	h = (struct image_header*)map;
+	if (memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0
+		|| h->version != IMAGE_VERSION
+		|| h->size != (uint64_t)st.st_size
+		|| !valid_header(h)) goto cleanup;
+
+	vm = calloc(1, sizeof(VM));
+	if (vm == NULL) goto cleanup;
+
+	vm->frames = malloc(MAX_FRAMES(h->stack_size) * sizeof(struct frame));
+	if (vm->frames == NULL) {
+		free(vm);
+		goto cleanup;
+	}
+	memcpy(vm->frames, map + sizeof(*h), h->csp * sizeof(struct frame));
+
+	vm->env = map + h->env_off;
+	vm->stack = map + h->stack_off;
+	vm->code = code;
+	vm->stack_size = h->stack_size;
+	vm->env_size = h->env_size;
+	vm->pc = h->pc;
+	vm->sp = h->sp;
+	vm->fp = h->fp;
+	vm->csp = h->csp;
+	vm->map = map;
+	vm->map_size = h->size;
+	vm->image_fd = -1;
+
+	return vm;
+
+cleanup:
+	munmap(map, st.st_size);
+
+	return NULL;
+}
+
+static int write_snapshot(int fd, void *vm)
+{
+	if (write_image(vm, fd) != 0) return -1;
+
+	return fsync(fd);
+}
+
+int vm_snapshot(VM *vm, const char *path)
+{
+	/* images hold no coroutine, child or pending PURE call state */
+	if (has_coros(vm) || has_tasks(vm) || has_pending(vm)) return -1;
+
+	/* a VM restored from path keeps its clean pages from the old file */
+	return replace_file_with(path, write_snapshot, vm);
+}
+
+VM* vm_restore(const char *path, uint8_t *code)
+{
+	VM *vm;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	/* the mapping keeps the file alive, so we don't need the fd */
+	vm = map_image(fd, code);
+	close(fd);
+
+	return vm;
+}
+
+/* move vm's env and stack into a fresh image that clones can map */
+static int seal(VM *vm)
+{
+	VM *tmp;
+	int fd = memfd_create("stacker-vm", MFD_CLOEXEC);
+	if (fd < 0) return -1;
+
+	if (write_image(vm, fd) != 0) goto cleanup;
+
+	tmp = map_image(fd, vm->code);
+	if (tmp == NULL) goto cleanup;
+
+	/* the mapping holds the same bytes, so vm can simply switch to it */
+	if (vm->map != NULL) {
+		munmap(vm->map, vm->map_size);
+	} else {
+		free(vm->stack);
+		free(vm->env);
+	}
+	if (vm->image_fd >= 0) close(vm->image_fd);
+
+	vm->env = tmp->env;
+	vm->stack = tmp->stack;
+	vm->map = tmp->map;
+	vm->map_size = tmp->map_size;
+	vm->image_fd = fd;
+	vm->dirty = 0;
+
+	free(tmp->frames);
+	free(tmp);
+
+	return 0;
+
+cleanup:
+	close(fd);
+
+	return -1;
+}
+
+VM* vm_clone(VM *vm)
+{
+	VM *clone;
+	size_t size = vm->window_count * sizeof(struct window);
+
+	/* their stacks live outside the image, so they can't come along */
+	if (has_coros(vm) || has_tasks(vm)) return NULL;
+
+	if (vm->image_fd < 0 || vm->dirty) {
+		if (seal(vm) != 0) return NULL;
+	}
+
+	clone = map_image(vm->image_fd, vm->code);
+	if (clone == NULL) return NULL;
+
+	/*
+	 * windows and channels are host objects the clone shares; ports
+	 * have one reader and one writer, so they stay vm's
+	 */
+	if (size != 0) {
+		clone->windows = malloc(size);
+		if (clone->windows == NULL) goto cleanup;
+
+		memcpy(clone->windows, vm->windows, size);
+		clone->window_count = vm->window_count;
+	}
+
+	size = vm->channel_count * sizeof(Channel*);
+	if (size != 0) {
+		clone->channels = malloc(size);
+		if (clone->channels == NULL) goto cleanup;
+
+		memcpy(clone->channels, vm->channels, size);
+		clone->channel_count = vm->channel_count;
+	}
+	if (copy_pending(clone, vm) != 0) goto cleanup;
+	clone->memo = vm->memo;
+	inherit_syscall_log(clone, vm);
+	clone->call = vm->call;
+	clone->call_suspended = vm->call_suspended;
+	clone->pool = vm->pool;
+	clone->tries = vm->tries;
+	clone->try_count = vm->try_count;
+	clone->debug = vm->debug;
+	clone->slot = vm->slot;
+	clone->version = vm->version;
+	if (clone->version != NULL) code_ref(clone->version);
+
+	return clone;
+
+cleanup:
+	free_vm(clone);
+
+	return NULL;
+}
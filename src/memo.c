@@ -0,0 +1,349 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memo.h>
+#include <reload.h>
+#include "vm_internal.h"
+
+#define WAYS 4
+
+struct entry {
+	uint64_t hash;
+	const uint8_t *code; /* the code pc is in */
+	uint64_t version; /* and its version, if it came from a CodeSlot */
+	size_t pc; /* the PURE opcode */
+	uint8_t full;
+	uint8_t argc;
+	uint8_t width;
+	uint8_t args[MEMO_ARGS];
+	uint8_t value[MEMO_VALUE];
+};
+
+/* a set of WAYS entries is picked by hash, and evicted round-robin */
+struct Memo {
+	pthread_mutex_t lock;
+	size_t mask;
+	struct entry *entries;
+	uint8_t *victims;
+	struct memo_stats stats;
+};
+
+/* a call that missed, waiting to return its result to the cache */
+struct pending {
+	size_t ret; /* where the frame really returns to */
+	size_t next; /* next free pending + 1, while this one is free */
+	int used;
+	struct entry key;
+};
+
+Memo* make_memo(size_t entries)
+{
+	Memo *m;
+	size_t sets = 1;
+
+	while (sets * WAYS < entries) sets <<= 1;
+
+	m = calloc(1, sizeof(Memo));
+	if (m == NULL) return NULL;
+
+	m->entries = calloc(sets * WAYS, sizeof(struct entry));
+	m->victims = calloc(sets, 1);
+	if (m->entries == NULL || m->victims == NULL) {
+		free(m->entries);
+		free(m->victims);
+		free(m);
+		return NULL;
+	}
+	m->mask = sets - 1;
+	pthread_mutex_init(&m->lock, NULL);
+
+	return m;
+}
+
+void free_memo(Memo *m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m->entries);
+	free(m->victims);
+	free(m);
+}
+
+void memo_clear(Memo *m)
+{
+	pthread_mutex_lock(&m->lock);
+	memset(m->entries, 0, (m->mask + 1) * WAYS * sizeof(struct entry));
+	memset(&m->stats, 0, sizeof(m->stats));
+	pthread_mutex_unlock(&m->lock);
+}
+
+void memo_stats(Memo *m, struct memo_stats *stats)
+{
+	pthread_mutex_lock(&m->lock);
+	*stats = m->stats;
+	pthread_mutex_unlock(&m->lock);
+}
+
+void vm_attach_memo(VM *vm, Memo *m)
+{
+	vm->memo = m;
+}
+
+static int same_key(const struct entry *a, const struct entry *b)
+{
+	return a->full && a->hash == b->hash && a->pc == b->pc
+		&& a->code == b->code && a->version == b->version
+		&& a->argc == b->argc && a->width == b->width
+		&& memcmp(a->args, b->args, a->argc) == 0;
+}
+
+/* copy the result cached for key into value, returning 0 on a hit */
+static int lookup(Memo *m, const struct entry *key, uint8_t *value)
+{
+	struct entry *set = m->entries + (key->hash & m->mask) * WAYS;
+	int i;
+
+	pthread_mutex_lock(&m->lock);
+	for (i=0; i<WAYS; ++i) {
+		if (!same_key(&set[i], key)) continue;
+
+		memcpy(value, set[i].value, key->width);
+		++m->stats.hits;
+		pthread_mutex_unlock(&m->lock);
+
+		return 0;
+	}
+	++m->stats.misses;
+	pthread_mutex_unlock(&m->lock);
+
+	return -1;
+}
+
+static void insert(Memo *m, const struct entry *e)
+{
+	size_t at = e->hash & m->mask;
+	struct entry *set = m->entries + at * WAYS;
+	int i;
+
+	pthread_mutex_lock(&m->lock);
+
+	/* another VM may have cached the same call meanwhile */
+	for (i=0; i<WAYS; ++i) {
+		if (!set[i].full || same_key(&set[i], e)) break;
+	}
+	if (i == WAYS) {
+		i = m->victims[at]++ % WAYS;
+		++m->stats.evictions;
+	}
+	set[i] = *e;
+
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* return from the frame at fp with the width bytes at value */
+static void memo_ret(VM *vm, const uint8_t *value, uint8_t width)
+{
+	size_t fp = vm->fp;
+	uint64_t buf;
+	uint8_t argc;
+
+	if (vm->csp > 0 && vm->frames[vm->csp-1].self == fp) {
+		vm->sp = fp - FRAME_HEADER;
+		--vm->csp;
+		vm->pc = vm->frames[vm->csp].pc;
+		vm->fp = vm->frames[vm->csp].fp;
+	} else {
+		vm->sp = fp;
+		POP_64(vm, vm->fp, buf);
+		POP_64(vm, vm->pc, buf);
+	}
+
+	argc = POP(vm);
+	vm->sp -= argc;
+
+	memcpy(vm->stack + vm->sp, value, width);
+	vm->sp += width;
+}
+
+static void set_word(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i=7; i>=0; --i) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+static uint64_t get_word(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i=0; i<8; ++i) v = v << 8 | p[i];
+
+	return v;
+}
+
+/* a free pending, or MAX_PENDING if every one is in use */
+static size_t take_pending(VM *vm)
+{
+	struct pending *pending;
+	size_t i, size;
+
+	if (vm->pending_free == 0) {
+		if (vm->pending_size == MAX_PENDING) return MAX_PENDING;
+
+		size = vm->pending_size > 0 ? vm->pending_size * 2 : 16;
+		if (size > MAX_PENDING) size = MAX_PENDING;
+
+		pending = realloc(vm->pending, size * sizeof(struct pending));
+		if (pending == NULL) return MAX_PENDING;
+
+		for (i=vm->pending_size; i<size; ++i) {
+			pending[i].used = 0;
+			pending[i].next = i + 1 < size ? i + 2 : 0;
+		}
+		vm->pending = pending;
+		vm->pending_free = vm->pending_size + 1;
+		vm->pending_size = size;
+	}
+
+	i = vm->pending_free - 1;
+	vm->pending_free = vm->pending[i].next;
+	vm->pending[i].used = 1;
+
+	return i;
+}
+
+static void give_pending(VM *vm, size_t i)
+{
+	vm->pending[i].used = 0;
+	vm->pending[i].next = vm->pending_free;
+	vm->pending_free = i + 1;
+}
+
+int pure_op(VM *vm)
+{
+	uint8_t value[MEMO_VALUE];
+	struct entry key;
+	struct pending *p;
+	size_t i, fp = vm->fp;
+	uint8_t *args;
+
+	key.code = vm->code;
+	key.version = vm->version != NULL ? code_version(vm->version) : 0;
+	key.pc = vm->pc - 1;
+	key.full = 1;
+	key.width = GETCODE(vm);
+
+	/* code run_vm was started on directly has no frame to return from */
+	if (vm->memo == NULL || fp == 0) return 0;
+
+	key.argc = vm->stack[fp - FRAME_HEADER - 1];
+	if (key.argc > MEMO_ARGS || key.width > MEMO_VALUE) return 0;
+
+	args = vm->stack + fp - FRAME_HEADER - 1 - key.argc;
+	memcpy(key.args, args, key.argc);
+	key.hash = hash64(key.args, key.argc, (key.pc << 8 | key.argc)
+		^ (size_t)key.code ^ key.version << 32);
+
+	if (lookup(vm->memo, &key, value) == 0) {
+		memo_ret(vm, value, key.width);
+		return 0;
+	}
+
+	i = take_pending(vm);
+	if (i == MAX_PENDING) return 0;
+
+	/* send the frame's return through memo_return to catch its result */
+	p = &vm->pending[i];
+	p->key = key;
+
+	if (vm->csp > 0 && vm->frames[vm->csp-1].self == fp) {
+		p->ret = vm->frames[vm->csp-1].pc;
+		vm->frames[vm->csp-1].pc = MEMO_RETURN - i;
+	} else {
+		p->ret = get_word(vm->stack + fp - FRAME_HEADER);
+		set_word(vm->stack + fp - FRAME_HEADER, MEMO_RETURN - i);
+	}
+
+	return 0;
+}
+
+int memo_return(VM *vm)
+{
+	size_t i = MEMO_RETURN - vm->pc;
+	struct pending *p;
+
+	/* a frame from an image, whose pending calls weren't saved */
+	if (i >= vm->pending_size || !vm->pending[i].used) return -1;
+
+	p = &vm->pending[i];
+	if (vm->memo != NULL && vm->sp >= p->key.width) {
+		memcpy(p->key.value, vm->stack + vm->sp - p->key.width,
+			p->key.width);
+		insert(vm->memo, &p->key);
+	}
+
+	vm->pc = p->ret;
+	give_pending(vm, i);
+
+	return 0;
+}
+
+size_t memo_abandon(VM *vm, size_t ret)
+{
+	size_t i = MEMO_RETURN - ret;
+
+	if (i >= vm->pending_size || !vm->pending[i].used) return HOST_RETURN;
+
+	ret = vm->pending[i].ret;
+	give_pending(vm, i);
+
+	return ret;
+}
+
+int has_pending(VM *vm)
+{
+	size_t i;
+
+	for (i=0; i<vm->pending_size; ++i) {
+		if (vm->pending[i].used) return 1;
+	}
+
+	return 0;
+}
+
+int copy_pending(VM *dst, VM *src)
+{
+	if (src->pending_size == 0) return 0;
+
+	dst->pending = malloc(src->pending_size * sizeof(struct pending));
+	if (dst->pending == NULL) return -1;
+
+	memcpy(dst->pending, src->pending,
+		src->pending_size * sizeof(struct pending));
+	dst->pending_size = src->pending_size;
+	dst->pending_free = src->pending_free;
+
+	return 0;
+}
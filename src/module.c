@@ -0,0 +1,448 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <compact.h>
+#include <module.h>
+#include "vm_internal.h"
+
+
+#define MODULE_MAGIC "STKRMOD"
+
+#define HEADER_SIZE 32
+#define SECTION_SIZE 32
+#define SYMBOL_SIZE 16
+#define TRY_SIZE 32
+
+#define SECTION_COUNT 5
+
+struct Module {
+	uint8_t *map;
+	size_t map_size;
+
+	/* each section's checksum, and the sections verified so far */
+	uint64_t sums[SECTION_TRY + 1];
+	unsigned checked;
+
+	uint8_t *code;
+	size_t code_size;
+	int compact; /* code was translated into a buffer we own */
+
+	const uint8_t *data;
+	size_t data_size;
+
+	struct symbol *symbols;
+	size_t symbol_count;
+
+	struct try_entry *tries;
+	size_t try_count;
+};
+
+static uint32_t get_32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+		| (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static uint64_t get_64(const uint8_t *p)
+{
+	return (uint64_t)get_32(p) << 32 | get_32(p + 4);
+}
+
+static void put_32(uint8_t *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static void put_64(uint8_t *p, uint64_t v)
+{
+	put_32(p, v >> 32);
+	put_32(p + 4, v & 0xFFFFFFFF);
+}
+
+static uint8_t* put_section(uint8_t *entry, uint32_t type, size_t off,
+	size_t size)
+{
+	put_32(entry, type);
+	put_32(entry + 4, 0);
+	put_64(entry + 8, off);
+	put_64(entry + 16, size);
+
+	return entry + SECTION_SIZE;
+}
+
+int write_module(const char *path, const struct module_desc *desc)
+{
+	size_t i, size, strings_size = 0;
+	size_t code_off, data_off, symbols_off, strings_off, try_off;
+	uint8_t *buf, *p, *names;
+	int ret;
+
+	for (i=0; i<desc->symbol_count; ++i) {
+		strings_size += strlen(desc->symbols[i].name) + 1;
+	}
+
+	code_off = HEADER_SIZE + SECTION_COUNT * SECTION_SIZE;
+	data_off = code_off + desc->code_size;
+	symbols_off = data_off + desc->data_size;
+	strings_off = symbols_off + desc->symbol_count * SYMBOL_SIZE;
+	try_off = strings_off + strings_size;
+	size = try_off + desc->try_count * TRY_SIZE;
+
+	buf = malloc(size);
+	if (buf == NULL) return -1;
+
+	memcpy(buf, MODULE_MAGIC, sizeof(MODULE_MAGIC));
+	put_32(buf + 8, MODULE_VERSION);
+	put_32(buf + 12, desc->flags);
+	put_32(buf + 24, SECTION_COUNT);
+	put_32(buf + 28, 0);
+
+	p = buf + HEADER_SIZE;
+	p = put_section(p, SECTION_CODE, code_off, desc->code_size);
+	p = put_section(p, SECTION_DATA, data_off, desc->data_size);
+	p = put_section(p, SECTION_SYMBOLS, symbols_off,
+		desc->symbol_count * SYMBOL_SIZE);
+	p = put_section(p, SECTION_STRINGS, strings_off, strings_size);
+	put_section(p, SECTION_TRY, try_off, desc->try_count * TRY_SIZE);
+
+	memcpy(buf + code_off, desc->code, desc->code_size);
+	if (desc->data_size > 0) {
+		memcpy(buf + data_off, desc->data, desc->data_size);
+	}
+
+	p = buf + symbols_off;
+	names = buf + strings_off;
+	for (i=0; i<desc->symbol_count; ++i, p += SYMBOL_SIZE) {
+		size_t len = strlen(desc->symbols[i].name) + 1;
+
+		put_64(p, desc->symbols[i].pc);
+		put_32(p + 8, desc->symbols[i].flags);
+		put_32(p + 12, names - (buf + strings_off));
+
+		memcpy(names, desc->symbols[i].name, len);
+		names += len;
+	}
+
+	p = buf + try_off;
+	for (i=0; i<desc->try_count; ++i, p += TRY_SIZE) {
+		put_64(p, desc->tries[i].start);
+		put_64(p + 8, desc->tries[i].end);
+		put_64(p + 16, desc->tries[i].handler);
+		put_64(p + 24, desc->tries[i].depth);
+	}
+
+	/* checksum each section, then the table holding their checksums */
+	p = buf + HEADER_SIZE;
+	for (i=0; i<SECTION_COUNT; ++i, p += SECTION_SIZE) {
+		put_64(p + 24, hash64(buf + get_64(p + 8), get_64(p + 16), 0));
+	}
+	put_64(buf + 16, hash64(buf + 24, p - (buf + 24), 0));
+
+	ret = replace_file(path, buf, size);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * verify section type, which is size bytes at p, the first time it's
+ * used; VMs on any thread may ask at once, and all get the same answer
+ */
+static int check_section(Module *m, uint32_t type, const uint8_t *p,
+	size_t size)
+{
+	unsigned bit = 1u << type;
+
+	/* a section the writer left out has nothing to check */
+	if (p == NULL) return 0;
+	if (__atomic_load_n(&m->checked, __ATOMIC_ACQUIRE) & bit) return 0;
+	if (hash64(p, size, 0) != m->sums[type]) return -1;
+
+	__atomic_fetch_or(&m->checked, bit, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int read_symbols(Module *m, const uint8_t *syms, size_t syms_size,
+	const uint8_t *strs, size_t strs_size)
+{
+	size_t i;
+
+	m->symbol_count = syms_size / SYMBOL_SIZE;
+	if (m->symbol_count == 0) return 0;
+
+	m->symbols = malloc(m->symbol_count * sizeof(struct symbol));
+	if (m->symbols == NULL) return -1;
+
+	for (i=0; i<m->symbol_count; ++i, syms += SYMBOL_SIZE) {
+		uint32_t name = get_32(syms + 12);
+
+		/* names point into the mapping, so they must be terminated */
+		if (name >= strs_size) return -1;
+		if (memchr(strs + name, '\0', strs_size - name) == NULL) return -1;
+
+		m->symbols[i].name = (const char*)strs + name;
+		m->symbols[i].pc = get_64(syms);
+		m->symbols[i].flags = get_32(syms + 8);
+	}
+
+	return 0;
+}
+
+static int read_tries(Module *m, const uint8_t *p, size_t size)
+{
+	size_t i;
+
+	m->try_count = size / TRY_SIZE;
+	if (m->try_count == 0) return 0;
+
+	m->tries = malloc(m->try_count * sizeof(struct try_entry));
+	if (m->tries == NULL) return -1;
+
+	for (i=0; i<m->try_count; ++i, p += TRY_SIZE) {
+		m->tries[i].start = get_64(p);
+		m->tries[i].end = get_64(p + 8);
+		m->tries[i].handler = get_64(p + 16);
+		m->tries[i].depth = get_64(p + 24);
+	}
+
+	return 0;
+}
+
+/* translate a pc in compact code, which may be the end of the code */
+static int map_pc(const size_t *pcmap, size_t code_size, size_t *pc)
+{
+	if (*pc > code_size || pcmap[*pc] == (size_t)-1) return -1;
+
+	*pc = pcmap[*pc];
+
+	return 0;
+}
+
+/* translate compact code and move the symbols along with it */
+static int expand_code(Module *m)
+{
+	size_t i, size, *pcmap;
+	uint8_t *code;
+
+	pcmap = malloc((m->code_size + 1) * sizeof(size_t));
+	if (pcmap == NULL) return -1;
+
+	code = load_compact(m->code, m->code_size, &size, pcmap);
+	if (code == NULL) goto cleanup;
+
+	for (i=0; i<m->symbol_count; ++i) {
+		size_t pc = m->symbols[i].pc;
+
+		if (pc >= m->code_size || pcmap[pc] == (size_t)-1) {
+			free(code);
+			goto cleanup;
+		}
+		m->symbols[i].pc = pcmap[pc];
+	}
+
+	for (i=0; i<m->try_count; ++i) {
+		struct try_entry *t = &m->tries[i];
+
+		if (map_pc(pcmap, m->code_size, &t->start) != 0
+			|| map_pc(pcmap, m->code_size, &t->end) != 0
+			|| map_pc(pcmap, m->code_size, &t->handler) != 0) {
+			free(code);
+			goto cleanup;
+		}
+	}
+
+	free(pcmap);
+	m->code = code;
+	m->code_size = size;
+	m->compact = 1;
+
+	return 0;
+
+cleanup:
+	free(pcmap);
+
+	return -1;
+}
+
+Module* load_module(const char *path)
+{
+	const uint8_t *sections[SECTION_TRY + 1];
+	size_t sizes[SECTION_TRY + 1];
+	struct stat st;
+	Module *m;
+	uint32_t i, count;
+	int fd;
+
+	m = calloc(1, sizeof(Module));
+	if (m == NULL) return NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) goto cleanup;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+		close(fd);
+		goto cleanup;
+	}
+
+	m->map_size = st.st_size;
+	m->map = mmap(NULL, m->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED) {
+		m->map = NULL;
+		goto cleanup;
+	}
+
+	if (memcmp(m->map, MODULE_MAGIC, sizeof(MODULE_MAGIC)) != 0) goto cleanup;
+	if (get_32(m->map + 8) != MODULE_VERSION) goto cleanup;
+
+	count = get_32(m->map + 24);
+	if (count > (m->map_size - HEADER_SIZE) / SECTION_SIZE) goto cleanup;
+	if (get_64(m->map + 16) != hash64(m->map + 24,
+		HEADER_SIZE - 24 + count * SECTION_SIZE, 0)) goto cleanup;
+
+	memset(sections, 0, sizeof(sections));
+	memset(sizes, 0, sizeof(sizes));
+	for (i=0; i<count; ++i) {
+		const uint8_t *entry = m->map + HEADER_SIZE + i * SECTION_SIZE;
+		uint32_t type = get_32(entry);
+		uint64_t off = get_64(entry + 8);
+		uint64_t size = get_64(entry + 16);
+
+		if (off > m->map_size || size > m->map_size - off) goto cleanup;
+
+		/* skip sections from newer writers that we don't understand */
+		if (type > SECTION_TRY) continue;
+
+		sections[type] = m->map + off;
+		sizes[type] = size;
+		m->sums[type] = get_64(entry + 24);
+	}
+	if (sections[SECTION_CODE] == NULL) goto cleanup;
+
+	m->code = (uint8_t*)sections[SECTION_CODE];
+	m->code_size = sizes[SECTION_CODE];
+	m->data = sections[SECTION_DATA];
+	m->data_size = sizes[SECTION_DATA];
+
+	if (check_section(m, SECTION_SYMBOLS, sections[SECTION_SYMBOLS],
+		sizes[SECTION_SYMBOLS]) != 0
+		|| check_section(m, SECTION_STRINGS, sections[SECTION_STRINGS],
+		sizes[SECTION_STRINGS]) != 0
+		|| check_section(m, SECTION_TRY, sections[SECTION_TRY],
+		sizes[SECTION_TRY]) != 0) goto cleanup;
+
+	if (read_symbols(m, sections[SECTION_SYMBOLS], sizes[SECTION_SYMBOLS],
+		sections[SECTION_STRINGS], sizes[SECTION_STRINGS]) != 0) {
+		goto cleanup;
+	}
+	if (read_tries(m, sections[SECTION_TRY], sizes[SECTION_TRY]) != 0) {
+		goto cleanup;
+	}
+
+	/* translating compact code reads all of it anyway */
+	if (get_32(m->map + 12) & MODULE_COMPACT) {
+		if (check_section(m, SECTION_CODE, m->code, m->code_size) != 0
+			|| expand_code(m) != 0) goto cleanup;
+	}
+
+	return m;
+
+cleanup:
+	free_module(m);
+
+	return NULL;
+}
+
+void free_module(Module *m)
+{
+	if (m->compact) free(m->code);
+	if (m->map != NULL) munmap(m->map, m->map_size);
+	free(m->symbols);
+	free(m->tries);
+	free(m);
+}
+
+uint8_t* module_code(Module *m, size_t *size)
+{
+	if (size != NULL) *size = m->code_size;
+
+	if (!m->compact && check_section(m, SECTION_CODE, m->code,
+		m->code_size) != 0) return NULL;
+
+	return m->code;
+}
+
+const struct symbol* module_symbols(Module *m, size_t *count)
+{
+	*count = m->symbol_count;
+
+	return m->symbols;
+}
+
+const struct try_entry* module_tries(Module *m, size_t *count)
+{
+	*count = m->try_count;
+
+	return m->tries;
+}
+
+int module_entry(Module *m, const char *name, size_t *pc)
+{
+	size_t i;
+
+	for (i=0; i<m->symbol_count; ++i) {
+		if (!(m->symbols[i].flags & SYMBOL_ENTRY)) continue;
+		if (strcmp(m->symbols[i].name, name) != 0) continue;
+
+		*pc = m->symbols[i].pc;
+		return 0;
+	}
+
+	return -1;
+}
+
+VM* make_module_vm(Module *m, size_t stack_size, size_t env_size)
+{
+	VM *vm;
+
+	if (env_size < m->data_size) return NULL;
+	if (module_code(m, NULL) == NULL) return NULL;
+	if (check_section(m, SECTION_DATA, m->data, m->data_size) != 0) {
+		return NULL;
+	}
+
+	vm = make_vm(m->code, stack_size, env_size);
+	if (vm == NULL) return NULL;
+
+	if (m->data_size > 0) memcpy(vm->env, m->data, m->data_size);
+	vm_set_try_table(vm, m->tries, m->try_count);
+
+	return vm;
+}
@@ -0,0 +1,350 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <vm.h>
+#include "vm_internal.h"
+
+
+#define OP(info, i, po, pu, f) \
+	(info)->imm = (i); \
+	(info)->pop = (po); \
+	(info)->push = (pu); \
+	(info)->flags = (f)
+
+int describe_op(uint8_t opcode, struct opinfo *info)
+{
+	switch (opcode) {
+	case ADD_u8: case ADD_i8: case SUB_u8: case SUB_i8:
+	case MUL_u8: case MUL_i8:
+		OP(info, 0, 2, 2, 0);
+		break;
+	case ADD_u16: case ADD_i16: case SUB_u16: case SUB_i16:
+	case MUL_u16: case MUL_i16:
+		OP(info, 0, 4, 4, 0);
+		break;
+	case ADD_u32: case ADD_i32: case SUB_u32: case SUB_i32:
+	case MUL_u32: case MUL_i32:
+		OP(info, 0, 8, 8, 0);
+		break;
+	case ADD_u64: case ADD_i64: case SUB_u64: case SUB_i64:
+	case MUL_u64: case MUL_i64: case DIV_u64: case DIV_i64:
+	case MOD_u64: case MOD_i64: case ADD_d: case SUB_d: case MUL_d:
+	case DIV_d: case AND_u64: case OR_u64: case XOR_u64:
+		OP(info, 0, 16, 8, 0);
+		break;
+	case ADD_f: case SUB_f: case MUL_f: case DIV_f:
+	case DIV_u32: case DIV_i32: case MOD_u32: case MOD_i32:
+	case AND_u32: case OR_u32: case XOR_u32:
+		OP(info, 0, 8, 4, 0);
+		break;
+	case DIV_u16: case DIV_i16: case MOD_u16: case MOD_i16:
+	case AND_u16: case OR_u16: case XOR_u16:
+		OP(info, 0, 4, 2, 0);
+		break;
+	case DIV_u8: case DIV_i8: case MOD_u8: case MOD_i8:
+	case AND_u8: case OR_u8: case XOR_u8: case AND: case OR: case XOR:
+	case EQ_u8: case NEQ_u8: case LT_u8: case LT_i8: case LTEQ_u8:
+	case LTEQ_i8: case GT_u8: case GT_i8: case GTEQ_u8: case GTEQ_i8:
+	case LSHFT_u8: case RSHFT_u8:
+		OP(info, 0, 2, 1, 0);
+		break;
+	case EQ_u16: case NEQ_u16: case LT_u16: case LT_i16: case LTEQ_u16:
+	case LTEQ_i16: case GT_u16: case GT_i16: case GTEQ_u16: case GTEQ_i16:
+		OP(info, 0, 4, 1, 0);
+		break;
+	case EQ_u32: case NEQ_u32: case LT_u32: case LT_i32: case LTEQ_u32:
+	case LTEQ_i32: case GT_u32: case GT_i32: case GTEQ_u32: case GTEQ_i32:
+	case EQ_f: case NEQ_f: case LT_f: case LTEQ_f: case GT_f: case GTEQ_f:
+		OP(info, 0, 8, 1, 0);
+		break;
+	case EQ_u64: case NEQ_u64: case LT_u64: case LT_i64: case LTEQ_u64:
+	case LTEQ_i64: case GT_u64: case GT_i64: case GTEQ_u64: case GTEQ_i64:
+	case EQ_d: case NEQ_d: case LT_d: case LTEQ_d: case GT_d: case GTEQ_d:
+		OP(info, 0, 16, 1, 0);
+		break;
+	case NOT: case NOT_u8: case LOAD_u8: case ARG:
+		OP(info, 0, 1, 1, 0);
+		break;
+	case NOT_u16:
+		OP(info, 0, 2, 2, 0);
+		break;
+	case NOT_u32:
+		OP(info, 0, 4, 4, 0);
+		break;
+	case NOT_u64:
+		OP(info, 0, 8, 8, 0);
+		break;
+	/* the wide shifts only pop a single byte to shift */
+	case LSHFT_u16: case RSHFT_u16:
+		OP(info, 0, 2, 2, 0);
+		break;
+	case LSHFT_u32: case RSHFT_u32:
+		OP(info, 0, 2, 4, 0);
+		break;
+	case LSHFT_u64: case RSHFT_u64:
+		OP(info, 0, 2, 8, 0);
+		break;
+	case JMP_u8:
+		OP(info, 0, 1, 0, OP_INDIRECT | OP_STOP);
+		break;
+	case JMP_u16:
+		OP(info, 0, 2, 0, OP_INDIRECT | OP_STOP);
+		break;
+	case JMP_u32:
+		OP(info, 0, 4, 0, OP_INDIRECT | OP_STOP);
+		break;
+	case JMP_u64:
+		OP(info, 0, 8, 0, OP_INDIRECT | OP_STOP);
+		break;
+	case JMPIF_u8:
+		OP(info, 0, 2, 0, OP_INDIRECT | OP_COND);
+		break;
+	case JMPIF_u16:
+		OP(info, 0, 3, 0, OP_INDIRECT | OP_COND);
+		break;
+	case JMPIF_u32:
+		OP(info, 0, 5, 0, OP_INDIRECT | OP_COND);
+		break;
+	case JMPIF_u64:
+		OP(info, 0, 9, 0, OP_INDIRECT | OP_COND);
+		break;
+	case PUSH_u8:
+		OP(info, 1, 0, 1, 0);
+		break;
+	case PUSH_u16:
+		OP(info, 2, 0, 2, 0);
+		break;
+	case PUSH_u32:
+		OP(info, 4, 0, 4, 0);
+		break;
+	case PUSH_u64:
+		OP(info, 8, 0, 8, 0);
+		break;
+	case POP_u8:
+		OP(info, 0, 1, 0, 0);
+		break;
+	case POP_u16:
+		OP(info, 0, 2, 0, 0);
+		break;
+	case POP_u32:
+		OP(info, 0, 4, 0, 0);
+		break;
+	case POP_u64:
+		OP(info, 0, 8, 0, 0);
+		break;
+	case LOAD_u16:
+		OP(info, 0, 2, 1, 0);
+		break;
+	case LOAD_u32:
+		OP(info, 0, 4, 1, 0);
+		break;
+	case LOAD_u64:
+		OP(info, 0, 8, 1, 0);
+		break;
+	case STORE_u8:
+		OP(info, 0, 2, 0, 0);
+		break;
+	case STORE_u16:
+		OP(info, 0, 3, 0, 0);
+		break;
+	case STORE_u32:
+		OP(info, 0, 5, 0, 0);
+		break;
+	case STORE_u64:
+		OP(info, 0, 9, 0, 0);
+		break;
+	case CALL_u8: case CALL_u16: case CALL_u32: case CALL_u64:
+		OP(info, 0, 0, 0, OP_INDIRECT | OP_CALL | OP_DYNAMIC);
+		break;
+	case RET_u8: case RET_u16: case RET_u32: case RET_u64:
+		OP(info, 0, 0, 0, OP_STOP | OP_DYNAMIC);
+		break;
+	case ARGC:
+		OP(info, 0, 0, 1, 0);
+		break;
+	case HALT:
+		OP(info, 0, 0, 0, OP_STOP);
+		break;
+	case SYSCALL:
+		OP(info, 0, 0, 0, OP_DYNAMIC);
+		break;
+	case JMP_rel:
+		OP(info, 4, 0, 0, OP_JUMP | OP_REL | OP_STOP);
+		break;
+	case JMPIF_rel:
+		OP(info, 4, 1, 0, OP_JUMP | OP_REL | OP_COND);
+		break;
+	case CALL_rel: case FCALL:
+		OP(info, 4, 0, 0, OP_JUMP | OP_REL | OP_CALL | OP_DYNAMIC);
+		break;
+	case TCALL:
+		OP(info, 4, 0, 0, OP_JUMP | OP_REL | OP_CALL | OP_STOP
+			| OP_DYNAMIC);
+		break;
+	case JMP_abs:
+		OP(info, 4, 0, 0, OP_JUMP | OP_STOP);
+		break;
+	case JMPIF_abs:
+		OP(info, 4, 1, 0, OP_JUMP | OP_COND);
+		break;
+	case CALL_abs:
+		OP(info, 4, 0, 0, OP_JUMP | OP_CALL | OP_DYNAMIC);
+		break;
+	case FRET: case RETN:
+		OP(info, 1, 0, 0, OP_STOP | OP_DYNAMIC);
+		break;
+	case ARG_u16:
+		OP(info, 0, 1, 2, 0);
+		break;
+	case ARG_u32:
+		OP(info, 0, 1, 4, 0);
+		break;
+	case ARG_u64:
+		OP(info, 0, 1, 8, 0);
+		break;
+	case ALOAD_u8:
+		OP(info, 0, 8, 1, 0);
+		break;
+	case ALOAD_u16:
+		OP(info, 0, 8, 2, 0);
+		break;
+	case ALOAD_u32:
+		OP(info, 0, 8, 4, 0);
+		break;
+	case ALOAD_u64:
+		OP(info, 0, 8, 8, 0);
+		break;
+	case ASTORE_u8:
+		OP(info, 0, 9, 0, 0);
+		break;
+	case ASTORE_u16:
+		OP(info, 0, 10, 0, 0);
+		break;
+	case ASTORE_u32:
+		OP(info, 0, 12, 0, 0);
+		break;
+	case ASTORE_u64:
+		OP(info, 0, 16, 0, 0);
+		break;
+	case XCHG_u8: case XADD_u8:
+		OP(info, 0, 9, 1, 0);
+		break;
+	case XCHG_u16: case XADD_u16:
+		OP(info, 0, 10, 2, 0);
+		break;
+	case XCHG_u32: case XADD_u32:
+		OP(info, 0, 12, 4, 0);
+		break;
+	case XCHG_u64: case XADD_u64:
+		OP(info, 0, 16, 8, 0);
+		break;
+	case CAS_u8:
+		OP(info, 0, 10, 2, 0);
+		break;
+	case CAS_u16:
+		OP(info, 0, 12, 3, 0);
+		break;
+	case CAS_u32:
+		OP(info, 0, 16, 5, 0);
+		break;
+	case CAS_u64:
+		OP(info, 0, 24, 9, 0);
+		break;
+	case FENCE_acq: case FENCE_rel: case FENCE:
+		OP(info, 0, 0, 0, 0);
+		break;
+	case SEND: case RECV:
+		OP(info, 0, 9, 0, 0);
+		break;
+	case SPAWN:
+		OP(info, 4, 17, 1, OP_JUMP | OP_CALL | OP_DYNAMIC);
+		break;
+	case JOIN:
+		OP(info, 0, 1, 8, 0);
+		break;
+	case HASH_crc32c:
+		OP(info, 0, 20, 4, 0);
+		break;
+	case HASH_u64:
+		OP(info, 0, 24, 8, 0);
+		break;
+	case HT_INIT:
+		OP(info, 0, 20, 0, 0);
+		break;
+	case HT_INSERT:
+		OP(info, 0, 24, 1, 0);
+		break;
+	case HT_LOOKUP:
+		OP(info, 0, 16, 8, 0);
+		break;
+	case HT_DELETE:
+		OP(info, 0, 16, 1, 0);
+		break;
+	case SORT:
+		OP(info, 0, 17, 0, 0);
+		break;
+	case SORT_rec:
+		OP(info, 0, 25, 0, 0);
+		break;
+	case PARTITION: case BSEARCH:
+		OP(info, 0, 25, 8, 0);
+		break;
+	/* the function runs later, on the coroutine's own stack */
+	case CORO_NEW:
+		OP(info, 4, 5, 4, OP_JUMP | OP_CALL | OP_DYNAMIC);
+		break;
+	case RESUME:
+		OP(info, 0, 4, 9, 0);
+		break;
+	case YIELD:
+		OP(info, 0, 8, 0, 0);
+		break;
+	case THROW:
+		OP(info, 0, 8, 0, OP_STOP);
+		break;
+	case IN:
+		OP(info, 0, 13, 4, 0);
+		break;
+	case OUT:
+		OP(info, 0, 13, 0, 0);
+		break;
+	case PURE:
+		OP(info, 1, 0, 0, 0);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int branch_target(const uint8_t *code, size_t pc, const struct opinfo *info,
+	size_t *target)
+{
+	uint32_t imm;
+
+	if (!(info->flags & OP_JUMP)) return -1;
+
+	imm = (uint32_t)code[pc + 1] << 24 | (uint32_t)code[pc + 2] << 16
+		| (uint32_t)code[pc + 3] << 8 | (uint32_t)code[pc + 4];
+
+	*target = info->flags & OP_REL ? pc + (int32_t)imm : imm;
+
+	return 0;
+}
@@ -0,0 +1,381 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pool.h>
+#include "vm_internal.h"
+
+#define MAX_TASKS 256
+
+enum task_state {
+	TASK_QUEUED,
+	TASK_RUNNING,
+	TASK_DONE
+};
+
+/* a spawned child, the handle its parent joins on */
+struct task {
+	VM *vm;
+	size_t pc;
+	int state;
+	int status;
+	uint64_t result;
+	uint64_t exception; /* what the child threw or faulted with */
+	struct task *next;
+};
+
+struct Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* signalled when a task is queued */
+	pthread_cond_t done; /* broadcast when a task finishes */
+	struct task *head, *tail;
+	int stop;
+
+	pthread_t *threads;
+	size_t thread_count;
+};
+
+static void run_task(struct task *t)
+{
+	VM *vm = t->vm;
+
+	t->status = run_vm(vm, NULL, t->pc);
+	while (t->status == VM_BLOCKED) {
+		t->status = run_vm(vm, NULL, vm_wait(vm));
+	}
+
+	t->result = t->status == VM_RETURN ? pop_result(vm, 0) : 0;
+	t->exception = vm->exception;
+}
+
+static void* worker(void *arg)
+{
+	Pool *pool = arg;
+	struct task *t;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->head == NULL && !pool->stop) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->head == NULL) break;
+
+		t = pool->head;
+		pool->head = t->next;
+		if (pool->head == NULL) pool->tail = NULL;
+		t->state = TASK_RUNNING;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_task(t);
+
+		pthread_mutex_lock(&pool->lock);
+		t->state = TASK_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+Pool* make_pool(size_t threads)
+{
+	Pool *pool;
+
+	if (threads == 0) return NULL;
+
+	pool = calloc(1, sizeof(Pool));
+	if (pool == NULL) return NULL;
+
+	pool->threads = malloc(threads * sizeof(pthread_t));
+	if (pool->threads == NULL) goto cleanup;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (; pool->thread_count<threads; ++pool->thread_count) {
+		if (pthread_create(&pool->threads[pool->thread_count], NULL,
+			worker, pool) != 0) break;
+	}
+	if (pool->thread_count == 0) goto cleanup;
+
+	return pool;
+
+cleanup:
+	free(pool->threads);
+	free(pool);
+
+	return NULL;
+}
+
+void free_pool(Pool *pool)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
+
+void vm_attach_pool(VM *vm, Pool *pool)
+{
+	vm->pool = pool;
+}
+
+/* a VM running code on the len bytes of parent's env starting at base */
+static VM* make_child(VM *parent, size_t base, size_t len)
+{
+	size_t windows = parent->window_count * sizeof(struct window);
+	size_t channels = parent->channel_count * sizeof(Channel*);
+	VM *vm = calloc(1, sizeof(VM));
+	if (vm == NULL) return NULL;
+
+	vm->stack = malloc(parent->stack_size);
+	vm->frames = malloc(MAX_FRAMES(parent->stack_size) * sizeof(struct frame));
+	vm->windows = malloc(windows);
+	vm->channels = malloc(channels);
+	if (vm->stack == NULL || vm->frames == NULL
+		|| (windows != 0 && vm->windows == NULL)
+		|| (channels != 0 && vm->channels == NULL)) goto cleanup;
+
+	/* ports have one reader and one writer, so they stay the parent's */
+	memcpy(vm->windows, parent->windows, windows);
+	memcpy(vm->channels, parent->channels, channels);
+	vm->window_count = parent->window_count;
+	vm->channel_count = parent->channel_count;
+
+	vm->env = parent->env + base;
+	vm->env_size = len;
+	vm->code = parent->code;
+	vm->stack_size = parent->stack_size;
+	vm->pool = parent->pool;
+	vm->tries = parent->tries;
+	vm->try_count = parent->try_count;
+	vm->debug = parent->debug;
+	vm->memo = parent->memo;
+	inherit_syscall_log(vm, parent);
+	vm->image_fd = -1;
+
+	/* the child's frames hold the parent's version until it's joined */
+	vm->version = parent->version;
+	if (vm->version != NULL) code_ref(vm->version);
+
+	return vm;
+
+cleanup:
+	free(vm->stack);
+	free(vm->frames);
+	free(vm->windows);
+	free(vm->channels);
+	free(vm);
+
+	return NULL;
+}
+
+/* the child borrows its env, so free_vm would free the wrong thing */
+static void free_child(VM *vm)
+{
+	free_tasks(vm);
+	free_coros(vm);
+	if (vm->version != NULL) code_unref(vm->version);
+	free(vm->stack);
+	free(vm->frames);
+	free(vm->windows);
+	free(vm->channels);
+	free(vm->ports);
+	free(vm->pending);
+	free(vm);
+}
+
+int spawn_op(VM *vm, size_t pc)
+{
+	uint64_t base, len, buf;
+	uint8_t argc, handle;
+	struct task *t;
+	Pool *pool = vm->pool;
+
+	POP_64(vm, len, buf);
+	POP_64(vm, base, buf);
+	argc = POP(vm);
+	vm->sp -= argc;
+
+	if (base > vm->env_size || len > vm->env_size - base) return VM_FAULT;
+
+	if (vm->tasks == NULL) {
+		vm->tasks = calloc(MAX_TASKS, sizeof(struct task*));
+		if (vm->tasks == NULL) return VM_FAULT;
+	}
+	for (handle=0; vm->tasks[handle] != NULL; ++handle) {
+		if (handle == MAX_TASKS - 1) return VM_FAULT;
+	}
+
+	t = calloc(1, sizeof(struct task));
+	if (t == NULL) return VM_FAULT;
+
+	t->vm = make_child(vm, base, len);
+	if (t->vm == NULL) goto cleanup;
+	if (push_call(t->vm, vm->stack + vm->sp, argc, HOST_RETURN) != 0) {
+		free_child(t->vm);
+		goto cleanup;
+	}
+	t->pc = pc;
+
+	if (pool == NULL) {
+		run_task(t);
+		t->state = TASK_DONE;
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->tail == NULL) {
+			pool->head = t;
+		} else {
+			pool->tail->next = t;
+		}
+		pool->tail = t;
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	vm->tasks[handle] = t;
+	PUSH(vm, handle);
+
+	return 0;
+
+cleanup:
+	free(t);
+
+	return VM_FAULT;
+}
+
+int has_tasks(VM *vm)
+{
+	size_t i;
+
+	if (vm->tasks == NULL) return 0;
+
+	for (i=0; i<MAX_TASKS; ++i) {
+		if (vm->tasks[i] != NULL) return 1;
+	}
+
+	return 0;
+}
+
+/* take t back off the queue if no worker has started it yet */
+static int unqueue(Pool *pool, struct task *t)
+{
+	struct task **p;
+
+	if (t->state != TASK_QUEUED) return 0;
+
+	for (p=&pool->head; *p!=t; p=&(*p)->next);
+	*p = t->next;
+	if (pool->tail == t) {
+		pool->tail = NULL;
+		for (t=pool->head; t!=NULL; t=t->next) pool->tail = t;
+	}
+
+	return 1;
+}
+
+/* wait for t to finish, unless it can be taken off the queue first */
+static void settle(Pool *pool, struct task *t)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (!unqueue(pool, t)) {
+		while (t->state != TASK_DONE) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void free_tasks(VM *vm)
+{
+	size_t i;
+
+	if (vm->tasks == NULL) return;
+
+	/* children run on the parent's env, so none may outlive it */
+	for (i=0; i<MAX_TASKS; ++i) {
+		struct task *t = vm->tasks[i];
+		if (t == NULL) continue;
+
+		if (vm->pool != NULL) settle(vm->pool, t);
+		free_child(t->vm);
+		free(t);
+	}
+	free(vm->tasks);
+	vm->tasks = NULL;
+}
+
+int join_op(VM *vm)
+{
+	uint8_t handle = POP(vm);
+	struct task *t;
+	Pool *pool = vm->pool;
+	int status;
+
+	if (vm->tasks == NULL || vm->tasks[handle] == NULL) return VM_FAULT;
+	t = vm->tasks[handle];
+
+	/*
+	 * run a child nobody has picked up ourselves, rather than sleep on
+	 * it: a worker joining its own children could otherwise hold every
+	 * thread in the pool waiting on tasks none of them can run
+	 */
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		if (unqueue(pool, t)) {
+			pthread_mutex_unlock(&pool->lock);
+			run_task(t);
+		} else {
+			while (t->state != TASK_DONE) {
+				pthread_cond_wait(&pool->done, &pool->lock);
+			}
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	vm->tasks[handle] = NULL;
+	status = t->status;
+	PUSH_64(vm, t->result);
+	if (status != VM_RETURN && status != VM_HALT) {
+		vm->exception = t->exception;
+	}
+
+	free_child(t->vm);
+	free(t);
+
+	/* a child that halted joins as 0, but what it threw is the parent's */
+	if (status == VM_RETURN || status == VM_HALT) return 0;
+
+	return status == VM_EXCEPTION ? VM_EXCEPTION : VM_FAULT;
+}
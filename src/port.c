@@ -0,0 +1,378 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <port.h>
+#include "vm_internal.h"
+
+#define CACHE_LINE 64
+
+/*
+ * head and tail only ever grow, so the ring is empty when they're equal
+ * and full when they're capacity apart. The writer owns head and the
+ * reader tail, each publishing with a release store.
+ */
+struct Port {
+	size_t head; /* bytes written */
+	char pad0[CACHE_LINE - sizeof(size_t)];
+	size_t tail; /* bytes read */
+	char pad1[CACHE_LINE - sizeof(size_t)];
+
+	/* bumped whenever either end moves, for sleepers to futex on */
+	uint32_t event;
+	uint32_t waiters;
+	int closed;
+
+	int delim;
+	int mapped;
+	size_t capacity;
+	uint8_t *data;
+};
+
+/* the other end's position, along with the bytes it has moved */
+static size_t writer(Port *p)
+{
+	return __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+}
+
+static size_t reader(Port *p)
+{
+	return __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+}
+
+static void notify(Port *p)
+{
+	__atomic_add_fetch(&p->event, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->waiters, __ATOMIC_SEQ_CST) == 0) return;
+
+	syscall(SYS_futex, &p->event, FUTEX_WAKE_PRIVATE, INT32_MAX,
+		NULL, NULL, 0);
+}
+
+/* sleep until either end moves, unless one already has since event */
+static void wait(Port *p, uint32_t event)
+{
+	__atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &p->event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+	__atomic_sub_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * the iovecs covering len bytes of the ring from position pos, which
+ * wrap at most once; returns how many of the two were needed
+ */
+static int span(Port *p, size_t pos, size_t len, struct iovec *iov)
+{
+	size_t at, first;
+
+	if (len == 0) return 0;
+
+	at = pos % p->capacity;
+	first = p->capacity - at;
+	if (first > len) first = len;
+
+	iov[0].iov_base = p->data + at;
+	iov[0].iov_len = first;
+	if (first == len) return 1;
+
+	iov[1].iov_base = p->data;
+	iov[1].iov_len = len - first;
+
+	return 2;
+}
+
+Port* make_port(size_t capacity, int delim)
+{
+	Port *p;
+
+	if (capacity == 0) return NULL;
+
+	p = calloc(1, sizeof(Port));
+	if (p == NULL) return NULL;
+
+	p->data = malloc(capacity);
+	if (p->data == NULL) {
+		free(p);
+		return NULL;
+	}
+	p->capacity = capacity;
+	p->delim = delim;
+
+	return p;
+}
+
+Port* map_port(const char *path, int delim)
+{
+	Port *p = NULL;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) != 0) goto cleanup;
+
+	p = calloc(1, sizeof(Port));
+	if (p == NULL) goto cleanup;
+
+	if (st.st_size > 0) {
+		p->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p->data == MAP_FAILED) {
+			free(p);
+			p = NULL;
+			goto cleanup;
+		}
+		madvise(p->data, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	/* the whole file is already written, so nothing else ever can be */
+	p->capacity = st.st_size;
+	p->head = st.st_size;
+	p->closed = 1;
+	p->delim = delim;
+	p->mapped = 1;
+
+cleanup:
+	close(fd);
+
+	return p;
+}
+
+void free_port(Port *p)
+{
+	if (p->mapped) {
+		if (p->capacity > 0) munmap(p->data, p->capacity);
+	} else {
+		free(p->data);
+	}
+	free(p);
+}
+
+void port_close(Port *p)
+{
+	__atomic_store_n(&p->closed, 1, __ATOMIC_RELEASE);
+	notify(p);
+}
+
+size_t port_write(Port *p, const void *buf, size_t len)
+{
+	size_t head = p->head, tail = reader(p);
+	struct iovec iov[2];
+	int i, n;
+
+	if (p->mapped) return 0;
+	if (len > p->capacity - (head - tail)) {
+		len = p->capacity - (head - tail);
+	}
+
+	n = span(p, head, len, iov);
+	for (i=0; i<n; ++i) {
+		memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+		buf = (const uint8_t*)buf + iov[i].iov_len;
+	}
+
+	if (len > 0) {
+		__atomic_store_n(&p->head, head + len, __ATOMIC_RELEASE);
+		notify(p);
+	}
+
+	return len;
+}
+
+size_t port_read(Port *p, void *buf, size_t len)
+{
+	size_t tail = p->tail, head = writer(p);
+	struct iovec iov[2];
+	int i, n;
+
+	if (len > head - tail) len = head - tail;
+
+	n = span(p, tail, len, iov);
+	for (i=0; i<n; ++i) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf = (uint8_t*)buf + iov[i].iov_len;
+	}
+
+	if (len > 0) {
+		__atomic_store_n(&p->tail, tail + len, __ATOMIC_RELEASE);
+		notify(p);
+	}
+
+	return len;
+}
+
+ssize_t port_fill(Port *p, int fd)
+{
+	size_t head = p->head, tail = reader(p);
+	struct iovec iov[2];
+	ssize_t n;
+
+	if (p->mapped || head - tail == p->capacity) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	n = readv(fd, iov, span(p, head, p->capacity - (head - tail), iov));
+	if (n > 0) {
+		__atomic_store_n(&p->head, head + n, __ATOMIC_RELEASE);
+		notify(p);
+	} else if (n == 0) {
+		port_close(p);
+	}
+
+	return n;
+}
+
+ssize_t port_drain(Port *p, int fd)
+{
+	size_t tail = p->tail, head = writer(p);
+	struct iovec iov[2];
+	ssize_t n;
+
+	n = writev(fd, iov, span(p, tail, head - tail, iov));
+	if (n > 0) {
+		__atomic_store_n(&p->tail, tail + n, __ATOMIC_RELEASE);
+		notify(p);
+	}
+
+	return n;
+}
+
+int vm_attach_port(VM *vm, uint8_t id, Port *p)
+{
+	Port **ports;
+
+	if (id >= vm->port_count) {
+		ports = realloc(vm->ports, (id + 1) * sizeof(Port*));
+		if (ports == NULL) return -1;
+
+		memset(ports + vm->port_count, 0,
+			(id + 1 - vm->port_count) * sizeof(Port*));
+		vm->ports = ports;
+		vm->port_count = id + 1;
+	}
+	vm->ports[id] = p;
+
+	return 0;
+}
+
+void port_wait(VM *vm)
+{
+	wait(vm->parked_port, vm->parked_event);
+}
+
+/*
+ * how many bytes the next record read into room bytes takes, or -1 if
+ * it isn't all there yet. 0 means end of stream.
+ */
+static ptrdiff_t next_record(Port *p, size_t room)
+{
+	int closed = __atomic_load_n(&p->closed, __ATOMIC_ACQUIRE);
+	size_t tail = p->tail, head = writer(p);
+	size_t avail = head - tail, len = avail < room ? avail : room;
+	struct iovec iov[2];
+	uint8_t *end;
+	int i, n;
+
+	if (avail == 0) return closed ? 0 : -1;
+	if (p->delim == PORT_RAW) return len;
+
+	n = span(p, tail, len, iov);
+	for (i=0, len=0; i<n; ++i) {
+		end = memchr(iov[i].iov_base, p->delim, iov[i].iov_len);
+		if (end != NULL) {
+			return len + (end - (uint8_t*)iov[i].iov_base) + 1;
+		}
+		len += iov[i].iov_len;
+	}
+
+	/* no delimiter, but the record can't grow into the space it has */
+	if (len == room || avail == p->capacity || closed) return len;
+
+	return -1;
+}
+
+int port_op(VM *vm, int out)
+{
+	size_t sp = vm->sp;
+	uint64_t addr, buf;
+	uint32_t len, event;
+	ptrdiff_t n;
+	uint8_t id, *q;
+	Port *p;
+
+	POP_32(vm, len, buf);
+	POP_64(vm, addr, buf);
+	id = POP(vm);
+
+	if (id >= vm->port_count || vm->ports[id] == NULL) return VM_FAULT;
+	p = vm->ports[id];
+
+	if (out ? p->mapped : len == 0) return VM_FAULT;
+
+	q = env_ptr(vm, addr, len, !out);
+	if (q == NULL) return VM_FAULT;
+
+	/* read the event first, so a move after the check still wakes us */
+	event = __atomic_load_n(&p->event, __ATOMIC_SEQ_CST);
+
+	if (out) {
+		n = port_write(p, q, len);
+		if ((uint32_t)n == len) {
+			vm->parked_port = NULL;
+			return 0;
+		}
+
+		/*
+		 * hand over what fits now, so a reader waiting on the rest of
+		 * the record can make room for it
+		 */
+		addr += n;
+		len -= n;
+		vm->sp = sp - 12;
+		PUSH_64(vm, addr);
+		PUSH_32(vm, len);
+	} else {
+		n = next_record(p, len);
+		if (n >= 0) {
+			port_read(p, q, n);
+			PUSH_32(vm, (uint32_t)n);
+			vm->parked_port = NULL;
+			return 0;
+		}
+	}
+
+	/* leave the operands and pc on the op, so running again retries it */
+	vm->sp = sp;
+	--vm->pc;
+	vm->parked_port = p;
+	vm->parked_event = event;
+	vm->parked = NULL;
+
+	return VM_BLOCKED;
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <analyze.h>
+#include <profile.h>
+#include "vm_internal.h"
+
+
+struct Profile {
+	Debugger *debug;
+	uint64_t *counts;
+};
+
+/* every breakpoint is a block leader, so count it and carry on */
+static int count(VM *vm, size_t pc, void *arg)
+{
+	Profile *p = arg;
+
+	(void)vm;
+	__atomic_add_fetch(&p->counts[pc], 1, __ATOMIC_RELAXED);
+
+	return DEBUG_CONTINUE;
+}
+
+Profile* make_profile(const uint8_t *code, size_t size)
+{
+	const uint8_t *flags;
+	CodeInfo *info;
+	Profile *p;
+	size_t pc;
+
+	info = get_code_info(code, size);
+	if (info == NULL) return NULL;
+
+	p = calloc(1, sizeof(Profile));
+	if (p == NULL) goto cleanup;
+
+	p->counts = calloc(size > 0 ? size : 1, sizeof(uint64_t));
+	p->debug = make_debugger(code, size, count, p);
+	if (p->counts == NULL || p->debug == NULL) {
+		free_profile(p);
+		p = NULL;
+		goto cleanup;
+	}
+
+	flags = code_info_flags(info);
+	for (pc=0; pc<size; ++pc) {
+		if (flags[pc] & INSN_LEADER) set_breakpoint(p->debug, pc);
+	}
+
+cleanup:
+	free_code_info(info);
+
+	return p;
+}
+
+void free_profile(Profile *p)
+{
+	if (p->debug != NULL) free_debugger(p->debug);
+	free(p->counts);
+	free(p);
+}
+
+Debugger* profile_debugger(Profile *p)
+{
+	return p->debug;
+}
+
+const uint64_t* profile_counts(Profile *p)
+{
+	return p->counts;
+}
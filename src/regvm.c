@@ -0,0 +1,955 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <analyze.h>
+#include <regvm.h>
+#include "vm_internal.h"
+
+#define REG_MAX 256
+#define NONE ((uint32_t)-1)
+
+/* the most registers one instruction takes, past those the block holds */
+#define INSN_REGS 8
+
+/* added to an opcode whose b operand is the constant k, not a register */
+#define RK 0x100
+
+/*
+ * ALU opcodes are operations of their own, from registers a and b into
+ * d; the rest of the stack machine becomes these
+ */
+enum reg_op {
+	R_K = 0x200, /* d = k */
+	R_PUSH, /* push the w bytes of a */
+	R_PUSHK, /* push the w bytes of k */
+	R_POP, /* pop w bytes into d */
+	R_DROP, /* pop w bytes */
+	R_ARGC,
+	R_ARG, /* d = the w-byte arg ARG_* would push for a */
+	R_ARGK, /* the same, for k */
+	R_LOAD, /* d = env[a] */
+	R_LOADK, /* d = env[k] */
+	R_STORE, /* env[a] = b */
+	R_STOREK, /* env[k] = b */
+	R_JMP, /* go to ir k */
+	R_JNZ, /* go to ir k if a */
+	R_JMPR, /* go to pc a */
+	R_JNZR, /* go to pc a if b */
+	R_CALL, /* CALL_* ir k, returning to pc */
+	R_CALLR, /* CALL_* pc a, returning to pc */
+	R_FCALL, /* FCALL ir k, returning to pc */
+	R_TCALL, /* TCALL ir k */
+	R_RET, /* RET_* the w bytes of a */
+	R_RETN, /* RETN w */
+	R_FRET, /* FRET w */
+	R_HALT, /* HALT, leaving the VM at pc */
+	R_EXIT /* run the rest on run_vm from pc */
+};
+
+struct rinsn {
+	uint64_t k;
+	uint32_t pc;
+	uint32_t x; /* the deopt taken rather than faulting */
+	uint16_t op;
+	uint8_t w;
+	uint8_t d, a, b;
+};
+
+/* a value a block holds instead of the stack */
+struct slot {
+	uint64_t k; /* the value, if konst */
+	uint8_t w; /* the bytes it takes on the stack */
+	uint8_t reg;
+	uint8_t konst;
+};
+
+/*
+ * what to do instead of an instruction that would fault: give back the
+ * bytes it popped, push the values the block holds, and leave it to
+ * run_vm, which faults the same way
+ */
+struct deopt {
+	uint32_t pc;
+	uint32_t restore;
+	uint32_t first, count; /* slots, bottom first */
+};
+
+struct RegCode {
+	const uint8_t *code; /* what was translated, for run_reg to check */
+	struct rinsn *ir;
+	uint32_t *entry; /* the ir of the block at each pc, or NONE */
+	struct deopt *deopts;
+	struct slot *slots;
+	size_t size;
+};
+
+/* a translation in progress */
+struct xlate {
+	struct rinsn *ir;
+	size_t n, cap;
+	struct deopt *deopts;
+	size_t deopt_count, deopt_cap;
+	struct slot *slots;
+	size_t slot_count, slot_cap;
+	int failed;
+	struct rinsn spare; /* emitted into once out of memory */
+
+	/* the block's values not yet on the stack, top last */
+	struct slot stack[REG_MAX];
+	size_t depth;
+	unsigned next; /* the next free register */
+
+	/* what the instruction being translated took from each */
+	struct slot taken[2];
+	size_t taken_count;
+	size_t popped;
+};
+
+static uint64_t get_bytes(const uint8_t *p, size_t w)
+{
+	uint64_t v = 0;
+
+	while (w-- > 0) v = v << 8 | *p++;
+
+	return v;
+}
+
+static void put_bytes(uint8_t *p, uint64_t v, size_t w)
+{
+	while (w-- > 0) *p++ = v >> (8*w);
+}
+
+static struct rinsn* emit(struct xlate *x, uint16_t op)
+{
+	struct rinsn *i;
+	size_t cap;
+
+	if (x->n == x->cap) {
+		cap = x->cap > 0 ? 2 * x->cap : 256;
+		i = realloc(x->ir, cap * sizeof(struct rinsn));
+		if (i == NULL) {
+			x->failed = 1;
+			return &x->spare;
+		}
+		x->ir = i;
+		x->cap = cap;
+	}
+
+	i = x->ir + x->n++;
+	memset(i, 0, sizeof(*i));
+	i->op = op;
+
+	return i;
+}
+
+/* put every value the block holds on the stack */
+static void flush(struct xlate *x)
+{
+	struct rinsn *i;
+	size_t n;
+
+	for (n=0; n<x->depth; ++n) {
+		if (x->stack[n].konst) {
+			i = emit(x, R_PUSHK);
+			i->k = x->stack[n].k;
+		} else {
+			i = emit(x, R_PUSH);
+			i->a = x->stack[n].reg;
+		}
+		i->w = x->stack[n].w;
+	}
+
+	x->depth = 0;
+}
+
+/* pop a w-byte operand, off the stack unless the block holds it */
+static struct slot take(struct xlate *x, uint8_t w)
+{
+	struct rinsn *i;
+	struct slot s;
+
+	if (x->depth > 0 && x->stack[x->depth - 1].w == w) {
+		s = x->stack[--x->depth];
+		x->taken[x->taken_count++] = s;
+		return s;
+	}
+
+	flush(x);
+	i = emit(x, R_POP);
+	i->w = w;
+	i->d = x->next;
+	x->popped += w;
+
+	s.k = 0;
+	s.w = w;
+	s.reg = x->next++;
+	s.konst = 0;
+
+	return s;
+}
+
+/* the register holding s, loading it if s is a constant */
+static uint8_t reg(struct xlate *x, struct slot s)
+{
+	struct rinsn *i;
+
+	if (!s.konst) return s.reg;
+
+	i = emit(x, R_K);
+	i->d = x->next;
+	i->k = s.k;
+
+	return x->next++;
+}
+
+/* push a new register of w bytes, returning it */
+static uint8_t result(struct xlate *x, uint8_t w)
+{
+	struct slot *s = x->stack + x->depth++;
+
+	s->k = 0;
+	s->w = w;
+	s->reg = x->next;
+	s->konst = 0;
+
+	return x->next++;
+}
+
+static void constant(struct xlate *x, uint64_t k, uint8_t w)
+{
+	struct slot *s = x->stack + x->depth++;
+
+	s->k = k;
+	s->w = w;
+	s->reg = 0;
+	s->konst = 1;
+}
+
+/* record how to undo the instruction at pc so far */
+static uint32_t deopt(struct xlate *x, size_t pc)
+{
+	size_t n, count = x->depth + x->taken_count;
+	struct deopt *d;
+	struct slot *s;
+
+	if (x->deopt_count == x->deopt_cap) {
+		n = x->deopt_cap > 0 ? 2 * x->deopt_cap : 64;
+		d = realloc(x->deopts, n * sizeof(struct deopt));
+		if (d == NULL) goto cleanup;
+		x->deopts = d;
+		x->deopt_cap = n;
+	}
+	if (x->slot_count + count > x->slot_cap) {
+		n = x->slot_cap > 0 ? 2 * x->slot_cap : 256;
+		while (n < x->slot_count + count) n *= 2;
+		s = realloc(x->slots, n * sizeof(struct slot));
+		if (s == NULL) goto cleanup;
+		x->slots = s;
+		x->slot_cap = n;
+	}
+
+	d = x->deopts + x->deopt_count;
+	d->pc = pc;
+	d->restore = x->popped;
+	d->first = x->slot_count;
+	d->count = count;
+
+	/* what was taken sat above what the block still holds */
+	s = x->slots + x->slot_count;
+	for (n=0; n<x->depth; ++n) s[n] = x->stack[n];
+	for (n=0; n<x->taken_count; ++n) {
+		s[x->depth + n] = x->taken[x->taken_count - 1 - n];
+	}
+	x->slot_count += count;
+
+	return x->deopt_count++;
+
+cleanup:
+	x->failed = 1;
+
+	return 0;
+}
+
+/* the width of each operand of an ALU opcode, and how many it has */
+static int operands(uint8_t opcode, const struct opinfo *info, uint8_t *w)
+{
+	if (opcode >= LSHFT_u8 && opcode <= RSHFT_u64) {
+		*w = 1;
+		return 2;
+	}
+	if (opcode == NOT || (opcode >= NOT_u8 && opcode <= NOT_u64)) {
+		*w = info->pop;
+		return 1;
+	}
+	if ((opcode >= ADD_u8 && opcode <= XOR)
+		|| (opcode >= AND_u8 && opcode <= XOR_u64)) {
+		*w = info->pop / 2;
+		return 2;
+	}
+
+	return 0;
+}
+
+static int divides(uint8_t opcode)
+{
+	return opcode >= DIV_u8 && opcode <= MOD_i64 && opcode != DIV_f
+		&& opcode != DIV_d;
+}
+
+/* translate the instruction at pc, returning 1 if run_vm takes over */
+static int translate(struct xlate *x, const uint8_t *code, size_t pc,
+	const struct opinfo *info)
+{
+	uint8_t opcode = code[pc], w, ra, rb;
+	size_t next = pc + 1 + info->imm, target = 0;
+	struct slot a, b;
+	struct rinsn *i;
+	uint32_t dx;
+	int n;
+
+	x->taken_count = 0;
+	x->popped = 0;
+	if (x->next + INSN_REGS > REG_MAX || x->depth + 1 >= REG_MAX) {
+		flush(x);
+	}
+	if (x->depth == 0) x->next = 0;
+
+	branch_target(code, pc, info, &target);
+
+	n = operands(opcode, info, &w);
+	if (n == 2) {
+		b = take(x, w);
+		a = take(x, w);
+		dx = divides(opcode) ? deopt(x, pc) : 0;
+		ra = reg(x, a);
+
+		i = emit(x, b.konst ? opcode + RK : opcode);
+		i->a = ra;
+		i->b = b.reg;
+		i->k = b.k;
+		i->x = dx;
+		i->d = result(x, info->push);
+		return 0;
+	} else if (n == 1) {
+		ra = reg(x, take(x, w));
+		i = emit(x, opcode);
+		i->a = ra;
+		i->d = result(x, info->push);
+		return 0;
+	}
+
+	switch (opcode) {
+	case PUSH_u8: case PUSH_u16: case PUSH_u32: case PUSH_u64:
+		constant(x, get_bytes(code + pc + 1, info->imm), info->imm);
+		return 0;
+	case POP_u8: case POP_u16: case POP_u32: case POP_u64:
+		if (x->depth > 0 && x->stack[x->depth - 1].w == info->pop) {
+			--x->depth;
+			return 0;
+		}
+		flush(x);
+		emit(x, R_DROP)->w = info->pop;
+		return 0;
+	case LOAD_u8: case LOAD_u16: case LOAD_u32: case LOAD_u64:
+		a = take(x, info->pop);
+		dx = deopt(x, pc);
+		i = emit(x, a.konst ? R_LOADK : R_LOAD);
+		i->a = a.reg;
+		i->k = a.k;
+		i->x = dx;
+		i->d = result(x, 1);
+		return 0;
+	case STORE_u8: case STORE_u16: case STORE_u32: case STORE_u64:
+		a = take(x, info->pop - 1);
+		b = take(x, 1);
+		dx = deopt(x, pc);
+		rb = reg(x, b);
+		i = emit(x, a.konst ? R_STOREK : R_STORE);
+		i->a = a.reg;
+		i->b = rb;
+		i->k = a.k;
+		i->x = dx;
+		return 0;
+	case ARGC:
+		i = emit(x, R_ARGC);
+		i->d = result(x, 1);
+		return 0;
+	case ARG: case ARG_u16: case ARG_u32: case ARG_u64:
+		a = take(x, 1);
+		dx = deopt(x, pc);
+		i = emit(x, a.konst ? R_ARGK : R_ARG);
+		i->a = a.reg;
+		i->k = a.k;
+		i->w = info->push;
+		i->x = dx;
+		i->d = result(x, info->push);
+		return 0;
+	case JMP_rel: case JMP_abs:
+		flush(x);
+		emit(x, R_JMP)->k = target;
+		return 0;
+	case JMPIF_rel: case JMPIF_abs:
+		a = take(x, 1);
+		flush(x);
+		if (a.konst) {
+			if (a.k != 0) emit(x, R_JMP)->k = target;
+			return 0;
+		}
+		i = emit(x, R_JNZ);
+		i->a = a.reg;
+		i->k = target;
+		return 0;
+	case JMP_u8: case JMP_u16: case JMP_u32: case JMP_u64:
+		ra = reg(x, take(x, info->pop));
+		flush(x);
+		emit(x, R_JMPR)->a = ra;
+		return 0;
+	case JMPIF_u8: case JMPIF_u16: case JMPIF_u32: case JMPIF_u64:
+		ra = reg(x, take(x, info->pop - 1));
+		rb = reg(x, take(x, 1));
+		flush(x);
+		i = emit(x, R_JNZR);
+		i->a = ra;
+		i->b = rb;
+		return 0;
+	case CALL_rel: case CALL_abs: case FCALL: case TCALL:
+		flush(x);
+		i = emit(x, opcode == FCALL ? R_FCALL
+			: opcode == TCALL ? R_TCALL : R_CALL);
+		i->k = target;
+		i->pc = next;
+		return 0;
+	case CALL_u8: case CALL_u16: case CALL_u32: case CALL_u64:
+		ra = reg(x, take(x, 1 << (opcode - CALL_u8)));
+		flush(x);
+		i = emit(x, R_CALLR);
+		i->a = ra;
+		i->pc = next;
+		return 0;
+	case RET_u8: case RET_u16: case RET_u32: case RET_u64:
+		w = 1 << (opcode - RET_u8);
+		ra = reg(x, take(x, w));
+		flush(x);
+		i = emit(x, R_RET);
+		i->a = ra;
+		i->w = w;
+		return 0;
+	case RETN: case FRET:
+		flush(x);
+		emit(x, opcode == RETN ? R_RETN : R_FRET)->w = code[pc + 1];
+		return 0;
+	case HALT:
+		flush(x);
+		emit(x, R_HALT)->pc = next;
+		return 0;
+	default:
+		flush(x);
+		emit(x, R_EXIT)->pc = pc;
+		return 1;
+	}
+}
+
+RegCode* make_reg_code(const uint8_t *code, size_t size)
+{
+	struct xlate *x = NULL;
+	RegCode *rc = NULL;
+	CodeInfo *info;
+	const uint8_t *flags;
+	struct opinfo op;
+	struct rinsn *i;
+	size_t pc, n;
+	int dead = 0;
+
+	if (size >= NONE) return NULL;
+
+	info = get_code_info(code, size);
+	if (info == NULL) return NULL;
+	flags = code_info_flags(info);
+
+	rc = calloc(1, sizeof(RegCode));
+	x = calloc(1, sizeof(struct xlate));
+	if (rc == NULL || x == NULL) goto cleanup;
+
+	rc->code = code;
+	rc->size = size;
+	rc->entry = malloc((size > 0 ? size : 1) * sizeof(uint32_t));
+	if (rc->entry == NULL) goto cleanup;
+
+	for (pc=0; pc<size; pc+=1+op.imm) {
+		describe_op(code[pc], &op);
+		rc->entry[pc] = NONE;
+
+		/* blocks start and end with everything on the stack */
+		if (flags[pc] & INSN_LEADER) {
+			flush(x);
+			rc->entry[pc] = x->n;
+			dead = 0;
+		}
+		if (!dead) dead = translate(x, code, pc, &op);
+
+		for (n=pc+1; n<pc+1+op.imm; ++n) rc->entry[n] = NONE;
+	}
+	flush(x);
+	emit(x, R_EXIT)->pc = size;
+
+	if (x->failed || x->n >= NONE) goto cleanup;
+
+	/* direct branches go straight to their target's ir */
+	for (n=0; n<x->n; ++n) {
+		i = x->ir + n;
+		if (i->op == R_JMP || i->op == R_JNZ || i->op == R_CALL
+			|| i->op == R_FCALL || i->op == R_TCALL) {
+			i->k = rc->entry[i->k];
+		}
+	}
+
+	rc->ir = x->ir;
+	rc->deopts = x->deopts;
+	rc->slots = x->slots;
+	free(x);
+	free_code_info(info);
+
+	return rc;
+
+cleanup:
+	if (x != NULL) {
+		free(x->ir);
+		free(x->deopts);
+		free(x->slots);
+		free(x);
+	}
+	if (rc != NULL) free(rc->entry);
+	free(rc);
+	free_code_info(info);
+
+	return NULL;
+}
+
+void free_reg_code(RegCode *rc)
+{
+	free(rc->ir);
+	free(rc->entry);
+	free(rc->deopts);
+	free(rc->slots);
+	free(rc);
+}
+
+static const struct rinsn* find(const RegCode *rc, size_t pc)
+{
+	if (pc >= rc->size || rc->entry[pc] == NONE) return NULL;
+
+	return rc->ir + rc->entry[pc];
+}
+
+/* operands as the stack machine's types; registers hold raw bytes */
+#define U8(v) ((uint8_t)(v))
+#define I8(v) ((int8_t)U8(v))
+#define U16(v) ((uint16_t)(v))
+#define I16(v) ((int16_t)U16(v))
+#define U32(v) ((uint32_t)(v))
+#define I32(v) ((int32_t)U32(v))
+#define U64(v) ((uint64_t)(v))
+#define I64(v) ((int64_t)U64(v))
+#define F(v) deserialize_float(U32(v))
+#define D(v) deserialize_double(v)
+
+/* the operands DIVIDE throws VM_ERR_DIV for; BAD_I is for 32 and 64 bits */
+#define BAD_U (b == 0)
+#define BAD_I(bits) \
+	(b == 0 || (b == (uint64_t)-1 >> (64 - (bits)) \
+		&& a == (uint64_t)1 << ((bits) - 1)))
+
+#define ALU(op, bad, expr) \
+	case op: \
+		a = r[i->a]; \
+		b = r[i->b]; \
+		if (bad) goto deopt; \
+		r[i->d] = (expr); \
+		break; \
+	case op + RK: \
+		a = r[i->a]; \
+		b = i->k; \
+		if (bad) goto deopt; \
+		r[i->d] = (expr); \
+		break
+
+#define REL(op, expr) ALU(op, 0, (expr) ? 1 : 0)
+
+#define UNARY(op, expr) \
+	case op: \
+		a = r[i->a]; \
+		r[i->d] = (expr); \
+		break
+
+int run_reg(VM *vm, RegCode *rc, size_t pc)
+{
+	uint64_t r[REG_MAX], a, b;
+	const struct rinsn *i;
+	const struct deopt *d;
+	const struct slot *s;
+	uint8_t header[FRAME_HEADER], argc, *p;
+	size_t n, ret, base;
+
+	/* TRAPs and reloaded code only show in the VM's code */
+	if (vm->debug != NULL || vm->code != rc->code) {
+		return run_vm(vm, NULL, pc);
+	}
+
+	vm->pc = pc;
+	vm->dirty = 1;
+	vm->exception = VM_ERR_FAULT;
+
+	i = find(rc, pc);
+	if (i == NULL) return run_vm(vm, NULL, pc);
+
+	while (1) {
+		switch (i->op) {
+		ALU(ADD_u8, 0, U16(U8(a) + U8(b)));
+		ALU(ADD_i8, 0, U16(I8(a) + I8(b)));
+		ALU(ADD_u16, 0, U32(U16(a) + U16(b)));
+		ALU(ADD_i16, 0, U32(I16(a) + I16(b)));
+		ALU(ADD_u32, 0, U64(U32(a) + U32(b)));
+		ALU(ADD_i32, 0, U64(I32(a) + I32(b)));
+		ALU(ADD_u64, 0, a + b);
+		ALU(ADD_i64, 0, U64(I64(a) + I64(b)));
+		ALU(ADD_f, 0, serialize_float(F(a) + F(b)));
+		ALU(ADD_d, 0, serialize_double(D(a) + D(b)));
+		ALU(SUB_u8, 0, U16(U8(a) - U8(b)));
+		ALU(SUB_i8, 0, U16(I8(a) - I8(b)));
+		ALU(SUB_u16, 0, U32(U16(a) - U16(b)));
+		ALU(SUB_i16, 0, U32(I16(a) - I16(b)));
+		ALU(SUB_u32, 0, U64(U32(a) - U32(b)));
+		ALU(SUB_i32, 0, U64(I32(a) - I32(b)));
+		ALU(SUB_u64, 0, a - b);
+		ALU(SUB_i64, 0, U64(I64(a) - I64(b)));
+		ALU(SUB_f, 0, serialize_float(F(a) - F(b)));
+		ALU(SUB_d, 0, serialize_double(D(a) - D(b)));
+		ALU(MUL_u8, 0, U16(U8(a) * U8(b)));
+		ALU(MUL_i8, 0, U16(I8(a) * I8(b)));
+		ALU(MUL_u16, 0, U32(U16(a) * U16(b)));
+		ALU(MUL_i16, 0, U32(I16(a) * I16(b)));
+		ALU(MUL_u32, 0, U64(U32(a) * U32(b)));
+		ALU(MUL_i32, 0, U64(I32(a) * I32(b)));
+		ALU(MUL_u64, 0, a * b);
+		ALU(MUL_i64, 0, U64(I64(a) * I64(b)));
+		ALU(MUL_f, 0, serialize_float(F(a) * F(b)));
+		ALU(MUL_d, 0, serialize_double(D(a) * D(b)));
+		ALU(DIV_u8, BAD_U, U8(U8(a) / U8(b)));
+		ALU(DIV_i8, BAD_U, U8(I8(a) / I8(b)));
+		ALU(DIV_u16, BAD_U, U16(U16(a) / U16(b)));
+		ALU(DIV_i16, BAD_U, U16(I16(a) / I16(b)));
+		ALU(DIV_u32, BAD_U, U32(U32(a) / U32(b)));
+		ALU(DIV_i32, BAD_I(32), U32(I32(a) / I32(b)));
+		ALU(DIV_u64, BAD_U, a / b);
+		ALU(DIV_i64, BAD_I(64), U64(I64(a) / I64(b)));
+		ALU(DIV_f, 0, serialize_float(F(a) / F(b)));
+		ALU(DIV_d, 0, serialize_double(D(a) / D(b)));
+		ALU(MOD_u8, BAD_U, U8(U8(a) % U8(b)));
+		ALU(MOD_i8, BAD_U, U8(I8(a) % I8(b)));
+		ALU(MOD_u16, BAD_U, U16(U16(a) % U16(b)));
+		ALU(MOD_i16, BAD_U, U16(I16(a) % I16(b)));
+		ALU(MOD_u32, BAD_U, U32(U32(a) % U32(b)));
+		ALU(MOD_i32, BAD_I(32), U32(I32(a) % I32(b)));
+		ALU(MOD_u64, BAD_U, a % b);
+		ALU(MOD_i64, BAD_I(64), U64(I64(a) % I64(b)));
+		REL(EQ_u8, U8(a) == U8(b));
+		REL(EQ_u16, U16(a) == U16(b));
+		REL(EQ_u32, U32(a) == U32(b));
+		REL(EQ_u64, a == b);
+		REL(EQ_f, F(a) == F(b));
+		REL(EQ_d, D(a) == D(b));
+		REL(NEQ_u8, U8(a) != U8(b));
+		REL(NEQ_u16, U16(a) != U16(b));
+		REL(NEQ_u32, U32(a) != U32(b));
+		REL(NEQ_u64, a != b);
+		REL(NEQ_f, F(a) != F(b));
+		REL(NEQ_d, D(a) != D(b));
+		REL(LT_u8, U8(a) < U8(b));
+		REL(LT_i8, I8(a) < I8(b));
+		REL(LT_u16, U16(a) < U16(b));
+		REL(LT_i16, I16(a) < I16(b));
+		REL(LT_u32, U32(a) < U32(b));
+		REL(LT_i32, I32(a) < I32(b));
+		REL(LT_u64, a < b);
+		REL(LT_i64, I64(a) < I64(b));
+		REL(LT_f, F(a) < F(b));
+		REL(LT_d, D(a) < D(b));
+		REL(LTEQ_u8, U8(a) <= U8(b));
+		REL(LTEQ_i8, I8(a) <= I8(b));
+		REL(LTEQ_u16, U16(a) <= U16(b));
+		REL(LTEQ_i16, I16(a) <= I16(b));
+		REL(LTEQ_u32, U32(a) <= U32(b));
+		REL(LTEQ_i32, I32(a) <= I32(b));
+		REL(LTEQ_u64, a <= b);
+		REL(LTEQ_i64, I64(a) <= I64(b));
+		REL(LTEQ_f, F(a) <= F(b));
+		REL(LTEQ_d, D(a) <= D(b));
+		REL(GT_u8, U8(a) > U8(b));
+		REL(GT_i8, I8(a) > I8(b));
+		REL(GT_u16, U16(a) > U16(b));
+		REL(GT_i16, I16(a) > I16(b));
+		REL(GT_u32, U32(a) > U32(b));
+		REL(GT_i32, I32(a) > I32(b));
+		REL(GT_u64, a > b);
+		REL(GT_i64, I64(a) > I64(b));
+		REL(GT_f, F(a) > F(b));
+		REL(GT_d, D(a) > D(b));
+		REL(GTEQ_u8, U8(a) >= U8(b));
+		REL(GTEQ_i8, I8(a) >= I8(b));
+		REL(GTEQ_u16, U16(a) >= U16(b));
+		REL(GTEQ_i16, I16(a) >= I16(b));
+		REL(GTEQ_u32, U32(a) >= U32(b));
+		REL(GTEQ_i32, I32(a) >= I32(b));
+		REL(GTEQ_u64, a >= b);
+		REL(GTEQ_i64, I64(a) >= I64(b));
+		REL(GTEQ_f, F(a) >= F(b));
+		REL(GTEQ_d, D(a) >= D(b));
+		REL(AND, U8(a) && U8(b));
+		REL(OR, U8(a) || U8(b));
+		REL(XOR, (U8(a) || U8(b)) && !(U8(a) && U8(b)));
+		UNARY(NOT, U8(a) ? 0 : 1);
+		ALU(AND_u8, 0, a & b);
+		ALU(AND_u16, 0, a & b);
+		ALU(AND_u32, 0, a & b);
+		ALU(AND_u64, 0, a & b);
+		ALU(OR_u8, 0, a | b);
+		ALU(OR_u16, 0, a | b);
+		ALU(OR_u32, 0, a | b);
+		ALU(OR_u64, 0, a | b);
+		ALU(XOR_u8, 0, a ^ b);
+		ALU(XOR_u16, 0, a ^ b);
+		ALU(XOR_u32, 0, a ^ b);
+		ALU(XOR_u64, 0, a ^ b);
+		UNARY(NOT_u8, U8(~a));
+		UNARY(NOT_u16, U16(~a));
+		UNARY(NOT_u32, U32(~a));
+		UNARY(NOT_u64, ~a);
+		/* the wide shifts only shift a single byte */
+		ALU(LSHFT_u8, 0, U8(U8(a) << U8(b)));
+		ALU(LSHFT_u16, 0, U16(U16(U8(a)) << U8(b)));
+		ALU(LSHFT_u32, 0, U32(U32(U8(a)) << U8(b)));
+		ALU(LSHFT_u64, 0, U64(U8(a)) << U8(b));
+		ALU(RSHFT_u8, 0, U8(U8(a) >> U8(b)));
+		ALU(RSHFT_u16, 0, U16(U16(U8(a)) >> U8(b)));
+		ALU(RSHFT_u32, 0, U32(U32(U8(a)) >> U8(b)));
+		ALU(RSHFT_u64, 0, U64(U8(a)) >> U8(b));
+		case R_K:
+			r[i->d] = i->k;
+			break;
+		case R_PUSH:
+			put_bytes(vm->stack + vm->sp, r[i->a], i->w);
+			vm->sp += i->w;
+			break;
+		case R_PUSHK:
+			put_bytes(vm->stack + vm->sp, i->k, i->w);
+			vm->sp += i->w;
+			break;
+		case R_POP:
+			vm->sp -= i->w;
+			r[i->d] = get_bytes(vm->stack + vm->sp, i->w);
+			break;
+		case R_DROP:
+			vm->sp -= i->w;
+			break;
+		case R_ARGC:
+			r[i->d] = vm->stack[vm->fp - FRAME_HEADER - 1];
+			break;
+		case R_ARG:
+		case R_ARGK:
+			n = i->op == R_ARG ? U8(r[i->a]) : i->k;
+			n = vm->fp - FRAME_HEADER - 1 - n - (i->w - 1);
+
+			/* bytes the block holds aren't on the stack yet */
+			if (n >= vm->sp || vm->sp - n < i->w) goto deopt;
+			r[i->d] = get_bytes(vm->stack + n, i->w);
+			break;
+		case R_LOAD:
+		case R_LOADK:
+			a = i->op == R_LOAD ? r[i->a] : i->k;
+			if (a < vm->env_size) {
+				r[i->d] = vm->env[a];
+				break;
+			}
+			p = env_ptr(vm, a, 1, 0);
+			if (p == NULL) goto deopt;
+			r[i->d] = *p;
+			break;
+		case R_STORE:
+		case R_STOREK:
+			a = i->op == R_STORE ? r[i->a] : i->k;
+			if (a < vm->env_size) {
+				vm->env[a] = r[i->b];
+				break;
+			}
+			p = env_ptr(vm, a, 1, 1);
+			if (p == NULL) goto deopt;
+			*p = r[i->b];
+			break;
+		case R_JMP:
+			i = rc->ir + i->k;
+			continue;
+		case R_JNZ:
+			if (U8(r[i->a])) {
+				i = rc->ir + i->k;
+				continue;
+			}
+			break;
+		case R_JMPR:
+			vm->pc = r[i->a];
+			goto resume;
+		case R_JNZR:
+			if (U8(r[i->b])) {
+				vm->pc = r[i->a];
+				goto resume;
+			}
+			break;
+		case R_CALL:
+		case R_CALLR:
+			put_bytes(vm->stack + vm->sp, i->pc, 8);
+			put_bytes(vm->stack + vm->sp + 8, vm->fp, 8);
+			vm->sp += FRAME_HEADER;
+			vm->fp = vm->sp;
+
+			if (i->op == R_CALLR) {
+				vm->pc = r[i->a];
+				goto resume;
+			}
+			i = rc->ir + i->k;
+			continue;
+		case R_FCALL:
+			vm->sp += FRAME_HEADER;
+			vm->frames[vm->csp].pc = i->pc;
+			vm->frames[vm->csp].fp = vm->fp;
+			vm->frames[vm->csp].self = vm->sp;
+			++vm->csp;
+
+			vm->fp = vm->sp;
+			i = rc->ir + i->k;
+			continue;
+		case R_TCALL:
+			argc = vm->stack[vm->sp - 1];
+			base = vm->fp - FRAME_HEADER - 1
+				- vm->stack[vm->fp - FRAME_HEADER - 1];
+
+			memcpy(header, vm->stack + vm->fp - FRAME_HEADER,
+				FRAME_HEADER);
+			memmove(vm->stack + base, vm->stack + vm->sp - argc - 1,
+				argc + 1);
+			memcpy(vm->stack + base + argc + 1, header,
+				FRAME_HEADER);
+
+			vm->sp = base + argc + 1 + FRAME_HEADER;
+			if (vm->csp > 0
+				&& vm->frames[vm->csp-1].self == vm->fp) {
+				vm->frames[vm->csp-1].self = vm->sp;
+			}
+			vm->fp = vm->sp;
+			i = rc->ir + i->k;
+			continue;
+		case R_RET:
+			a = r[i->a];
+
+			vm->sp = vm->fp - FRAME_HEADER;
+			vm->fp = get_bytes(vm->stack + vm->sp + 8, 8);
+			vm->pc = get_bytes(vm->stack + vm->sp, 8);
+
+			argc = vm->stack[--vm->sp];
+			vm->sp -= argc;
+
+			put_bytes(vm->stack + vm->sp, a, i->w);
+			vm->sp += i->w;
+			goto returned;
+		case R_RETN:
+			ret = vm->sp - i->w;
+
+			vm->sp = vm->fp - FRAME_HEADER;
+			vm->fp = get_bytes(vm->stack + vm->sp + 8, 8);
+			vm->pc = get_bytes(vm->stack + vm->sp, 8);
+
+			argc = vm->stack[--vm->sp];
+			vm->sp -= argc;
+
+			memmove(vm->stack + vm->sp, vm->stack + ret, i->w);
+			vm->sp += i->w;
+			goto returned;
+		case R_FRET:
+			ret = vm->sp - i->w;
+
+			vm->sp = vm->fp - FRAME_HEADER;
+			argc = vm->stack[--vm->sp];
+			vm->sp -= argc;
+
+			memmove(vm->stack + vm->sp, vm->stack + ret, i->w);
+			vm->sp += i->w;
+
+			--vm->csp;
+			vm->pc = vm->frames[vm->csp].pc;
+			vm->fp = vm->frames[vm->csp].fp;
+			goto returned;
+		case R_HALT:
+			vm->pc = i->pc;
+			return VM_HALT;
+		case R_EXIT:
+			return run_vm(vm, NULL, i->pc);
+		}
+
+		++i;
+		continue;
+
+returned:
+		/* as RETURNED, with the fault run_vm would have caught */
+		while (MEMO_PENDING(vm->pc)) {
+			if (memo_return(vm) == 0) continue;
+
+			if (unwind(vm) != 0) return VM_FAULT;
+			vm->exception = VM_ERR_FAULT;
+			goto resume;
+		}
+		if (vm->pc == HOST_RETURN) return VM_RETURN;
+		if (vm->pc == CORO_RETURN) coro_exit(vm);
+
+resume:
+		i = find(rc, vm->pc);
+		if (i == NULL) return run_vm(vm, NULL, vm->pc);
+	}
+
+deopt:
+	d = rc->deopts + i->x;
+	vm->sp += d->restore;
+	for (n=0; n<d->count; ++n) {
+		s = rc->slots + d->first + n;
+		a = s->konst ? s->k : r[s->reg];
+		put_bytes(vm->stack + vm->sp, a, s->w);
+		vm->sp += s->w;
+	}
+
+	return run_vm(vm, NULL, d->pc);
+}
+
+int reg_call(VM *vm, RegCode *rc, size_t pc, const uint8_t *args,
+	uint8_t nargs, uint64_t *result)
+{
+	struct host_call call;
+
+	if (begin_call(vm, args, nargs, &call) != 0) return -1;
+
+	return end_call(vm, run_reg(vm, rc, pc), &call, result);
+}
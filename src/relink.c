@@ -0,0 +1,264 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <analyze.h>
+#include <profile.h>
+#include "vm_internal.h"
+
+#define NONE ((size_t)-1)
+
+/*
+ * JMP_rel and its 4-byte displacement, for joining blocks that moved
+ * apart without tying the code to where it's loaded
+ */
+#define LINK_SIZE 5
+
+struct block {
+	size_t start, end; /* where it was in the old code */
+	size_t last; /* its last instruction */
+	size_t func; /* the block its function starts with */
+	size_t next; /* the block it falls through to, or NONE */
+	size_t at; /* where it goes in the new code */
+	uint64_t count;
+	int placed;
+	int trim; /* its closing jump goes to the block after it, so drop it */
+	int link; /* it falls through to a block that moved, so jump there */
+};
+
+/* a function's entry block, for sorting hottest first */
+struct rank {
+	uint64_t count;
+	size_t block;
+};
+
+static int hotter(const void *a, const void *b)
+{
+	const struct rank *x = a, *y = b;
+
+	if (x->count != y->count) return x->count > y->count ? -1 : 1;
+
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* the block starting at pc, which analyze_code made a leader */
+static size_t find_block(const struct block *blocks, size_t n, size_t pc)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while (lo + 1 < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (blocks[mid].start <= pc) lo = mid;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+static void put_32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* place the ran blocks of the function starting at block f */
+static size_t chain(struct block *blocks, size_t n, size_t f, size_t *order,
+	size_t k)
+{
+	size_t i, cur = f, best;
+	uint64_t most = 0;
+
+	while (1) {
+		blocks[cur].placed = 1;
+		order[k++] = cur;
+
+		/* keep the hot fall-through, saving a jump */
+		i = blocks[cur].next;
+		if (i != NONE && !blocks[i].placed && blocks[i].func == f
+			&& blocks[i].count > 0) {
+			cur = i;
+			continue;
+		}
+
+		best = NONE;
+		for (i=f; i<n && blocks[i].func == f; ++i) {
+			if (blocks[i].placed || blocks[i].count == 0) continue;
+			if (best == NONE || blocks[i].count > most) {
+				best = i;
+				most = blocks[i].count;
+			}
+		}
+		if (best == NONE) return k;
+
+		cur = best;
+	}
+}
+
+uint8_t* relink_code(const uint8_t *code, size_t size,
+	const uint64_t *counts, size_t *code_size, size_t *pcmap)
+{
+	struct block *blocks = NULL, *b;
+	struct rank *funcs = NULL;
+	size_t *order = NULL;
+	uint8_t *out = NULL;
+	const uint8_t *flags;
+	struct opinfo info;
+	size_t i, k, n = 0, nfuncs = 0, pc, next, target, at, len, total = 0;
+	CodeInfo *code_info;
+
+	code_info = get_code_info(code, size);
+	if (code_info == NULL) return NULL;
+	flags = code_info_flags(code_info);
+
+	for (pc=0; pc<size; pc=next) {
+		describe_op(code[pc], &info);
+		next = pc + 1 + info.imm;
+
+		if (info.flags & OP_INDIRECT) goto cleanup;
+		if (flags[pc] & INSN_LEADER) ++n;
+	}
+
+	blocks = calloc(n > 0 ? n : 1, sizeof(struct block));
+	funcs = malloc((n > 0 ? n : 1) * sizeof(struct rank));
+	order = malloc((n > 0 ? n : 1) * sizeof(size_t));
+	if (blocks == NULL || funcs == NULL || order == NULL) goto cleanup;
+
+	/* split the code into blocks, grouped by the function they start */
+	b = blocks;
+	for (pc=0, i=0; pc<size; pc=next) {
+		describe_op(code[pc], &info);
+		next = pc + 1 + info.imm;
+
+		if (flags[pc] & INSN_LEADER) {
+			b = &blocks[i++];
+			b->start = pc;
+			b->count = counts[pc];
+
+			if (pc == 0 || (flags[pc] & INSN_ENTRY)) {
+				b->func = i - 1;
+				if (pc != 0) {
+					funcs[nfuncs].count = b->count;
+					funcs[nfuncs++].block = i - 1;
+				}
+			} else {
+				b->func = blocks[i-2].func;
+			}
+		}
+		b->last = pc;
+		b->end = next;
+	}
+
+	for (i=0; i<n; ++i) {
+		describe_op(code[blocks[i].last], &info);
+		blocks[i].next = NONE;
+		if (!(info.flags & OP_STOP) && i + 1 < n) {
+			blocks[i].next = i + 1;
+		}
+	}
+
+	/* the function at 0 first, so code started at 0 still is */
+	k = 0;
+	if (n > 0) k = chain(blocks, n, 0, order, k);
+
+	qsort(funcs, nfuncs, sizeof(struct rank), hotter);
+	for (i=0; i<nfuncs && funcs[i].count > 0; ++i) {
+		k = chain(blocks, n, funcs[i].block, order, k);
+	}
+
+	/* what never ran keeps its order, and so most of its fall-throughs */
+	for (i=0; i<n; ++i) {
+		if (!blocks[i].placed) order[k++] = i;
+	}
+
+	for (k=0; k<n; ++k) {
+		b = &blocks[order[k]];
+		next = k + 1 < n ? order[k + 1] : NONE;
+
+		describe_op(code[b->last], &info);
+		if ((info.flags & OP_JUMP) && (info.flags & OP_STOP)
+			&& !(info.flags & OP_CALL)) {
+			branch_target(code, b->last, &info, &target);
+			b->trim = next != NONE && target == blocks[next].start;
+		}
+		b->link = b->next != NONE && b->next != next;
+
+		b->at = total;
+		total += (b->trim ? b->last : b->end) - b->start;
+		if (b->link) total += LINK_SIZE;
+	}
+
+	/* branch immediates only have 4 bytes */
+	if (total > UINT32_MAX) goto cleanup;
+
+	out = malloc(total > 0 ? total : 1);
+	if (out == NULL) goto cleanup;
+
+	for (k=0; k<n; ++k) {
+		b = &blocks[order[k]];
+		len = (b->trim ? b->last : b->end) - b->start;
+		memcpy(out + b->at, code + b->start, len);
+
+		for (pc=b->start; pc<b->start+len; pc=next) {
+			describe_op(code[pc], &info);
+			next = pc + 1 + info.imm;
+
+			if (!(info.flags & OP_JUMP)) continue;
+
+			branch_target(code, pc, &info, &target);
+			at = b->at + (pc - b->start);
+			target = blocks[find_block(blocks, n, target)].at;
+			if (info.flags & OP_REL) target -= at;
+			put_32(out + at + 1, (uint32_t)target);
+		}
+
+		if (b->link) {
+			at = b->at + len;
+			target = blocks[b->next].at - at;
+			out[at] = JMP_rel;
+			put_32(out + at + 1, (uint32_t)target);
+		}
+	}
+
+	if (pcmap != NULL) {
+		for (pc=0; pc<=size; ++pc) pcmap[pc] = (size_t)-1;
+
+		/* a dropped jump maps onto the block it went to, right after */
+		for (i=0; i<n; ++i) {
+			b = &blocks[i];
+			for (pc=b->start; pc<b->end; pc=next) {
+				describe_op(code[pc], &info);
+				next = pc + 1 + info.imm;
+				pcmap[pc] = b->at + (pc - b->start);
+			}
+		}
+		pcmap[size] = total;
+	}
+	*code_size = total;
+
+cleanup:
+	free_code_info(code_info);
+	free(blocks);
+	free(funcs);
+	free(order);
+
+	return out;
+}
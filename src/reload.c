@@ -0,0 +1,180 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <reload.h>
+#include "vm_internal.h"
+
+
+struct Code {
+	Module *module;
+	uint8_t *code;
+	uint64_t version;
+	size_t refs;
+};
+
+struct CodeSlot {
+	/*
+	 * only held to swap latest, or to take a reference to it before a
+	 * publish can drop the slot's own; never while guest code runs
+	 */
+	pthread_mutex_t lock;
+	Code *latest;
+	uint64_t version;
+};
+
+Code* make_code(Module *m)
+{
+	Code *c;
+
+	if (module_code(m, NULL) == NULL) return NULL;
+
+	c = calloc(1, sizeof(Code));
+	if (c == NULL) return NULL;
+
+	c->module = m;
+	c->code = module_code(m, NULL);
+	c->refs = 1;
+
+	return c;
+}
+
+void code_ref(Code *c)
+{
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+void code_unref(Code *c)
+{
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+	free_module(c->module);
+	free(c);
+}
+
+uint64_t code_version(Code *c)
+{
+	return c->version;
+}
+
+CodeSlot* make_code_slot(Code *c)
+{
+	CodeSlot *slot = calloc(1, sizeof(CodeSlot));
+	if (slot == NULL) return NULL;
+
+	pthread_mutex_init(&slot->lock, NULL);
+	publish_code(slot, c);
+
+	return slot;
+}
+
+void free_code_slot(CodeSlot *slot)
+{
+	code_unref(slot->latest);
+	pthread_mutex_destroy(&slot->lock);
+	free(slot);
+}
+
+void publish_code(CodeSlot *slot, Code *c)
+{
+	Code *old;
+
+	pthread_mutex_lock(&slot->lock);
+	c->version = ++slot->version;
+	old = slot->latest;
+	__atomic_store_n(&slot->latest, c, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&slot->lock);
+
+	if (old != NULL) code_unref(old);
+}
+
+Code* acquire_code(CodeSlot *slot)
+{
+	Code *c;
+
+	pthread_mutex_lock(&slot->lock);
+	c = slot->latest;
+	code_ref(c);
+	pthread_mutex_unlock(&slot->lock);
+
+	return c;
+}
+
+/*
+ * point vm at c, whose reference it takes over; or drop c and return -1
+ * if vm runs a debugger's patched copy of the code it has
+ */
+static int use_code(VM *vm, Code *c)
+{
+	const struct try_entry *tries;
+	size_t count;
+
+	if (vm->debug != NULL) {
+		code_unref(c);
+		return -1;
+	}
+
+	if (vm->version != NULL) code_unref(vm->version);
+
+	tries = module_tries(c->module, &count);
+	vm_set_try_table(vm, tries, count);
+	vm->version = c;
+	vm->code = c->code;
+
+	return 0;
+}
+
+VM* make_slot_vm(CodeSlot *slot, size_t stack_size, size_t env_size)
+{
+	Code *c = acquire_code(slot);
+	VM *vm = make_module_vm(c->module, stack_size, env_size);
+
+	if (vm == NULL) {
+		code_unref(c);
+		return NULL;
+	}
+
+	vm->slot = slot;
+	use_code(vm, c);
+
+	return vm;
+}
+
+int vm_call_latest(VM *vm, const char *name, const uint8_t *args,
+	uint8_t nargs, uint64_t *result)
+{
+	size_t pc;
+
+	/*
+	 * returning frames read their pcs against the code they came from,
+	 * as do parked coroutines, SPAWNed children and a suspended call
+	 */
+	if (vm->slot != NULL && vm->fp == 0 && vm->csp == 0
+		&& !has_coros(vm) && !has_tasks(vm) && !vm->call_suspended
+		&& __atomic_load_n(&vm->slot->latest, __ATOMIC_ACQUIRE)
+		!= vm->version) {
+		use_code(vm, acquire_code(vm->slot));
+	}
+
+	if (vm->version == NULL) return -1;
+	if (module_entry(vm->version->module, name, &pc) != 0) return -1;
+
+	return vm_call(vm, pc, args, nargs, result);
+}
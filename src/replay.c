@@ -0,0 +1,427 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <replay.h>
+#include "vm_internal.h"
+
+#define LOG_MAGIC "STKRSYS"
+#define LOG_VERSION 2
+
+/* changed env bytes fewer than this apart are logged as one write */
+#define WRITE_GAP 8
+
+struct log_header {
+	char magic[8];
+	uint64_t version;
+};
+
+/*
+ * Records follow the header back to back: a varint for the stream of
+ * the VM that made the call, the number and argument count bytes, then
+ * a varint for each argument, the zigzagged result and the env writes,
+ * each of which is a length and offset varint followed by the bytes
+ * written, and a 0 length after the last.
+ */
+struct record_index {
+	uint64_t stream;
+	size_t pos; /* of the number byte */
+};
+
+struct SyscallLog {
+	pthread_mutex_t lock;
+	uint64_t roots; /* streams given out by vm_attach_syscall_log */
+	FILE *out; /* while recording */
+	int failed;
+	uint8_t *map; /* while replaying */
+	size_t size;
+	struct record_index *index; /* by stream, then position */
+	size_t count;
+};
+
+static void put_varint(SyscallLog *log, uint64_t v)
+{
+	while (v >= 0x80) {
+		if (putc((v & 0x7F) | 0x80, log->out) == EOF) log->failed = 1;
+		v >>= 7;
+	}
+	if (putc(v, log->out) == EOF) log->failed = 1;
+}
+
+static int get_varint(const SyscallLog *log, size_t *pos, uint64_t *v)
+{
+	unsigned shift;
+
+	*v = 0;
+	for (shift = 0; *pos < log->size && shift < 64; shift += 7) {
+		uint8_t b = log->map[(*pos)++];
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return 0;
+	}
+
+	return -1;
+}
+
+SyscallLog* record_syscalls(const char *path)
+{
+	struct log_header h;
+	SyscallLog *log = calloc(1, sizeof(SyscallLog));
+	if (log == NULL) return NULL;
+
+	log->out = fopen(path, "wb");
+	if (log->out == NULL) goto cleanup;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+	h.version = LOG_VERSION;
+	if (fwrite(&h, sizeof(h), 1, log->out) != 1) goto cleanup;
+
+	pthread_mutex_init(&log->lock, NULL);
+
+	return log;
+
+cleanup:
+	if (log->out != NULL) fclose(log->out);
+	free(log);
+
+	return NULL;
+}
+
+/* step *pos past the rest of the record whose number byte it's at */
+static int skip_record(const SyscallLog *log, size_t *pos)
+{
+	uint64_t v, len;
+	uint8_t argc, i;
+
+	if (log->size - *pos < 2) return -1;
+	argc = log->map[*pos + 1];
+	*pos += 2;
+
+	/* the arguments and the result */
+	for (i = 0; i <= argc; ++i) {
+		if (get_varint(log, pos, &v) != 0) return -1;
+	}
+
+	for (;;) {
+		if (get_varint(log, pos, &len) != 0) return -1;
+		if (len == 0) return 0;
+		if (get_varint(log, pos, &v) != 0
+			|| len > log->size - *pos) return -1;
+		*pos += len;
+	}
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct record_index *x = a, *y = b;
+
+	if (x->stream != y->stream) return x->stream < y->stream ? -1 : 1;
+
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* list every record in log, sorted so each stream's are together */
+static int index_records(SyscallLog *log)
+{
+	struct record_index *grown;
+	size_t pos = sizeof(struct log_header), cap = 0;
+	uint64_t stream;
+
+	while (pos < log->size) {
+		if (get_varint(log, &pos, &stream) != 0) return -1;
+
+		if (log->count == cap) {
+			cap = cap > 0 ? cap * 2 : 64;
+			grown = realloc(log->index, cap * sizeof(*grown));
+			if (grown == NULL) return -1;
+			log->index = grown;
+		}
+		log->index[log->count].stream = stream;
+		log->index[log->count].pos = pos;
+		++log->count;
+
+		if (skip_record(log, &pos) != 0) return -1;
+	}
+
+	qsort(log->index, log->count, sizeof(*log->index), compare_records);
+
+	return 0;
+}
+
+SyscallLog* replay_syscalls(const char *path)
+{
+	struct log_header *h;
+	struct stat st;
+	SyscallLog *log = NULL;
+	uint8_t *map;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	h = (struct log_header*)map;
+	if (memcmp(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0
+		|| h->version != LOG_VERSION) goto cleanup;
+
+	log = calloc(1, sizeof(SyscallLog));
+	if (log == NULL) goto cleanup;
+
+	log->map = map;
+	log->size = st.st_size;
+	if (index_records(log) != 0) goto cleanup;
+	pthread_mutex_init(&log->lock, NULL);
+
+	return log;
+
+cleanup:
+	if (log != NULL) free(log->index);
+	free(log);
+	munmap(map, st.st_size);
+
+	return NULL;
+}
+
+int close_syscall_log(SyscallLog *log)
+{
+	int status = 0;
+
+	if (log == NULL) return 0;
+
+	if (log->out != NULL) {
+		if (fclose(log->out) != 0 || log->failed) status = -1;
+	} else {
+		munmap(log->map, log->size);
+		free(log->index);
+	}
+
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+
+	return status;
+}
+
+void vm_attach_syscall_log(VM *vm, SyscallLog *log)
+{
+	vm->syscall_log = log;
+	vm->syscall_children = 0;
+	vm->syscall_next = 0;
+	if (log == NULL) return;
+
+	pthread_mutex_lock(&log->lock);
+	vm->syscall_stream = log->roots++;
+	pthread_mutex_unlock(&log->lock);
+}
+
+void inherit_syscall_log(VM *child, VM *vm)
+{
+	uint8_t bytes[8];
+	uint64_t n;
+	int i;
+
+	child->syscall_log = vm->syscall_log;
+	child->syscall_children = 0;
+	child->syscall_next = 0;
+	if (child->syscall_log == NULL) return;
+
+	/* the parent makes its children in the same order every run */
+	n = ++vm->syscall_children;
+	for (i = 0; i < 8; ++i) bytes[i] = n >> (8 * i);
+	child->syscall_stream = hash64(bytes, sizeof(bytes),
+		vm->syscall_stream);
+}
+
+/*
+ * Return where the next run of bytes that differ between old and cur
+ * starts at or after from, setting *len to its length, or size if
+ * there's none.
+ */
+static size_t next_run(const uint8_t *old, const uint8_t *cur, size_t size,
+	size_t from, size_t *len)
+{
+	size_t start, end, i;
+
+	for (start = from; start < size && old[start] == cur[start]; ++start);
+	if (start == size) return size;
+
+	end = start + 1;
+	for (i = end; i < size && i - end < WRITE_GAP; ++i) {
+		if (old[i] != cur[i]) end = i + 1;
+	}
+	*len = end - start;
+
+	return start;
+}
+
+static uint64_t record(VM *vm, uint8_t number, uint8_t argc,
+	const uint64_t *args)
+{
+	SyscallLog *log = vm->syscall_log;
+	uint8_t *old = NULL, *cur;
+	size_t from = vm->env_size, size, off, len = 0;
+	uint64_t ret;
+	uint8_t i;
+
+	/*
+	 * only an argument pointing into env lets the call write to it, and
+	 * only from there on, so save what's past the first such one
+	 */
+	for (i = 0; i < argc; ++i) {
+		off = (uintptr_t)args[i] - (uintptr_t)vm->env;
+		if (off < from) from = off;
+	}
+	size = vm->env_size - from;
+	cur = vm->env + from;
+	if (size > 0) {
+		old = malloc(size);
+		if (old != NULL) memcpy(old, cur, size);
+	}
+
+	ret = syscall(number, args[0], args[1], args[2], args[3], args[4]);
+
+	pthread_mutex_lock(&log->lock);
+
+	/* a write we couldn't look for would spoil the replay */
+	if (size > 0 && old == NULL) log->failed = 1;
+
+	put_varint(log, vm->syscall_stream);
+	putc(number, log->out);
+	putc(argc, log->out);
+	for (i = 0; i < argc; ++i) put_varint(log, args[i]);
+	put_varint(log, (ret << 1) ^ (0 - (ret >> 63)));
+
+	off = old != NULL ? next_run(old, cur, size, 0, &len) : size;
+	for (; off < size; off = next_run(old, cur, size, off + len, &len)) {
+		put_varint(log, len);
+		put_varint(log, from + off);
+		if (fwrite(cur + off, 1, len, log->out) != len) {
+			log->failed = 1;
+		}
+	}
+	put_varint(log, 0);
+
+	if (ferror(log->out)) log->failed = 1;
+
+	pthread_mutex_unlock(&log->lock);
+
+	free(old);
+
+	return ret;
+}
+
+/* find the first record of stream, or where it would be */
+static size_t first_record(const SyscallLog *log, uint64_t stream)
+{
+	size_t lo = 0, hi = log->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->index[mid].stream < stream) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Serve vm's next logged SYSCALL, returning -1 if it isn't this one. The
+ * arguments aren't compared since pointers into env move between runs.
+ * The log isn't changed, and each VM keeps its own place in it, so this
+ * needs no lock.
+ */
+static int replay(VM *vm, uint8_t number, uint8_t argc, uint64_t *ret)
+{
+	SyscallLog *log = vm->syscall_log;
+	uint64_t v, off, len;
+	size_t k, pos;
+	uint8_t i;
+
+	k = vm->syscall_next > 0 ? vm->syscall_next - 1
+		: first_record(log, vm->syscall_stream);
+	if (k >= log->count || log->index[k].stream != vm->syscall_stream) {
+		return -1;
+	}
+
+	/* index_records checked the whole record is there */
+	pos = log->index[k].pos;
+	if (log->map[pos] != number || log->map[pos + 1] != argc) return -1;
+	pos += 2;
+
+	for (i = 0; i < argc; ++i) get_varint(log, &pos, &v);
+
+	get_varint(log, &pos, &v);
+	*ret = (v >> 1) ^ (0 - (v & 1));
+
+	for (;;) {
+		get_varint(log, &pos, &len);
+		if (len == 0) break;
+		get_varint(log, &pos, &off);
+		if (off > vm->env_size || len > vm->env_size - off) return -1;
+
+		memcpy(vm->env + off, log->map + pos, len);
+		pos += len;
+	}
+
+	vm->syscall_next = k + 2;
+
+	return 0;
+}
+
+int syscall_op(VM *vm)
+{
+	uint64_t args[5], ret, buf;
+	uint8_t argc, number, i;
+
+	argc = POP(vm);
+	if (argc > 5) return 0;
+
+	memset(args, 0, sizeof(args));
+	for (i = 0; i < argc; ++i) {
+		POP_64(vm, args[i], buf);
+	}
+	number = POP(vm);
+
+	if (vm->syscall_log == NULL) {
+		ret = syscall(number, args[0], args[1], args[2], args[3],
+			args[4]);
+	} else if (vm->syscall_log->out != NULL) {
+		ret = record(vm, number, argc, args);
+	} else if (replay(vm, number, argc, &ret) != 0) {
+		return VM_FAULT;
+	}
+
+	PUSH_64(vm, ret);
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <segment.h>
+
+
+struct Segment {
+	int fd;
+	void *base;
+	size_t size;
+};
+
+static Segment* map_segment(int fd)
+{
+	struct stat st;
+	Segment *s;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) return NULL;
+
+	s = malloc(sizeof(Segment));
+	if (s == NULL) return NULL;
+
+	s->base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (s->base == MAP_FAILED) {
+		free(s);
+		return NULL;
+	}
+	s->fd = fd;
+	s->size = st.st_size;
+
+	return s;
+}
+
+Segment* make_segment(const char *name, size_t size)
+{
+	Segment *s;
+	int fd;
+
+	if (name != NULL) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} else {
+		fd = memfd_create("stacker-segment", 0);
+	}
+	if (fd < 0) return NULL;
+
+	if (ftruncate(fd, size) != 0) goto cleanup;
+
+	s = map_segment(fd);
+	if (s == NULL) goto cleanup;
+
+	return s;
+
+cleanup:
+	close(fd);
+	if (name != NULL) shm_unlink(name);
+
+	return NULL;
+}
+
+Segment* open_segment(const char *name)
+{
+	Segment *s;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) return NULL;
+
+	s = map_segment(fd);
+	if (s == NULL) close(fd);
+
+	return s;
+}
+
+Segment* open_segment_fd(int fd)
+{
+	return map_segment(fd);
+}
+
+void free_segment(Segment *s)
+{
+	munmap(s->base, s->size);
+	close(s->fd);
+	free(s);
+}
+
+int unlink_segment(const char *name)
+{
+	return shm_unlink(name);
+}
+
+int segment_fd(Segment *s)
+{
+	return s->fd;
+}
+
+void* segment_base(Segment *s)
+{
+	return s->base;
+}
+
+size_t segment_size(Segment *s)
+{
+	return s->size;
+}
+
+int vm_attach_segment(VM *vm, size_t addr, Segment *s, int flags)
+{
+	return vm_bind_env(vm, addr, s->base, s->size, flags);
+}
@@ -0,0 +1,230 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+
+static const uint8_t widths[] = {1, 1, 2, 2, 4, 4, 8, 8, 4, 8};
+
+/*
+ * map a native-endian element to a u64 that orders the same way when
+ * compared unsigned: flip the sign bit of ints, and for floats flip
+ * every bit of negatives but only the sign bit of positives. Floats are
+ * made canonical first, so -0.0 keys like +0.0 and every NaN like one
+ * quiet NaN, above +inf.
+ */
+static uint64_t sort_key(const uint8_t *p, uint8_t type)
+{
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch (type) {
+	case TYPE_u8:
+		return *p;
+	case TYPE_i8:
+		return (uint8_t)(*p ^ 0x80);
+	case TYPE_u16:
+		memcpy(&v16, p, 2);
+		return v16;
+	case TYPE_i16:
+		memcpy(&v16, p, 2);
+		return (uint16_t)(v16 ^ 0x8000);
+	case TYPE_u32:
+		memcpy(&v32, p, 4);
+		return v32;
+	case TYPE_i32:
+		memcpy(&v32, p, 4);
+		return v32 ^ UINT32_C(0x80000000);
+	case TYPE_f:
+		memcpy(&v32, p, 4);
+		if ((v32 & UINT32_C(0x7FFFFFFF)) == 0) v32 = 0;
+		if ((v32 & UINT32_C(0x7FFFFFFF)) > UINT32_C(0x7F800000)) {
+			v32 = UINT32_C(0x7FC00000);
+		}
+		return v32 & UINT32_C(0x80000000) ? (uint32_t)~v32
+			: v32 | UINT32_C(0x80000000);
+	case TYPE_u64:
+		memcpy(&v64, p, 8);
+		return v64;
+	case TYPE_i64:
+		memcpy(&v64, p, 8);
+		return v64 ^ UINT64_C(0x8000000000000000);
+	default:
+		memcpy(&v64, p, 8);
+		if ((v64 & UINT64_C(0x7FFFFFFFFFFFFFFF)) == 0) v64 = 0;
+		if ((v64 & UINT64_C(0x7FFFFFFFFFFFFFFF))
+			> UINT64_C(0x7FF0000000000000)) {
+			v64 = UINT64_C(0x7FF8000000000000);
+		}
+		return v64 & UINT64_C(0x8000000000000000) ? ~v64
+			: v64 | UINT64_C(0x8000000000000000);
+	}
+}
+
+/*
+ * stable LSD radix sort of count items of size bytes, keyed by the
+ * element of type at off in each. All the byte histograms are counted
+ * in one pass, and passes where every key shares the byte are skipped.
+ */
+static int radix_sort(uint8_t *base, size_t count, size_t size, size_t off,
+	uint8_t type)
+{
+	size_t (*counts)[256];
+	size_t i, pass, width = widths[type], sum, n;
+	uint8_t *src = base, *dst, *tmp, *item;
+	uint64_t key;
+
+	if (count < 2) return 0;
+
+	counts = calloc(width, sizeof(*counts));
+	tmp = malloc(count * size);
+	if (counts == NULL || tmp == NULL) {
+		free(counts);
+		free(tmp);
+		return -1;
+	}
+	dst = tmp;
+
+	for (i=0; i<count; ++i) {
+		key = sort_key(base + i * size + off, type);
+		for (pass=0; pass<width; ++pass) {
+			++counts[pass][(key >> (8*pass)) & 0xFF];
+		}
+	}
+
+	for (pass=0; pass<width; ++pass) {
+		if (counts[pass][(sort_key(src + off, type) >> (8*pass)) & 0xFF]
+			== count) continue;
+
+		for (sum=0, i=0; i<256; ++i) {
+			n = counts[pass][i];
+			counts[pass][i] = sum;
+			sum += n;
+		}
+
+		for (i=0, item=src; i<count; ++i, item+=size) {
+			key = sort_key(item + off, type);
+			n = counts[pass][(key >> (8*pass)) & 0xFF]++;
+			memcpy(dst + n * size, item, size);
+		}
+
+		item = src;
+		src = dst;
+		dst = item;
+	}
+
+	if (src != base) memcpy(base, src, count * size);
+
+	free(counts);
+	free(tmp);
+
+	return 0;
+}
+
+static void swap(uint8_t *a, uint8_t *b, size_t size)
+{
+	uint8_t t;
+
+	while (size--) {
+		t = *a;
+		*a++ = *b;
+		*b++ = t;
+	}
+}
+
+/* move the elements less than pivot first, returning how many there are */
+static size_t partition(uint8_t *base, size_t count, uint8_t type,
+	uint64_t pivot)
+{
+	size_t width = widths[type], lo = 0, hi = count;
+
+	while (1) {
+		while (lo < hi && sort_key(base + lo * width, type) < pivot) ++lo;
+		while (lo < hi && sort_key(base + (hi-1) * width, type) >= pivot) {
+			--hi;
+		}
+		if (lo >= hi) return lo;
+
+		swap(base + lo * width, base + (hi-1) * width, width);
+	}
+}
+
+/* the index of the first element not less than key */
+static size_t lower_bound(const uint8_t *base, size_t count, uint8_t type,
+	uint64_t key)
+{
+	size_t width = widths[type], lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sort_key(base + mid * width, type) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+int sort_op(VM *vm, uint8_t opcode)
+{
+	uint64_t addr, count, key_addr, buf;
+	uint32_t size, off, buf32;
+	uint8_t type, *base, *key;
+
+	type = POP(vm);
+	if (type > TYPE_d) return VM_FAULT;
+
+	size = widths[type];
+	off = 0;
+	key_addr = 0;
+	if (opcode == SORT_rec) {
+		POP_32(vm, off, buf32);
+		POP_32(vm, size, buf32);
+		if (off > size || widths[type] > size - off) return VM_FAULT;
+	} else if (opcode != SORT) {
+		POP_64(vm, key_addr, buf);
+	}
+	POP_64(vm, count, buf);
+	POP_64(vm, addr, buf);
+
+	if (count > SIZE_MAX / size) return VM_FAULT;
+	base = env_ptr(vm, addr, count * size, opcode != BSEARCH);
+	if (base == NULL) return VM_FAULT;
+
+	if (opcode == SORT || opcode == SORT_rec) {
+		return radix_sort(base, count, size, off, type) == 0 ? 0 : VM_FAULT;
+	}
+
+	key = env_ptr(vm, key_addr, size, 0);
+	if (key == NULL) return VM_FAULT;
+
+	if (opcode == PARTITION) {
+		count = partition(base, count, type, sort_key(key, type));
+	} else {
+		count = lower_bound(base, count, type, sort_key(key, type));
+	}
+	PUSH_64(vm, count);
+
+	return 0;
+}
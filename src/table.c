@@ -0,0 +1,171 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include "vm_internal.h"
+
+/*
+ * An open-addressing hash table that lives in env, so guests and clones
+ * see it like any other data. The header is followed by capacity slots,
+ * each a control byte, the key and the value. Everything is native-endian.
+ */
+struct table_header {
+	uint64_t capacity; /* a power of two */
+	uint64_t count; /* live keys */
+	uint32_t key_size;
+	uint32_t value_size;
+};
+
+/* control bytes: full slots hold 7 bits of the hash to skip most compares */
+#define SLOT_EMPTY 0x00
+#define SLOT_DELETED 0x01
+#define SLOT_FULL 0x80
+#define TAG(h) (SLOT_FULL | (uint8_t)((h) >> 57))
+
+#define SLOT_SIZE(h) (1 + (size_t)(h).key_size + (h).value_size)
+
+/*
+ * find the table at addr, or NULL if it doesn't fit where it claims to or
+ * isn't writable when write is set
+ */
+static uint8_t* find_table(VM *vm, uint64_t addr, struct table_header *h,
+	int write)
+{
+	uint8_t *p = env_ptr(vm, addr, sizeof(*h), write);
+	if (p == NULL) return NULL;
+
+	memcpy(h, p, sizeof(*h));
+	if (h->capacity == 0 || h->capacity & (h->capacity - 1)) return NULL;
+	if (h->capacity > (SIZE_MAX - sizeof(*h)) / SLOT_SIZE(*h)) return NULL;
+
+	return env_ptr(vm, addr, sizeof(*h) + h->capacity * SLOT_SIZE(*h),
+		write);
+}
+
+/*
+ * the slot holding key, or else the first free slot on its probe
+ * sequence, or NULL if it isn't there and the table is full
+ */
+static uint8_t* probe(uint8_t *table, const struct table_header *h,
+	const uint8_t *key, int *found)
+{
+	uint64_t hash = hash64(key, h->key_size, 0);
+	size_t mask = h->capacity - 1, size = SLOT_SIZE(*h), i, n;
+	uint8_t *slot, *free_slot = NULL;
+
+	*found = 0;
+	for (i=hash&mask, n=0; n<h->capacity; i=(i+1)&mask, ++n) {
+		slot = table + sizeof(*h) + i * size;
+
+		if (*slot == SLOT_EMPTY) return free_slot != NULL ? free_slot : slot;
+
+		if (*slot == SLOT_DELETED) {
+			if (free_slot == NULL) free_slot = slot;
+		} else if (*slot == TAG(hash)
+			&& memcmp(slot + 1, key, h->key_size) == 0) {
+			*found = 1;
+			return slot;
+		}
+	}
+
+	return free_slot;
+}
+
+int table_op(VM *vm, uint8_t opcode)
+{
+	struct table_header h;
+	uint64_t addr, key_addr, value_addr, capacity, buf;
+	uint16_t key_size, value_size, buf16;
+	uint8_t *table, *key, *value, *slot;
+	int found;
+
+	POP_64(vm, addr, buf);
+
+	if (opcode == HT_INIT) {
+		POP_16(vm, value_size, buf16);
+		POP_16(vm, key_size, buf16);
+		POP_64(vm, capacity, buf);
+
+		h.capacity = capacity;
+		h.count = 0;
+		h.key_size = key_size;
+		h.value_size = value_size;
+
+		if (capacity == 0 || capacity & (capacity - 1)) return VM_FAULT;
+		if (capacity > (SIZE_MAX - sizeof(h)) / SLOT_SIZE(h)) {
+			return VM_FAULT;
+		}
+
+		table = env_ptr(vm, addr, sizeof(h) + capacity * SLOT_SIZE(h), 1);
+		if (table == NULL) return VM_FAULT;
+
+		memcpy(table, &h, sizeof(h));
+		for (slot=table+sizeof(h); capacity--; slot+=SLOT_SIZE(h)) {
+			*slot = SLOT_EMPTY;
+		}
+
+		return 0;
+	}
+
+	/* lookups work on tables in read-only windows */
+	table = find_table(vm, addr, &h, opcode != HT_LOOKUP);
+	if (table == NULL) return VM_FAULT;
+
+	if (opcode == HT_INSERT) {
+		POP_64(vm, value_addr, buf);
+	}
+	POP_64(vm, key_addr, buf);
+
+	key = env_ptr(vm, key_addr, h.key_size, 0);
+	if (key == NULL) return VM_FAULT;
+
+	slot = probe(table, &h, key, &found);
+
+	if (opcode == HT_INSERT) {
+		value = env_ptr(vm, value_addr, h.value_size, 0);
+		if (value == NULL) return VM_FAULT;
+
+		if (slot == NULL) {
+			PUSH(vm, 0);
+			return 0;
+		}
+
+		if (!found) {
+			*slot = TAG(hash64(key, h.key_size, 0));
+			memmove(slot + 1, key, h.key_size);
+			++h.count;
+			memcpy(table, &h, sizeof(h));
+		}
+		memmove(slot + 1 + h.key_size, value, h.value_size);
+		PUSH(vm, 1);
+	} else if (opcode == HT_LOOKUP) {
+		/* the header comes first, so no value lives at 0 */
+		addr = found ? addr + (slot + 1 + h.key_size - table) : 0;
+		PUSH_64(vm, addr);
+	} else {
+		if (found) {
+			*slot = SLOT_DELETED;
+			--h.count;
+			memcpy(table, &h, sizeof(h));
+		}
+		PUSH(vm, found);
+	}
+
+	return 0;
+}
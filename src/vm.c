@@ -21,53 +21,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <vm.h>
+#include "vm_internal.h"
 
 
-#define PUSH(vm, v) (vm)->stack[(vm)->sp++] = (v) /* push v onto data stack */
-#define POP(vm) (vm)->stack[--(vm)->sp] /* pop from data stack */
-#define GETCODE(vm) (vm)->code[(vm)->pc++] /* get next opcode */
-
-#define PUSH_16(vm, v) \
-	PUSH((vm), ((v) >> 8) & 0xFF); \
-	PUSH((vm), (v) & 0xFF)
-
-#define PUSH_32(vm, v) \
-	PUSH((vm), ((v) >> 24) & 0xFF); \
-	PUSH((vm), ((v) >> 16) & 0xFF); \
-	PUSH_16((vm), (v))
-
-#define PUSH_64(vm, v) \
-	PUSH((vm), ((v) >> 56) & 0xFF); \
-	PUSH((vm), ((v) >> 48) & 0xFF); \
-	PUSH((vm), ((v) >> 40) & 0xFF); \
-	PUSH((vm), ((v) >> 32) & 0xFF); \
-	PUSH_32((vm), (v))
-
-#define POP_16(vm, v, buf) \
-	(buf) = POP((vm)); \
-	(v) = (buf); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 8)
-
-#define POP_32(vm, v, buf) \
-	POP_16((vm), (v), (buf)); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 16); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 24)
-
-#define POP_64(vm, v, buf) \
-	POP_32((vm), (v), (buf)); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 32); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 40); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 48); \
-	(buf) = POP((vm)); \
-	(v) |= ((buf) << 56)
+/* addresses past env are checked against the host windows */
+#define LOAD(vm, addr) \
+	if ((addr) < (vm)->env_size) { \
+		PUSH((vm), (vm)->env[(addr)]); \
+	} else { \
+		uint8_t *p = env_ptr((vm), (addr), 1, 0); \
+		if (p == NULL) return VM_FAULT; \
+		PUSH((vm), *p); \
+	}
+
+#define STORE(vm, addr, val) \
+	if ((addr) < (vm)->env_size) { \
+		(vm)->env[(addr)] = (val); \
+	} else { \
+		uint8_t *p = env_ptr((vm), (addr), 1, 1); \
+		if (p == NULL) return VM_FAULT; \
+		*p = (val); \
+	}
+
+/* read a 4-byte big-endian immediate from the code stream */
+#define GETCODE_32(vm, v) \
+	(v) = (uint32_t)(vm)->code[(vm)->pc] << 24 \
+		| (uint32_t)(vm)->code[(vm)->pc + 1] << 16 \
+		| (uint32_t)(vm)->code[(vm)->pc + 2] << 8 \
+		| (uint32_t)(vm)->code[(vm)->pc + 3]; \
+	(vm)->pc += 4
 
 #define BINARY_u8(vm, op) \
 	uint8_t b = POP((vm)); \
@@ -344,7 +328,111 @@
 \
 	PUSH((vm), ret)
 
-static uint32_t serialize_float(float x)
+/* push the width-byte arg whose last byte is the one ARG would read */
+#define ARG_n(vm, width) \
+	uint8_t arg_num = POP((vm)); \
+	size_t arg = (vm)->fp - FRAME_HEADER - 1 - arg_num - ((width) - 1); \
+\
+	memcpy((vm)->stack + (vm)->sp, (vm)->stack + arg, (width)); \
+	(vm)->sp += (width)
+
+/* throw VM_ERR_DIV instead of dividing by zero or overflowing */
+#define DIVIDE(vm, width, sign, binary, op) \
+	if (bad_divide((vm)->stack + (vm)->sp, (width), (sign))) { \
+		(vm)->exception = VM_ERR_DIV; \
+		return VM_FAULT; \
+	} else { \
+		binary((vm), op); \
+	}
+
+/*
+ * leave run_vm, or the coroutine, if the frame returned to was entered so.
+ * A PURE function tail calling another has both calls pending on one frame.
+ */
+#define RETURNED(vm) \
+	while (MEMO_PENDING((vm)->pc)) { \
+		if (memo_return((vm)) != 0) return VM_FAULT; \
+	} \
+	if ((vm)->pc == HOST_RETURN) return VM_RETURN; \
+	if ((vm)->pc == CORO_RETURN) coro_exit((vm))
+
+/* single bytes, so the atomics can paste their width onto PUSH_ and POP_ */
+#define PUSH_8(vm, v) PUSH((vm), (v))
+#define POP_8(vm, v, buf) (void)(buf); (v) = POP((vm))
+
+/*
+ * pop the address and find the aligned value it names, or fault; write is
+ * set for everything but loads, which read-only windows allow
+ */
+#define ATOMIC_ADDR(vm, type, p, write) \
+	uint64_t addr, abuf; \
+	type *p; \
+\
+	POP_64((vm), addr, abuf); \
+	p = atomic_ptr((vm), addr, sizeof(type), (write)); \
+	if (p == NULL) return VM_FAULT
+
+#define ALOAD_n(vm, type, bits) \
+	type val; \
+	ATOMIC_ADDR((vm), type, p, 0); \
+\
+	val = __atomic_load_n(p, __ATOMIC_SEQ_CST); \
+	PUSH_##bits((vm), val)
+
+#define ASTORE_n(vm, type, bits) \
+	type val, buf; \
+	ATOMIC_ADDR((vm), type, p, 1); \
+\
+	POP_##bits((vm), val, buf); \
+	__atomic_store_n(p, val, __ATOMIC_SEQ_CST)
+
+/* read-modify-write with an __atomic builtin, pushing the old value */
+#define RMW_n(vm, type, bits, builtin) \
+	type val, buf; \
+	ATOMIC_ADDR((vm), type, p, 1); \
+\
+	POP_##bits((vm), val, buf); \
+	val = builtin(p, val, __ATOMIC_SEQ_CST); \
+	PUSH_##bits((vm), val)
+
+#define CAS_n(vm, type, bits) \
+	type expected, desired, buf; \
+	uint8_t swapped; \
+	ATOMIC_ADDR((vm), type, p, 1); \
+\
+	POP_##bits((vm), desired, buf); \
+	POP_##bits((vm), expected, buf); \
+	swapped = __atomic_compare_exchange_n(p, &expected, desired, 0, \
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	PUSH_##bits((vm), expected); \
+	PUSH((vm), swapped)
+
+/*
+ * check the two width-byte operands below top: the divisor must not be 0,
+ * and signed division of the minimum by -1 traps on some hosts as well.
+ * Narrower operands are promoted to int, so only 32 and 64 bits can trap.
+ */
+static int bad_divide(const uint8_t *top, size_t width, int sign)
+{
+	const uint8_t *b = top - width, *a = b - width;
+	int zero = 1, ones = 1;
+	size_t i;
+
+	for (i=0; i<width; ++i) {
+		if (b[i] != 0x00) zero = 0;
+		if (b[i] != 0xFF) ones = 0;
+	}
+	if (zero) return 1;
+	if (!sign || width < 4 || !ones || a[0] != 0x80) return 0;
+
+	for (i=1; i<width; ++i) {
+		if (a[i] != 0x00) return 0;
+	}
+
+	return 1;
+}
+
+uint32_t serialize_float(float x)
 {
 	uint32_t ret, xx;
 	uint8_t b;
@@ -356,13 +444,13 @@ static uint32_t serialize_float(float x)
 	ret = 0;
 	for (i=0; i<len; ++i) {
 		b = (xx >> (8*i)) & 0xFF;
-		ret |= b << ((len - 1 - i) * 8);
+		ret |= (uint32_t)b << ((len - 1 - i) * 8);
 	}
 
 	return ret;
 }
 
-static float deserialize_float(uint32_t x)
+float deserialize_float(uint32_t x)
 {
 	uint32_t xx;
 	uint8_t b;
@@ -373,7 +461,7 @@ static float deserialize_float(uint32_t x)
 	xx = 0;
 	for (i=0; i<len; ++i) {
 		b = (x >> 8*i) & 0xFF;
-		xx |= b << ((len - 1 - i) * 8);
+		xx |= (uint32_t)b << ((len - 1 - i) * 8);
 	}
 
 	memcpy(&ret, &xx, len);
@@ -381,7 +469,7 @@ static float deserialize_float(uint32_t x)
 	return ret;
 }
 
-static uint64_t serialize_double(double x)
+uint64_t serialize_double(double x)
 {
 	uint64_t ret, xx;
 	uint8_t b;
@@ -393,13 +481,13 @@ static uint64_t serialize_double(double x)
 	ret = 0;
 	for (i=0; i<len; ++i) {
 		b = (xx >> (8*i)) & 0xFF;
-		ret |= b << ((len - 1 - i) * 8);
+		ret |= (uint64_t)b << ((len - 1 - i) * 8);
 	}
 
 	return ret;
 }
 
-static double deserialize_double(uint64_t x)
+double deserialize_double(uint64_t x)
 {
 	uint64_t xx;
 	uint8_t b;
@@ -410,7 +498,7 @@ static double deserialize_double(uint64_t x)
 	xx = 0;
 	for (i=0; i<len; ++i) {
 		b = (x >> 8*i) & 0xFF;
-		xx |= b << ((len - 1 - i) * 8);
+		xx |= (uint64_t)b << ((len - 1 - i) * 8);
 	}
 
 	memcpy(&ret, &xx, len);
@@ -418,22 +506,14 @@ static double deserialize_double(uint64_t x)
 	return ret;
 }
 
-struct VM {
-	uint8_t *env; /* variable env */
-
-	uint8_t *code; /* executable code */
-	uint8_t *stack; /* data stack */
-
-	size_t pc; /* program counter */
-	size_t sp; /* stack pointer */
-	size_t fp; /* frame pointer */
-};
-
 VM* make_vm(uint8_t *code, size_t stack_size, size_t env_size)
 {
-	VM *vm = malloc(sizeof(VM));
+	VM *vm = calloc(1, sizeof(VM));
 	if (vm == NULL) goto cleanup;
 
+	vm->frames = malloc(MAX_FRAMES(stack_size) * sizeof(struct frame));
+	if (vm->frames == NULL) goto cleanup;
+
 	vm->stack = malloc(stack_size * sizeof(uint8_t));
 	if (vm->stack == NULL) goto cleanup;
 
@@ -441,14 +521,19 @@ VM* make_vm(uint8_t *code, size_t stack_size, size_t env_size)
 	if (vm->env == NULL) goto cleanup;
 
 	vm->code = code;
+	vm->stack_size = stack_size;
+	vm->env_size = env_size;
 	vm->pc = 0;
 	vm->fp = 0;
 	vm->sp = 0;
+	vm->csp = 0;
+	vm->image_fd = -1;
 
 	return vm;
 
 cleanup:
 	if (vm != NULL) {
+		free(vm->frames);
 		free(vm->stack);
 		free(vm->env);
 		free(vm);
@@ -459,21 +544,36 @@ cleanup:
 
 void free_vm(VM *vm)
 {
-	free(vm->stack);
-	free(vm->env);
+	free_tasks(vm);
+	free_coros(vm);
+	if (vm->version != NULL) code_unref(vm->version);
+	free(vm->frames);
+	free(vm->windows);
+	free(vm->channels);
+	free(vm->ports);
+	free(vm->pending);
+	if (vm->map != NULL) {
+		munmap(vm->map, vm->map_size);
+	} else {
+		free(vm->stack);
+		free(vm->env);
+	}
+	if (vm->image_fd >= 0) close(vm->image_fd);
 	free(vm);
 }
 
-int run_vm(VM *vm, uint8_t *code, size_t pc)
+/*
+ * the interpreter proper: run until something makes run_vm return, or
+ * until a THROW or fault that run_vm may be able to catch
+ */
+static int run(VM *vm)
 {
 	uint8_t opcode;
 
-	vm->pc = pc;
-	if (code != NULL) vm->code=code;
-
 	while (1) {
 		opcode = GETCODE(vm); /* get next instruction */
 
+dispatch:
 		if (opcode == ADD_u8) {
 			BINARY_u8_PROM(vm, +);
 		} else if (opcode == ADD_i8) {
@@ -535,41 +635,41 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 		} else if (opcode == MUL_d) {
 			BINARY_d(vm, *);
 		} else if (opcode == DIV_u8) {
-			BINARY_u8(vm, /);
+			DIVIDE(vm, 1, 0, BINARY_u8, /);
 		} else if (opcode == DIV_i8) {
-			BINARY_i8(vm, /);
+			DIVIDE(vm, 1, 1, BINARY_i8, /);
 		} else if (opcode == DIV_u16) {
-			BINARY_u16(vm, /);
+			DIVIDE(vm, 2, 0, BINARY_u16, /);
 		} else if (opcode == DIV_i16) {
-			BINARY_i16(vm, /);
+			DIVIDE(vm, 2, 1, BINARY_i16, /);
 		} else if (opcode == DIV_u32) {
-			BINARY_u32(vm, /);
+			DIVIDE(vm, 4, 0, BINARY_u32, /);
 		} else if (opcode == DIV_i32) {
-			BINARY_i32(vm, /);
+			DIVIDE(vm, 4, 1, BINARY_i32, /);
 		} else if (opcode == DIV_u64) {
-			BINARY_u64(vm, /);
+			DIVIDE(vm, 8, 0, BINARY_u64, /);
 		} else if (opcode == DIV_i64) {
-			BINARY_i64(vm, /);
+			DIVIDE(vm, 8, 1, BINARY_i64, /);
 		} else if (opcode == DIV_f) {
 			BINARY_f(vm, /);
 		} else if (opcode == DIV_d) {
 			BINARY_d(vm, /);
 		} else if (opcode == MOD_u8) {
-			BINARY_u8(vm, %);
+			DIVIDE(vm, 1, 0, BINARY_u8, %);
 		} else if (opcode == MOD_i8) {
-			BINARY_i8(vm, %);
+			DIVIDE(vm, 1, 1, BINARY_i8, %);
 		} else if (opcode == MOD_u16) {
-			BINARY_u16(vm, %);
+			DIVIDE(vm, 2, 0, BINARY_u16, %);
 		} else if (opcode == MOD_i16) {
-			BINARY_i16(vm, %);
+			DIVIDE(vm, 2, 1, BINARY_i16, %);
 		} else if (opcode == MOD_u32) {
-			BINARY_u32(vm, %);
+			DIVIDE(vm, 4, 0, BINARY_u32, %);
 		} else if (opcode == MOD_i32) {
-			BINARY_i32(vm, %);
+			DIVIDE(vm, 4, 1, BINARY_i32, %);
 		} else if (opcode == MOD_u64) {
-			BINARY_u64(vm, %);
+			DIVIDE(vm, 8, 0, BINARY_u64, %);
 		} else if (opcode == MOD_i64) {
-			BINARY_i64(vm, %);
+			DIVIDE(vm, 8, 1, BINARY_i64, %);
 		} else if (opcode == EQ_u8) {
 			REL_u8(vm, ==);
 		} else if (opcode == EQ_u16) {
@@ -851,24 +951,24 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			vm->sp -= 8;
 		} else if (opcode == LOAD_u8) {
 			uint8_t a = POP(vm);
-			PUSH(vm, vm->env[a]);
+			LOAD(vm, a);
 		} else if (opcode == LOAD_u16) {
 			uint16_t a, buf;
 			POP_16(vm, a, buf);
-			PUSH(vm, vm->env[a]);
+			LOAD(vm, a);
 		} else if (opcode == LOAD_u32) {
 			uint32_t a, buf;
 			POP_32(vm, a, buf);
-			PUSH(vm, vm->env[a]);
+			LOAD(vm, a);
 		} else if (opcode == LOAD_u64) {
 			uint64_t a, buf;
 			POP_64(vm, a, buf);
-			PUSH(vm, vm->env[a]);
+			LOAD(vm, a);
 		} else if (opcode == STORE_u8) {
 			uint8_t addr = POP(vm);
 			uint8_t val = POP(vm);
 
-			vm->env[addr] = val;
+			STORE(vm, addr, val);
 		} else if (opcode == STORE_u16) {
 			uint8_t val;
 			uint16_t addr, buf;
@@ -876,7 +976,7 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			POP_16(vm, addr, buf);
 			val = POP(vm);
 
-			vm->env[addr] = val;
+			STORE(vm, addr, val);
 		} else if (opcode == STORE_u32) {
 			uint8_t val;
 			uint32_t addr, buf;
@@ -884,7 +984,7 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			POP_32(vm, addr, buf);
 			val = POP(vm);
 
-			vm->env[addr] = val;
+			STORE(vm, addr, val);
 		} else if (opcode == STORE_u64) {
 			uint8_t val;
 			uint64_t addr, buf;
@@ -892,7 +992,7 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			POP_64(vm, addr, buf);
 			val = POP(vm);
 
-			vm->env[addr] = val;
+			STORE(vm, addr, val);
 		} else if (opcode == CALL_u8) {
 			/* we expect a uint8_t as the first arg: argc */
 			uint8_t addr = POP(vm);
@@ -943,6 +1043,8 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			vm->sp -= argc;
 
 			PUSH(vm, val);
+
+			RETURNED(vm);
 		} else if (opcode == RET_u16) {
 			uint8_t argc;
 			uint16_t val;
@@ -957,7 +1059,9 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			argc = POP(vm);
 			vm->sp -= argc;
 
-			PUSH(vm, val);
+			PUSH_16(vm, val);
+
+			RETURNED(vm);
 		} else if (opcode == RET_u32) {
 			uint8_t argc;
 			uint32_t val;
@@ -972,7 +1076,9 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			argc = POP(vm);
 			vm->sp -= argc;
 
-			PUSH(vm, val);
+			PUSH_32(vm, val);
+
+			RETURNED(vm);
 		} else if (opcode == RET_u64) {
 			uint8_t argc;
 			uint64_t val;
@@ -987,69 +1093,286 @@ int run_vm(VM *vm, uint8_t *code, size_t pc)
 			argc = POP(vm);
 			vm->sp -= argc;
 
-			PUSH(vm, val);
+			PUSH_64(vm, val);
+
+			RETURNED(vm);
+		} else if (opcode == RETN) {
+			uint8_t n = GETCODE(vm);
+			size_t ret = vm->sp - n;
+			uint8_t argc;
+			uint64_t buf;
+
+			vm->sp = vm->fp;
+			POP_64(vm, vm->fp, buf);
+			POP_64(vm, vm->pc, buf);
+
+			argc = POP(vm);
+			vm->sp -= argc;
+
+			memmove(vm->stack + vm->sp, vm->stack + ret, n);
+			vm->sp += n;
+
+			RETURNED(vm);
 		} else if (opcode == ARGC) {
-			uint8_t argc = vm->fp - 8*2 - 1;
+			uint8_t argc = vm->stack[vm->fp - FRAME_HEADER - 1];
 			PUSH(vm, argc);
 		} else if (opcode == ARG) {
 			uint8_t arg_num = POP(vm);
 			uint8_t arg = vm->stack[vm->fp - 8*2 - 1 - arg_num];
 			PUSH(vm, arg);
-		} else if (opcode == HALT) {
-			return 0;
-		} else if (opcode == SYSCALL) {
-			uint64_t syscall_num, ret, buf;
-			uint64_t args[5];
-			size_t i;
+		} else if (opcode == ARG_u16) {
+			ARG_n(vm, 2);
+		} else if (opcode == ARG_u32) {
+			ARG_n(vm, 4);
+		} else if (opcode == ARG_u64) {
+			ARG_n(vm, 8);
+		} else if (opcode == JMP_rel) {
+			size_t at = vm->pc - 1;
+			uint32_t disp;
+
+			GETCODE_32(vm, disp);
+			vm->pc = at + (int32_t)disp;
+		} else if (opcode == JMPIF_rel) {
+			size_t at = vm->pc - 1;
+			uint32_t disp;
+			uint8_t a = POP(vm);
+
+			GETCODE_32(vm, disp);
+			if (a) vm->pc = at + (int32_t)disp;
+		} else if (opcode == CALL_rel) {
+			size_t at = vm->pc - 1;
+			uint32_t disp;
+
+			GETCODE_32(vm, disp);
+
+			PUSH_64(vm, vm->pc);
+			PUSH_64(vm, vm->fp);
+
+			vm->fp = vm->sp;
+			vm->pc = at + (int32_t)disp;
+		} else if (opcode == JMP_abs) {
+			uint32_t addr;
+
+			GETCODE_32(vm, addr);
+			vm->pc = addr;
+		} else if (opcode == JMPIF_abs) {
+			uint32_t addr;
+			uint8_t a = POP(vm);
+
+			GETCODE_32(vm, addr);
+			if (a) vm->pc = addr;
+		} else if (opcode == CALL_abs) {
+			uint32_t addr;
+
+			GETCODE_32(vm, addr);
+
+			PUSH_64(vm, vm->pc);
+			PUSH_64(vm, vm->fp);
+
+			vm->fp = vm->sp;
+			vm->pc = addr;
+		} else if (opcode == FCALL) {
+			size_t at = vm->pc - 1;
+			uint32_t disp;
+
+			GETCODE_32(vm, disp);
+
+			vm->sp += FRAME_HEADER;
+			vm->frames[vm->csp].pc = vm->pc;
+			vm->frames[vm->csp].fp = vm->fp;
+			vm->frames[vm->csp].self = vm->sp;
+			++vm->csp;
+
+			vm->fp = vm->sp;
+			vm->pc = at + (int32_t)disp;
+		} else if (opcode == FRET) {
+			uint8_t n = GETCODE(vm);
+			size_t ret = vm->sp - n;
+			uint8_t argc;
 
-			uint8_t argc = POP(vm);
-
-			switch (argc) {
-			case 0:
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num);
-				PUSH_64(vm, ret);
-				break;
-			case 1:
-				POP_64(vm, args[0], buf);
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num, args[0]);
-				PUSH_64(vm, ret);
-				break;
-			case 2:
-				for (i=0;i<argc; ++i) POP_64(vm, args[i], buf);
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num, args[0], args[1]);
-				PUSH_64(vm, ret);
-				break;
-			case 3:
-				for (i=0;i<argc; ++i) POP_64(vm, args[i], buf);
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num, args[0], args[1],
-					args[2]);
-				PUSH_64(vm, ret);
-				break;
-			case 4:
-				for (i=0;i<argc; ++i) POP_64(vm, args[i], buf);
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num, args[0], args[1],
-					args[2], args[3]);
-				PUSH_64(vm, ret);
-				break;
-			case 5:
-				for (i=0;i<argc; ++i) POP_64(vm, args[i], buf);
-				syscall_num = POP(vm);
-
-				ret = syscall(syscall_num, args[0], args[1],
-					args[2], args[3], args[4]);
-				PUSH_64(vm, ret);
-				break;
+			vm->sp = vm->fp - FRAME_HEADER;
+			argc = POP(vm);
+			vm->sp -= argc;
+
+			memmove(vm->stack + vm->sp, vm->stack + ret, n);
+			vm->sp += n;
+
+			--vm->csp;
+			vm->pc = vm->frames[vm->csp].pc;
+			vm->fp = vm->frames[vm->csp].fp;
+
+			RETURNED(vm);
+		} else if (opcode == TCALL) {
+			size_t at = vm->pc - 1;
+			uint32_t disp;
+			uint8_t header[FRAME_HEADER];
+			uint8_t argc = vm->stack[vm->sp - 1];
+			size_t base = vm->fp - FRAME_HEADER - 1
+				- vm->stack[vm->fp - FRAME_HEADER - 1];
+
+			GETCODE_32(vm, disp);
+
+			/* replace our args with the callee's, keeping our header */
+			memcpy(header, vm->stack + vm->fp - FRAME_HEADER,
+				FRAME_HEADER);
+			memmove(vm->stack + base, vm->stack + vm->sp - argc - 1,
+				argc + 1);
+			memcpy(vm->stack + base + argc + 1, header, FRAME_HEADER);
+
+			vm->sp = base + argc + 1 + FRAME_HEADER;
+			if (vm->csp > 0 && vm->frames[vm->csp-1].self == vm->fp) {
+				vm->frames[vm->csp-1].self = vm->sp;
 			}
+			vm->fp = vm->sp;
+			vm->pc = at + (int32_t)disp;
+		} else if (opcode == ALOAD_u8) {
+			ALOAD_n(vm, uint8_t, 8);
+		} else if (opcode == ALOAD_u16) {
+			ALOAD_n(vm, uint16_t, 16);
+		} else if (opcode == ALOAD_u32) {
+			ALOAD_n(vm, uint32_t, 32);
+		} else if (opcode == ALOAD_u64) {
+			ALOAD_n(vm, uint64_t, 64);
+		} else if (opcode == ASTORE_u8) {
+			ASTORE_n(vm, uint8_t, 8);
+		} else if (opcode == ASTORE_u16) {
+			ASTORE_n(vm, uint16_t, 16);
+		} else if (opcode == ASTORE_u32) {
+			ASTORE_n(vm, uint32_t, 32);
+		} else if (opcode == ASTORE_u64) {
+			ASTORE_n(vm, uint64_t, 64);
+		} else if (opcode == XCHG_u8) {
+			RMW_n(vm, uint8_t, 8, __atomic_exchange_n);
+		} else if (opcode == XCHG_u16) {
+			RMW_n(vm, uint16_t, 16, __atomic_exchange_n);
+		} else if (opcode == XCHG_u32) {
+			RMW_n(vm, uint32_t, 32, __atomic_exchange_n);
+		} else if (opcode == XCHG_u64) {
+			RMW_n(vm, uint64_t, 64, __atomic_exchange_n);
+		} else if (opcode == XADD_u8) {
+			RMW_n(vm, uint8_t, 8, __atomic_fetch_add);
+		} else if (opcode == XADD_u16) {
+			RMW_n(vm, uint16_t, 16, __atomic_fetch_add);
+		} else if (opcode == XADD_u32) {
+			RMW_n(vm, uint32_t, 32, __atomic_fetch_add);
+		} else if (opcode == XADD_u64) {
+			RMW_n(vm, uint64_t, 64, __atomic_fetch_add);
+		} else if (opcode == CAS_u8) {
+			CAS_n(vm, uint8_t, 8);
+		} else if (opcode == CAS_u16) {
+			CAS_n(vm, uint16_t, 16);
+		} else if (opcode == CAS_u32) {
+			CAS_n(vm, uint32_t, 32);
+		} else if (opcode == CAS_u64) {
+			CAS_n(vm, uint64_t, 64);
+		} else if (opcode == FENCE_acq) {
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} else if (opcode == FENCE_rel) {
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+		} else if (opcode == FENCE) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		} else if (opcode == SEND || opcode == RECV) {
+			int status = channel_op(vm, opcode == SEND);
+			if (status != 0) return status;
+		} else if (opcode == SPAWN) {
+			uint32_t addr;
+			int status;
+
+			GETCODE_32(vm, addr);
+
+			status = spawn_op(vm, addr);
+			if (status != 0) return status;
+		} else if (opcode == JOIN) {
+			int status = join_op(vm);
+			if (status != 0) return status;
+		} else if (opcode == HASH_crc32c) {
+			uint64_t addr, len, buf;
+			uint32_t crc, buf32;
+			uint8_t *p;
+
+			POP_64(vm, len, buf);
+			POP_64(vm, addr, buf);
+			POP_32(vm, crc, buf32);
+
+			p = env_ptr(vm, addr, len, 0);
+			if (p == NULL) return VM_FAULT;
+
+			crc = crc32c(crc, p, len);
+			PUSH_32(vm, crc);
+		} else if (opcode == HASH_u64) {
+			uint64_t addr, len, seed, buf;
+			uint8_t *p;
+
+			POP_64(vm, len, buf);
+			POP_64(vm, addr, buf);
+			POP_64(vm, seed, buf);
+
+			p = env_ptr(vm, addr, len, 0);
+			if (p == NULL) return VM_FAULT;
+
+			seed = hash64(p, len, seed);
+			PUSH_64(vm, seed);
+		} else if (opcode >= HT_INIT && opcode <= HT_DELETE) {
+			int status = table_op(vm, opcode);
+			if (status != 0) return status;
+		} else if (opcode >= SORT && opcode <= BSEARCH) {
+			int status = sort_op(vm, opcode);
+			if (status != 0) return status;
+		} else if (opcode == CORO_NEW) {
+			uint32_t addr;
+			int status;
+
+			GETCODE_32(vm, addr);
+
+			status = coro_new_op(vm, addr);
+			if (status != 0) return status;
+		} else if (opcode == RESUME) {
+			int status = resume_op(vm);
+			if (status != 0) return status;
+		} else if (opcode == YIELD) {
+			int status = yield_op(vm);
+			if (status != 0) return status;
+		} else if (opcode == THROW) {
+			uint64_t buf;
+
+			POP_64(vm, vm->exception, buf);
+			return VM_EXCEPTION;
+		} else if (opcode == IN || opcode == OUT) {
+			int status = port_op(vm, opcode == OUT);
+			if (status != 0) return status;
+		} else if (opcode == PURE) {
+			int status = pure_op(vm);
+			if (status != 0) return status;
+
+			RETURNED(vm);
+		} else if (opcode == TRAP) {
+			int status = trap_op(vm, &opcode);
+			if (status != 0) return status;
+
+			goto dispatch;
+		} else if (opcode == HALT) {
+			return VM_HALT;
+		} else if (opcode == SYSCALL) {
+			int status = syscall_op(vm);
+			if (status != 0) return status;
 		}
 	}
 }
+
+int run_vm(VM *vm, uint8_t *code, size_t pc)
+{
+	int status;
+
+	vm->pc = pc;
+	vm->dirty = 1;
+	if (code != NULL) vm->code=code;
+
+	/* nothing is spent on try regions until something is thrown */
+	while (1) {
+		vm->exception = VM_ERR_FAULT;
+		status = run(vm);
+
+		if (status != VM_FAULT && status != VM_EXCEPTION) return status;
+		if (unwind(vm) != 0) return status;
+	}
+}
@@ -0,0 +1,366 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef VM_INTERNAL_HEADER
+#define VM_INTERNAL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vm.h>
+#include <channel.h>
+#include <port.h>
+#include <pool.h>
+#include <debug.h>
+#include <reload.h>
+#include <memo.h>
+#include <replay.h>
+
+#define PUSH(vm, v) (vm)->stack[(vm)->sp++] = (v) /* push v onto data stack */
+#define POP(vm) (vm)->stack[--(vm)->sp] /* pop from data stack */
+#define GETCODE(vm) (vm)->code[(vm)->pc++] /* get next opcode */
+
+#define PUSH_16(vm, v) \
+	PUSH((vm), ((v) >> 8) & 0xFF); \
+	PUSH((vm), (v) & 0xFF)
+
+#define PUSH_32(vm, v) \
+	PUSH((vm), ((v) >> 24) & 0xFF); \
+	PUSH((vm), ((v) >> 16) & 0xFF); \
+	PUSH_16((vm), (v))
+
+#define PUSH_64(vm, v) \
+	PUSH((vm), ((v) >> 56) & 0xFF); \
+	PUSH((vm), ((v) >> 48) & 0xFF); \
+	PUSH((vm), ((v) >> 40) & 0xFF); \
+	PUSH((vm), ((v) >> 32) & 0xFF); \
+	PUSH_32((vm), (v))
+
+#define POP_16(vm, v, buf) \
+	(buf) = POP((vm)); \
+	(v) = (buf); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 8)
+
+#define POP_32(vm, v, buf) \
+	POP_16((vm), (v), (buf)); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 16); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 24)
+
+#define POP_64(vm, v, buf) \
+	POP_32((vm), (v), (buf)); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 32); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 40); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 48); \
+	(buf) = POP((vm)); \
+	(v) |= ((buf) << 56)
+
+/*
+ * FCALL frames keep the CALL_* layout on the data stack, so ARG and ARGC work
+ * unchanged, but the 16 header bytes are only reserved: the return address
+ * and caller fp live on the native-word control stack instead.
+ */
+#define FRAME_HEADER (8*2)
+
+/* frames made by vm_call return here, which makes run_vm return */
+#define HOST_RETURN ((size_t)-1)
+
+/* a coroutine's function returns here, which finishes the coroutine */
+#define CORO_RETURN ((size_t)-2)
+
+/*
+ * a PURE function that missed the cache returns here, less the index
+ * of the pending call that will save its result
+ */
+#define MEMO_RETURN ((size_t)-3)
+#define MAX_PENDING 4096
+#define MEMO_PENDING(pc) (MEMO_RETURN - (pc) < MAX_PENDING)
+
+/* every FCALL uses an argc byte and a header on the data stack */
+#define MAX_FRAMES(stack_size) ((stack_size) / (FRAME_HEADER + 1) + 1)
+
+struct frame {
+	size_t pc; /* return address */
+	size_t fp; /* caller's frame pointer */
+	size_t self; /* callee's frame pointer, telling the frame apart */
+};
+
+/* the registers and stacks RESUME and YIELD swap between */
+struct context {
+	uint8_t *stack;
+	struct frame *frames;
+	size_t pc;
+	size_t sp;
+	size_t fp;
+	size_t csp;
+	size_t stack_size;
+};
+
+/* the registers vm_call restores once its call is over */
+struct host_call {
+	size_t base; /* sp before the args were pushed */
+	size_t pc;
+	size_t fp;
+	size_t csp;
+};
+
+/* host memory bound into the env address space by vm_bind_env */
+struct window {
+	size_t addr;
+	size_t len;
+	uint8_t *buf;
+	int flags;
+};
+
+struct VM {
+	uint8_t *env; /* variable env */
+
+	uint8_t *code; /* executable code */
+	uint8_t *stack; /* data stack */
+	struct frame *frames; /* control stack */
+
+	size_t pc; /* program counter */
+	size_t sp; /* stack pointer */
+	size_t fp; /* frame pointer */
+	size_t csp; /* control stack pointer */
+
+	size_t stack_size;
+	size_t env_size;
+
+	/* addresses from env_size up are only valid inside a window */
+	struct window *windows;
+	size_t window_count;
+
+	/* env and stack live in this mapping, instead of the heap, if set */
+	void *map;
+	size_t map_size;
+
+	/*
+	 * memfd holding an image that clones are mapped from, or -1. The
+	 * image is stale once dirty is set by anything that can change state.
+	 */
+	int image_fd;
+	int dirty;
+
+	/* channels by id, and the one a SEND or RECV last blocked on */
+	Channel **channels;
+	size_t channel_count;
+	Channel *parked;
+	int parked_send;
+
+	/* ports by id, and the one an IN or OUT last blocked on */
+	Port **ports;
+	size_t port_count;
+	Port *parked_port;
+	uint32_t parked_event;
+
+	/* where SPAWN runs children, and their handles for JOIN */
+	Pool *pool;
+	struct task **tasks;
+
+	/* coroutines by handle, and the one running, if any */
+	struct coro **coros;
+	size_t coro_count;
+	struct coro *coro;
+
+	/* handlers for THROW and faults, and what was last thrown */
+	const struct try_entry *tries;
+	size_t try_count;
+	uint64_t exception;
+
+	/* debugger whose TRAPs the code has, and 1 + the pc resumed at */
+	Debugger *debug;
+	size_t resume;
+
+	/* the version of code held, and where newer ones are published */
+	Code *version;
+	CodeSlot *slot;
+
+	/* the cache PURE uses, and its calls in flight, free ones listed */
+	Memo *memo;
+	struct pending *pending;
+	size_t pending_size;
+	size_t pending_free; /* index + 1, or 0 if there are none */
+
+	/* where SYSCALLs are recorded to or replayed from, if set */
+	SyscallLog *syscall_log;
+	/* this VM's records in it, the VMs it gave one, and its next + 1 */
+	uint64_t syscall_stream;
+	uint64_t syscall_children;
+	size_t syscall_next;
+
+	/* the vm_call that stopped with VM_BLOCKED or VM_BREAK, if set */
+	struct host_call call;
+	int call_suspended;
+};
+
+enum op_flag {
+	OP_JUMP = 0x01, /* has a 4-byte immediate branch target */
+	OP_REL = 0x02, /* the target is relative to the opcode */
+	OP_COND = 0x04, /* may fall through as well as branch */
+	OP_CALL = 0x08,
+	OP_STOP = 0x10, /* never falls through */
+	OP_DYNAMIC = 0x20, /* stack effect is only known at run time */
+	OP_INDIRECT = 0x40 /* target is popped from the stack */
+};
+
+/* static description of an opcode; pop and push count bytes */
+struct opinfo {
+	uint8_t imm; /* immediate bytes following the opcode */
+	uint8_t pop;
+	uint8_t push;
+	uint8_t flags;
+};
+
+/* returns -1 for bytes that are not opcodes */
+int describe_op(uint8_t opcode, struct opinfo *info);
+
+/* decode the immediate target of the OP_JUMP instruction at pc */
+int branch_target(const uint8_t *code, size_t pc, const struct opinfo *info,
+	size_t *target);
+
+/*
+ * Return a pointer to len bytes of env at addr, or NULL if they don't lie
+ * entirely inside env or one writable (if write is set) window.
+ */
+uint8_t* env_ptr(VM *vm, uint64_t addr, size_t len, int write);
+
+/* like env_ptr, but also NULL unless addr is aligned to len for atomics */
+void* atomic_ptr(VM *vm, uint64_t addr, size_t len, int write);
+
+/* run SEND (send set) or RECV, returning 0 or the status to stop with */
+int channel_op(VM *vm, int send);
+
+/*
+ * run IN or OUT (out set), returning 0 or the status to stop with, and
+ * sleep until the port that blocked the VM moves
+ */
+int port_op(VM *vm, int out);
+void port_wait(VM *vm);
+
+/* set up a call as vm_call does, and collect what the callee left */
+int push_call(VM *vm, const uint8_t *args, uint8_t nargs, size_t ret);
+uint64_t pop_result(VM *vm, size_t base);
+
+/*
+ * push a vm_call's frame, saving the registers to restore in call, and
+ * finish it once running the function stopped with status
+ */
+int begin_call(VM *vm, const uint8_t *args, uint8_t nargs,
+	struct host_call *call);
+int end_call(VM *vm, int status, const struct host_call *call,
+	uint64_t *result);
+
+/* run SPAWN of the function at pc, and JOIN */
+int spawn_op(VM *vm, size_t pc);
+int join_op(VM *vm);
+
+/* whether vm has children it hasn't joined yet */
+int has_tasks(VM *vm);
+
+/* free vm's children without joining them, waiting on any running */
+void free_tasks(VM *vm);
+
+/*
+ * run CORO_NEW of the function at pc, RESUME and YIELD, returning 0 or
+ * the status to stop with. coro_exit finishes the running coroutine once
+ * its function returns, and free_coros frees every coroutine, switching
+ * back to the VM's own stack first.
+ */
+int coro_new_op(VM *vm, size_t pc);
+int resume_op(VM *vm);
+int yield_op(VM *vm);
+void coro_exit(VM *vm);
+void free_coros(VM *vm);
+
+/* whether vm has a coroutine that hasn't finished, running or not */
+int has_coros(VM *vm);
+
+/* finish the running coroutine without a result, to unwind past it */
+void coro_abort(VM *vm);
+
+/*
+ * run PURE, returning from the function on a hit. memo_return saves the
+ * result of the call that returned to a MEMO_PENDING pc and fails if it
+ * isn't known, memo_abandon forgets the call for an exception and
+ * returns where it would have gone, and copy_pending copies every call
+ * in flight for a clone.
+ */
+int pure_op(VM *vm);
+int memo_return(VM *vm);
+size_t memo_abandon(VM *vm, size_t ret);
+int copy_pending(VM *dst, VM *src);
+
+/* whether a call vm made to a PURE function is waiting for its result */
+int has_pending(VM *vm);
+
+/*
+ * run the host's callback for the TRAP just fetched, and replace opcode
+ * with the one it covers. Returns 0 or the status to stop with.
+ */
+int trap_op(VM *vm, uint8_t *opcode);
+
+/*
+ * jump to the handler for vm->exception thrown at vm->pc, popping frames
+ * until one has a try entry covering its pc. Returns -1 if none does.
+ */
+int unwind(VM *vm);
+
+/* values on the stack hold the bytes of a float in reverse order */
+uint32_t serialize_float(float x);
+float deserialize_float(uint32_t x);
+uint64_t serialize_double(double x);
+double deserialize_double(uint64_t x);
+
+/*
+ * Write a file by renaming a new one over path, so anything that has the
+ * old file mapped keeps a valid mapping. Returns 0 on success.
+ */
+int replace_file(const char *path, const void *buf, size_t len);
+
+/* like replace_file, but fill writes the new file's contents to fd */
+int replace_file_with(const char *path, int (*fill)(int fd, void *arg),
+	void *arg);
+
+/* analyze code, through load_code_info if set_code_info_dir set a dir */
+struct CodeInfo* get_code_info(const uint8_t *code, size_t size);
+
+/* fast non-cryptographic hash, stable across hosts */
+uint64_t hash64(const void *buf, size_t len, uint64_t seed);
+
+/* CRC-32C of buf continuing from crc, which starts at 0; hardware if we can */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* run SYSCALL, returning 0 or the status to stop with */
+int syscall_op(VM *vm);
+
+/* give child, a new SPAWN child or clone, its own stream in vm's log */
+void inherit_syscall_log(VM *child, VM *vm);
+
+/* run one of the HT_* opcodes, returning 0 or the status to stop with */
+int table_op(VM *vm, uint8_t opcode);
+
+/* run one of SORT, SORT_rec, PARTITION or BSEARCH */
+int sort_op(VM *vm, uint8_t opcode);
+
+#endif
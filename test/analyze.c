@@ -0,0 +1,110 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <analyze.h>
+#include <vm.h>
+#include "test.h"
+
+static char dir[] = "bin/test_cacheXXXXXX";
+
+static uint8_t code[] = {
+	PUSH_u8, 1,
+	JMPIF_abs, 0, 0, 0, 9,
+	PUSH_u8, 2,
+	HALT
+};
+
+/* empty dir and remove it */
+static void remove_dir(void)
+{
+	char path[sizeof(dir) + 256];
+	struct dirent *e;
+	DIR *d = opendir(dir);
+
+	while (d != NULL && (e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+
+		sprintf(path, "%s/%.255s", dir, e->d_name);
+		unlink(path);
+	}
+	if (d != NULL) closedir(d);
+	rmdir(dir);
+}
+
+/* a second load maps what the first saved */
+static void test_second_load(void)
+{
+	CodeInfo *a = load_code_info(code, sizeof(code), dir);
+	CodeInfo *b = load_code_info(code, sizeof(code), dir);
+
+	CHECK(a != NULL && b != NULL);
+	if (a == NULL || b == NULL) return;
+
+	CHECK(!code_info_cached(a));
+	CHECK(code_info_cached(b));
+	CHECK(memcmp(code_info_flags(a), code_info_flags(b),
+		sizeof(code)) == 0);
+	CHECK(code_info_flags(b)[9] & INSN_TARGET);
+	CHECK(code_info_max_growth(a) == code_info_max_growth(b));
+
+	free_code_info(a);
+	free_code_info(b);
+}
+
+/* different code doesn't find the first's results */
+static void test_other_code(void)
+{
+	uint8_t other[sizeof(code)];
+	CodeInfo *info;
+
+	memcpy(other, code, sizeof(code));
+	other[8] = 3;
+
+	info = load_code_info(other, sizeof(other), dir);
+	CHECK(info != NULL && !code_info_cached(info));
+	if (info != NULL) free_code_info(info);
+}
+
+/* code failing verification is neither analyzed nor saved */
+static void test_bad_code(void)
+{
+	uint8_t bad[] = {JMP_abs, 0, 0, 0, 1, HALT};
+
+	CHECK(load_code_info(bad, sizeof(bad), dir) == NULL);
+	CHECK(load_code_info(bad, sizeof(bad), dir) == NULL);
+}
+
+int main(void)
+{
+	if (mkdtemp(dir) == NULL) return 1;
+
+	test_second_load();
+	test_other_code();
+	test_bad_code();
+
+	remove_dir();
+
+	return failures != 0;
+}
@@ -0,0 +1,134 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <vm.h>
+#include "test.h"
+
+/* atomic loads read a read-only window, stores and RMWs fault on it */
+static void test_read_only(void)
+{
+	uint8_t load[] = {
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 20,
+		ALOAD_u32,
+		HALT
+	};
+	uint8_t store[] = {
+		PUSH_u32, 0, 0, 0, 1,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 20,
+		ASTORE_u32,
+		HALT
+	};
+	uint8_t xadd[] = {
+		PUSH_u32, 0, 0, 0, 1,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 20,
+		XADD_u32,
+		HALT
+	};
+	uint32_t ro[4] = {0, 0x11223344, 0, 0};
+	VM *vm = make_vm(load, 64, 16);
+	uint32_t v;
+
+	CHECK(vm_bind_env(vm, 16, ro, sizeof(ro), VM_ENV_READ) == 0);
+
+	CHECK(run_vm(vm, load, 0) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &v) == 0 && v == 0x11223344);
+
+	CHECK(run_vm(vm, store, 0) == VM_FAULT);
+	CHECK(run_vm(vm, xadd, 0) == VM_FAULT);
+	CHECK(ro[1] == 0x11223344);
+
+	free_vm(vm);
+}
+
+/* XADD, CAS and XCHG push the old value, CAS whether it swapped */
+static void test_rmw(void)
+{
+	uint8_t code[] = {
+		PUSH_u32, 0, 0, 0, 5,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		XADD_u32,
+		PUSH_u32, 0, 0, 0, 5,
+		PUSH_u32, 0, 0, 0, 9,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		CAS_u32,
+		PUSH_u32, 0, 0, 0, 5,
+		PUSH_u32, 0, 0, 0, 7,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		CAS_u32,
+		PUSH_u32, 0, 0, 0, 3,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		XCHG_u32,
+		FENCE,
+		HALT
+	};
+	uint32_t zero = 0, v;
+	VM *vm = make_vm(code, 64, 16);
+	uint8_t swapped;
+
+	CHECK(vm_env_write(vm, 0, &zero, sizeof(zero)) == 0);
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+
+	CHECK(vm_pop_u32(vm, &v) == 0 && v == 9);
+	CHECK(vm_pop_u8(vm, &swapped) == 0 && swapped == 0);
+	CHECK(vm_pop_u32(vm, &v) == 0 && v == 9);
+	CHECK(vm_pop_u8(vm, &swapped) == 0 && swapped == 1);
+	CHECK(vm_pop_u32(vm, &v) == 0 && v == 5);
+	CHECK(vm_pop_u32(vm, &v) == 0 && v == 0);
+	CHECK(vm_pop_u8(vm, &swapped) == -1);
+
+	/* env holds the value natively */
+	CHECK(vm_env_read(vm, 0, &v, sizeof(v)) == 0 && v == 3);
+
+	free_vm(vm);
+}
+
+/* misaligned addresses, and values running past a window, fault */
+static void test_bad_addresses(void)
+{
+	uint8_t code[] = {
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 1,
+		ALOAD_u32,
+		HALT
+	};
+	uint64_t buf[2] = {0, 0};
+	VM *vm = make_vm(code, 64, 16);
+	uint32_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_FAULT);
+
+	CHECK(vm_bind_env(vm, 32, buf, 12,
+		VM_ENV_READ | VM_ENV_WRITE) == 0);
+	code[8] = 40;
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &v) == 0);
+	code[9] = ALOAD_u64;
+	CHECK(run_vm(vm, code, 0) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_read_only();
+	test_rmw();
+	test_bad_addresses();
+
+	return failures != 0;
+}
@@ -0,0 +1,348 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <vm.h>
+#include "test.h"
+
+/* FRET returns its top bytes in place of the FCALL's args */
+static void test_fcall(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 7,
+		PUSH_u8, 9,
+		PUSH_u8, 2,
+		FCALL, 0, 0, 0, 6,
+		HALT,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 2,
+		ARG,
+		FRET, 2
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint8_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 7);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 9);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/*
+ * an FCALL'd function tail calls one taking more args, which FCALLs
+ * another before returning to the first's caller
+ */
+static void test_tcall_fcall_frame(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		FCALL, 0, 0, 0, 6,
+		HALT,
+		PUSH_u8, 0xAA,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 3,
+		PUSH_u8, 2,
+		TCALL, 0, 0, 0, 5,
+		PUSH_u8, 2,
+		ARG,
+		PUSH_u8, 1,
+		ARG,
+		ADD_u8,
+		PUSH_u8, 0,
+		FCALL, 0, 0, 0, 7,
+		FRET, 3,
+		PUSH_u8, 40,
+		FRET, 1
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint16_t w;
+	uint8_t v;
+	int i;
+
+	/* the control stack is back where it was after each run */
+	for (i=0; i<32; ++i) {
+		CHECK(run_vm(vm, code, 0) == VM_HALT);
+		CHECK(vm_pop_u8(vm, &v) == 0 && v == 40);
+		CHECK(vm_pop_u16(vm, &w) == 0 && w == 8);
+		CHECK(vm_pop_u8(vm, &v) == -1);
+	}
+
+	free_vm(vm);
+}
+
+/* TCALL from a CALL_* frame keeps its header on the data stack */
+static void test_tcall_call_frame(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 10,
+		HALT,
+		PUSH_u8, 0xAA,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint8_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 6);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* RET_u16, RET_u32 and RET_u64 push their whole value */
+static void test_ret_widths(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0xEE,
+		PUSH_u8, 9,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 30,
+		PUSH_u8, 9,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 34,
+		PUSH_u8, 9,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 40,
+		HALT,
+		PUSH_u16, 0x12, 0x34,
+		RET_u16,
+		PUSH_u32, 0x12, 0x34, 0x56, 0x78,
+		RET_u32,
+		PUSH_u64, 1, 2, 3, 4, 5, 6, 7, 8,
+		RET_u64
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint64_t d;
+	uint32_t q;
+	uint16_t w;
+	uint8_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &d) == 0 && d == 0x0102030405060708);
+	CHECK(vm_pop_u32(vm, &q) == 0 && q == 0x12345678);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 0x1234);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 0xEE);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* RETN returns its top bytes, dropping locals and args */
+static void test_retn(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 1,
+		PUSH_u8, 2,
+		PUSH_u8, 2,
+		CALL_abs, 0, 0, 0, 12,
+		HALT,
+		PUSH_u8, 0xAA,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 2,
+		ARG,
+		PUSH_u8, 3,
+		RETN, 3
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint8_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 3);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 1);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 2);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* ARGC and the wide ARGs, indexed by each arg's last byte */
+static void test_wide_args(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0xEE,
+		PUSH_u64, 1, 2, 3, 4, 5, 6, 7, 8,
+		PUSH_u32, 0x12, 0x34, 0x56, 0x78,
+		PUSH_u16, 0xAB, 0xCD,
+		PUSH_u8, 14,
+		CALL_abs, 0, 0, 0, 27,
+		HALT,
+		ARGC,
+		PUSH_u8, 1,
+		ARG_u16,
+		PUSH_u8, 3,
+		ARG_u32,
+		PUSH_u8, 7,
+		ARG_u64,
+		RETN, 15
+	};
+	VM *vm = make_vm(code, 256, 16);
+	uint64_t d;
+	uint32_t q;
+	uint16_t w;
+	uint8_t v;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &d) == 0 && d == 0x0102030405060708);
+	CHECK(vm_pop_u32(vm, &q) == 0 && q == 0x12345678);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 0xABCD);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 14);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 0xEE);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* run code, expecting the handler to leave just the u64 thrown */
+static void check_caught(uint8_t *code, const struct try_entry *tries,
+	size_t count)
+{
+	VM *vm = make_vm(code, 256, 16);
+	uint64_t e;
+	uint8_t v;
+
+	vm_set_try_table(vm, tries, count);
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &e) == 0 && e == 0x77);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* THROW unwinds CALL_* and FCALL frames alike to the handler */
+static void test_throw_mixed(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 9,
+		HALT,
+		HALT,
+		PUSH_u8, 0,
+		FCALL, 0, 0, 0, 6,
+		RET_u8,
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 26,
+		FRET, 1,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0x77,
+		THROW,
+		RET_u8
+	};
+	const struct try_entry tries[] = {{2, 7, 8, 0}};
+
+	check_caught(code, tries, 1);
+}
+
+/* a handler in an FCALL'd frame catches from a CALL_* frame above it */
+static void test_throw_to_fcall(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 8,
+		HALT,
+		PUSH_u8, 0,
+		FCALL, 0, 0, 0, 6,
+		RET_u64,
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 27,
+		FRET, 8,
+		FRET, 8,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0x77,
+		THROW
+	};
+	const struct try_entry tries[] = {{18, 23, 25, 0}};
+
+	check_caught(code, tries, 1);
+}
+
+/*
+ * an FCALL'd function tail calls one with more args, moving the frame;
+ * unwinding must still know it from the control stack
+ */
+static void test_throw_tcall(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		FCALL, 0, 0, 0, 7,
+		HALT,
+		HALT,
+		PUSH_u8, 3,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 27,
+		FRET, 1,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0x77,
+		THROW
+	};
+	const struct try_entry tries[] = {{2, 7, 8, 0}};
+
+	check_caught(code, tries, 1);
+}
+
+/* or the moved frame catches it, and FRETs it to its caller */
+static void test_throw_tcall_caught(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		FCALL, 0, 0, 0, 6,
+		HALT,
+		PUSH_u8, 3,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 28,
+		FRET, 1,
+		FRET, 8,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0x77,
+		THROW
+	};
+	const struct try_entry tries[] = {{19, 24, 26, 0}};
+
+	check_caught(code, tries, 1);
+}
+
+int main(void)
+{
+	test_fcall();
+	test_tcall_fcall_frame();
+	test_tcall_call_frame();
+	test_ret_widths();
+	test_retn();
+	test_wide_args();
+	test_throw_mixed();
+	test_throw_to_fcall();
+	test_throw_tcall();
+	test_throw_tcall_caught();
+
+	return failures != 0;
+}
@@ -0,0 +1,90 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <channel.h>
+#include <vm.h>
+#include "test.h"
+
+/* a blocked RECV resumes from the pc vm_wait returns */
+static void test_resume(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 4,
+		RECV,
+		HALT
+	};
+	uint32_t msg = 0xCAFE, got = 0;
+	Channel *c = make_channel(2, sizeof(msg));
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(vm_attach_channel(vm, 0, c) == 0);
+	CHECK(run_vm(vm, code, 0) == VM_BLOCKED);
+
+	CHECK(channel_send(c, &msg) == 0);
+	CHECK(run_vm(vm, NULL, vm_wait(vm)) == VM_HALT);
+	CHECK(vm_env_read(vm, 4, &got, sizeof(got)) == 0 && got == msg);
+
+	free_vm(vm);
+	free_channel(c);
+}
+
+#define SENDS 50000
+
+static void* send_all(void *arg)
+{
+	uint32_t i;
+
+	for (i = 1; i <= SENDS; ++i) channel_send_wait(arg, &i);
+
+	return NULL;
+}
+
+/* senders and a receiver sleeping on a small channel all get woken */
+static void test_wait(void)
+{
+	Channel *c = make_channel(2, sizeof(uint32_t));
+	pthread_t t[2];
+	uint64_t sum = 0;
+	uint32_t i, msg;
+
+	CHECK(pthread_create(&t[0], NULL, send_all, c) == 0);
+	CHECK(pthread_create(&t[1], NULL, send_all, c) == 0);
+
+	for (i = 0; i < 2*SENDS; ++i) {
+		channel_recv_wait(c, &msg);
+		sum += msg;
+	}
+	CHECK(pthread_join(t[0], NULL) == 0);
+	CHECK(pthread_join(t[1], NULL) == 0);
+
+	CHECK(sum == (uint64_t)SENDS * (SENDS + 1));
+	CHECK(channel_recv(c, &msg) == -1);
+
+	free_channel(c);
+}
+
+int main(void)
+{
+	test_resume();
+	test_wait();
+
+	return failures != 0;
+}
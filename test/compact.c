@@ -0,0 +1,220 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <compact.h>
+#include <vm.h>
+#include "test.h"
+
+/* run compact code from 0 until it stops, returning the status */
+static int run_compact(const uint8_t *src, size_t size, VM **vm,
+	uint8_t **code, size_t *pcmap)
+{
+	size_t code_size;
+
+	*code = load_compact(src, size, &code_size, pcmap);
+	if (*code == NULL) return -1;
+
+	*vm = make_vm(*code, 64, 16);
+
+	return run_vm(*vm, *code, 0);
+}
+
+/* LEB128 PUSH immediates at each width's boundaries */
+static void test_push_boundaries(void)
+{
+	uint8_t src[] = {
+		PUSH_u16, 0x7F,
+		PUSH_u16, 0x80, 0x01,
+		PUSH_u16, 0xFF, 0xFF, 0x03,
+		PUSH_u32, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F,
+		PUSH_u64, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			0xFF, 0xFF, 0xFF, 0xFF, 0x01,
+		HALT
+	};
+	size_t pcmap[sizeof(src) + 1];
+	uint8_t *code;
+	uint64_t d;
+	uint32_t q;
+	uint16_t w;
+	VM *vm;
+
+	CHECK(run_compact(src, sizeof(src), &vm, &code, pcmap) == VM_HALT);
+	CHECK(pcmap[2] == 3 && pcmap[5] == 6 && pcmap[9] == 9);
+	CHECK(pcmap[15] == 14 && pcmap[26] == 23 && pcmap[27] == 24);
+
+	/* all ones reads back as -1 at any width */
+	CHECK(vm_pop_u64(vm, &d) == 0 && (int64_t)d == -1);
+	CHECK(vm_pop_u32(vm, &q) == 0 && (int32_t)q == -1);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 0xFFFF);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 0x80);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 0x7F);
+
+	free_vm(vm);
+	free(code);
+}
+
+/* immediates too wide for their PUSH, or cut short, don't load */
+static void test_push_bad(void)
+{
+	uint8_t wide16[] = {PUSH_u16, 0x80, 0x80, 0x04, HALT};
+	uint8_t wide32[] = {PUSH_u32, 0x80, 0x80, 0x80, 0x80, 0x10, HALT};
+	uint8_t wide64[] = {
+		PUSH_u64, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			0xFF, 0xFF, 0xFF, 0xFF, 0x02,
+		HALT
+	};
+	uint8_t cut[] = {PUSH_u32, 0x80};
+	size_t n;
+
+	CHECK(load_compact(wide16, sizeof(wide16), &n, NULL) == NULL);
+	CHECK(load_compact(wide32, sizeof(wide32), &n, NULL) == NULL);
+	CHECK(load_compact(wide64, sizeof(wide64), &n, NULL) == NULL);
+	CHECK(load_compact(cut, sizeof(cut), &n, NULL) == NULL);
+}
+
+/*
+ * CJMP, CJMPIF and CCALL forwards and backwards, with one and two byte
+ * displacements: 0 jumps to 128, which jumps back to 6, and the rest
+ * runs through the call to 33, which jumps back to push 42 and halt
+ */
+static void test_compact_branches(void)
+{
+	uint8_t src[131] = {
+		CJMP, 0x80, 0x01,
+		PUSH_u8, 42,
+		HALT,
+		PUSH_u8, 1,
+		CJMPIF, 4,
+		PUSH_u8, 99,
+		PUSH_u8, 0,
+		CJMPIF, 0x7C,
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CCALL, 6,
+		CJMP, 11,
+		PUSH_u8, 77,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8,
+		CJMP, 0x62
+	};
+	size_t pcmap[sizeof(src) + 1];
+	uint8_t *code, v;
+	size_t i;
+	VM *vm;
+
+	/* nothing runs the padding up to the first CJMP's target */
+	for (i=35; i+1<128; i+=2) {
+		src[i] = PUSH_u8;
+		src[i + 1] = 0;
+	}
+	src[127] = HALT;
+	src[128] = CJMP;
+	src[129] = 0x86; /* -122 */
+	src[130] = 0x7F;
+
+	CHECK(run_compact(src, sizeof(src), &vm, &code, pcmap) == VM_HALT);
+	CHECK(pcmap[3] == 5 && pcmap[128] == pcmap[127] + 1);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 42);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 6);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+	free(code);
+}
+
+/* a _rel branch over an instruction that grows when translated */
+static void test_rel_branch(void)
+{
+	uint8_t src[] = {
+		JMP_rel, 0, 0, 0, 8,
+		PUSH_u16, 1,
+		HALT,
+		PUSH_u8, 42,
+		HALT
+	};
+	size_t pcmap[sizeof(src) + 1];
+	uint8_t *code, v;
+	VM *vm;
+
+	CHECK(run_compact(src, sizeof(src), &vm, &code, pcmap) == VM_HALT);
+	CHECK(pcmap[8] == 9);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 42);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+	free(code);
+}
+
+/*
+ * an _abs call past an instruction that grows when translated, whose
+ * target's low byte reads as PUSH_u16
+ */
+static void test_abs_call(void)
+{
+	uint8_t src[PUSH_u16 + 3] = {
+		PUSH_u16, 1,
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, PUSH_u16,
+		HALT
+	};
+	uint8_t *code, v;
+	uint16_t w;
+	size_t i;
+	VM *vm;
+
+	for (i=10; i<PUSH_u16; ++i) src[i] = FENCE;
+	src[PUSH_u16] = PUSH_u8;
+	src[PUSH_u16 + 1] = 7;
+	src[PUSH_u16 + 2] = RET_u8;
+
+	CHECK(run_compact(src, sizeof(src), &vm, &code, NULL) == VM_HALT);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 7);
+	CHECK(vm_pop_u16(vm, &w) == 0 && w == 1);
+
+	free_vm(vm);
+	free(code);
+}
+
+/* inline targets must name an instruction */
+static void test_bad_target(void)
+{
+	uint8_t src[] = {
+		JMP_abs, 0, 0, 0, 2,
+		HALT
+	};
+	size_t code_size;
+
+	CHECK(load_compact(src, sizeof(src), &code_size, NULL) == NULL);
+}
+
+int main(void)
+{
+	test_push_boundaries();
+	test_push_bad();
+	test_compact_branches();
+	test_rel_branch();
+	test_abs_call();
+	test_bad_target();
+
+	return failures != 0;
+}
@@ -0,0 +1,169 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <vm.h>
+#include "test.h"
+
+/*
+ * RESUME at 0; at 2 make a coroutine of the function at 17 with the arg
+ * 5 and a stack of code[9..10] bytes. It yields 1 and 2, then returns
+ * 2 * its arg through a CALL.
+ */
+static uint8_t code[] = {
+	RESUME,
+	HALT,
+	PUSH_u8, 5,
+	PUSH_u8, 1,
+	PUSH_u32, 0, 0, 1, 0,
+	CORO_NEW, 0, 0, 0, 17,
+	HALT,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 1,
+	YIELD,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 2,
+	YIELD,
+	PUSH_u8, 1,
+	ARG,
+	PUSH_u8, 1,
+	CALL_abs, 0, 0, 0, 48,
+	RET_u16,
+	PUSH_u8, 1,
+	ARG,
+	PUSH_u8, 2,
+	MUL_u8,
+	RET_u16
+};
+
+/* resume handle, returning what it yielded or returned, or -1 */
+static int resume(VM *vm, uint32_t handle, uint64_t *val)
+{
+	uint8_t yielded;
+
+	vm_push_u32(vm, handle);
+	if (run_vm(vm, code, 0) != VM_HALT) return -1;
+	if (vm_pop_u8(vm, &yielded) != 0) return -1;
+	if (vm_pop_u64(vm, val) != 0) return -1;
+
+	return yielded;
+}
+
+/* a coroutine with a stack of size bytes runs to the end */
+static void run_coroutine(uint16_t size)
+{
+	VM *vm = make_vm(code, 256, 16);
+	uint32_t handle;
+	uint64_t val;
+	uint8_t v;
+
+	code[9] = size >> 8;
+	code[10] = size & 0xFF;
+
+	CHECK(run_vm(vm, code, 2) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &handle) == 0 && handle == 0);
+
+	CHECK(resume(vm, handle, &val) == 1 && val == 1);
+	CHECK(resume(vm, handle, &val) == 1 && val == 2);
+	CHECK(resume(vm, handle, &val) == 0 && val == 10);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	/* the handle is freed once the function returns */
+	CHECK(resume(vm, handle, &val) == -1);
+
+	free_vm(vm);
+}
+
+/* stack sizes that leave the frames after them unaligned still work */
+static void test_resume_yield(void)
+{
+	run_coroutine(256);
+	run_coroutine(61);
+	run_coroutine(63);
+	run_coroutine(65);
+}
+
+/* handles are reused once freed, and a stack too small faults */
+static void test_handles(void)
+{
+	VM *vm = make_vm(code, 256, 16);
+	uint32_t a, b;
+	uint64_t val;
+
+	code[9] = 1;
+	code[10] = 0;
+	CHECK(run_vm(vm, code, 2) == VM_HALT);
+	CHECK(run_vm(vm, code, 2) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &b) == 0 && b == 1);
+	CHECK(vm_pop_u32(vm, &a) == 0 && a == 0);
+
+	while (resume(vm, a, &val) == 1) continue;
+	CHECK(run_vm(vm, code, 2) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &a) == 0 && a == 0);
+
+	code[9] = 0;
+	code[10] = 13;
+	CHECK(run_vm(vm, code, 2) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+/* YIELD outside a coroutine, or a coroutine resuming itself, faults */
+static void test_bad(void)
+{
+	uint8_t yield[] = {
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 1,
+		YIELD,
+		HALT
+	};
+	uint8_t self[] = {
+		RESUME,
+		HALT,
+		PUSH_u8, 0,
+		PUSH_u32, 0, 0, 1, 0,
+		CORO_NEW, 0, 0, 0, 15,
+		HALT,
+		PUSH_u32, 0, 0, 0, 0,
+		RESUME,
+		HALT
+	};
+	VM *vm = make_vm(yield, 256, 16), *clone;
+	uint32_t handle;
+
+	CHECK(run_vm(vm, yield, 0) == VM_FAULT);
+
+	CHECK(run_vm(vm, self, 2) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &handle) == 0 && handle == 0);
+
+	/* the fault ends the coroutine and is raised by the RESUME */
+	CHECK(vm_clone(vm) == NULL);
+	CHECK(vm_push_u32(vm, handle) == 0);
+	CHECK(run_vm(vm, self, 0) == VM_FAULT);
+	clone = vm_clone(vm);
+	CHECK(clone != NULL);
+	if (clone != NULL) free_vm(clone);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_resume_yield();
+	test_handles();
+	test_bad();
+
+	return failures != 0;
+}
@@ -0,0 +1,73 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <debug.h>
+#include <vm.h>
+#include "test.h"
+
+static VM *stepper;
+static int traps[2];
+
+/* step through everything stepper runs, and only count the others */
+static int on_trap(VM *vm, size_t pc, void *arg)
+{
+	(void)pc;
+	(void)arg;
+
+	if (vm == stepper) {
+		++traps[0];
+		return DEBUG_STEP;
+	}
+	++traps[1];
+
+	return DEBUG_CONTINUE;
+}
+
+/* one VM stepping doesn't make another sharing its debugger trap */
+static void test_step_per_vm(void)
+{
+	uint8_t code[] = {PUSH_u8, 1, PUSH_u8, 2, ADD_u8, HALT};
+	Debugger *d = make_debugger(code, sizeof(code), on_trap, NULL);
+	VM *a = make_vm(code, 64, 16), *b = make_vm(code, 64, 16);
+	uint8_t v;
+
+	vm_debug(a, d, code);
+	vm_debug(b, d, code);
+	CHECK(set_breakpoint(d, 2) == 0);
+	stepper = a;
+
+	CHECK(run_vm(a, NULL, 0) == VM_HALT);
+	CHECK(traps[0] == 3);
+	CHECK(vm_pop_u8(a, &v) == 0 && v == 3);
+
+	CHECK(run_vm(b, NULL, 0) == VM_HALT);
+	CHECK(traps[1] == 1);
+	CHECK(vm_pop_u8(b, &v) == 0 && v == 3);
+
+	free_vm(a);
+	free_vm(b);
+	free_debugger(d);
+}
+
+int main(void)
+{
+	test_step_per_vm();
+
+	return failures != 0;
+}
@@ -0,0 +1,73 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <vm.h>
+#include "test.h"
+
+/* run a, b, op on the stack and pop the u8 result or the exception */
+static int divide_u8(uint8_t op, uint8_t a, uint8_t b, uint8_t *result)
+{
+	uint8_t code[] = {PUSH_u8, 0, PUSH_u8, 0, 0, HALT};
+	VM *vm = make_vm(code, 64, 16);
+	int status;
+
+	code[1] = a;
+	code[3] = b;
+	code[4] = op;
+
+	status = run_vm(vm, code, 0);
+	if (status == VM_HALT) vm_pop_u8(vm, result);
+	free_vm(vm);
+
+	return status;
+}
+
+static void test_narrow_overflow(void)
+{
+	uint8_t v = 0;
+
+	/* the minimum over -1 is promoted to int, so it doesn't trap */
+	CHECK(divide_u8(DIV_i8, 0x80, 0xFF, &v) == VM_HALT && v == 0x80);
+	CHECK(divide_u8(MOD_i8, 0x80, 0xFF, &v) == VM_HALT && v == 0);
+	CHECK(divide_u8(DIV_i8, 0x80, 0, &v) == VM_FAULT);
+}
+
+static void test_wide_overflow(void)
+{
+	uint8_t code[] = {
+		PUSH_u32, 0x80, 0, 0, 0,
+		PUSH_u32, 0xFF, 0xFF, 0xFF, 0xFF,
+		DIV_i32,
+		HALT
+	};
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(run_vm(vm, code, 0) == VM_FAULT);
+	CHECK(vm_exception(vm) == VM_ERR_DIV);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_narrow_overflow();
+	test_wide_overflow();
+
+	return failures != 0;
+}
@@ -0,0 +1,153 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <vm.h>
+#include "test.h"
+
+/* run code on vm from 0, returning the status */
+static int run(VM *vm, uint8_t *code)
+{
+	return run_vm(vm, code, 0);
+}
+
+/* LOAD and STORE reach windows past the private env */
+static void test_load_store(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 17,
+		LOAD_u8,
+		PUSH_u8, 24,
+		STORE_u8,
+		HALT
+	};
+	uint8_t ro[8] = {0, 7}, rw[8];
+	VM *vm = make_vm(code, 64, 16);
+	uint8_t v;
+
+	memset(rw, 0, sizeof(rw));
+	CHECK(vm_bind_env(vm, 16, ro, sizeof(ro), VM_ENV_READ) == 0);
+	CHECK(vm_bind_env(vm, 24, rw, sizeof(rw),
+		VM_ENV_READ | VM_ENV_WRITE) == 0);
+
+	CHECK(run(vm, code) == VM_HALT);
+	CHECK(rw[0] == 7);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+}
+
+/* a STORE to a read-only window faults and leaves the buffer alone */
+static void test_store_read_only(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 9,
+		PUSH_u8, 20,
+		STORE_u8,
+		HALT
+	};
+	uint8_t ro[8];
+	VM *vm = make_vm(code, 64, 16);
+
+	memset(ro, 0, sizeof(ro));
+	CHECK(vm_bind_env(vm, 16, ro, sizeof(ro), VM_ENV_READ) == 0);
+
+	CHECK(run(vm, code) == VM_FAULT);
+	CHECK(ro[4] == 0);
+	CHECK(vm_env_write(vm, 20, "x", 1) == -1);
+	CHECK(ro[4] == 0);
+
+	free_vm(vm);
+}
+
+/* addresses past a window, or between windows, fault */
+static void test_outside(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 40,
+		LOAD_u8,
+		HALT
+	};
+	uint8_t buf[8];
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(vm_bind_env(vm, 32, buf, sizeof(buf), VM_ENV_READ) == 0);
+	CHECK(run(vm, code) == VM_FAULT);
+
+	code[1] = 20;
+	CHECK(run(vm, code) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+/* an access must fit in one window or the private env */
+static void test_straddle(void)
+{
+	uint8_t a[8], b[8], out[4];
+	uint8_t code[] = {HALT};
+	VM *vm = make_vm(code, 64, 16);
+
+	memset(a, 1, sizeof(a));
+	memset(b, 2, sizeof(b));
+	CHECK(vm_bind_env(vm, 16, a, sizeof(a),
+		VM_ENV_READ | VM_ENV_WRITE) == 0);
+	CHECK(vm_bind_env(vm, 24, b, sizeof(b),
+		VM_ENV_READ | VM_ENV_WRITE) == 0);
+
+	/* private env into the first window, then across both windows */
+	CHECK(vm_env_read(vm, 14, out, 4) == -1);
+	CHECK(vm_env_read(vm, 22, out, 4) == -1);
+	CHECK(vm_env_write(vm, 22, out, 4) == -1);
+	CHECK(vm_env_read(vm, 30, out, 4) == -1);
+	CHECK(a[6] == 1 && b[0] == 2);
+
+	CHECK(vm_env_read(vm, 20, out, 4) == 0 && out[3] == 1);
+	CHECK(vm_env_read(vm, 12, out, 4) == 0);
+
+	free_vm(vm);
+}
+
+/* windows can't overlap each other or the private env */
+static void test_bind(void)
+{
+	uint8_t buf[8];
+	uint8_t code[] = {HALT};
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(vm_bind_env(vm, 8, buf, sizeof(buf), VM_ENV_READ) == -1);
+	CHECK(vm_bind_env(vm, 16, buf, sizeof(buf), VM_ENV_READ) == 0);
+	CHECK(vm_bind_env(vm, 20, buf, sizeof(buf), VM_ENV_READ) == -1);
+	CHECK(vm_bind_env(vm, 12, buf, 0, VM_ENV_READ) == -1);
+	CHECK(vm_unbind_env(vm, 16) == 0);
+	CHECK(vm_bind_env(vm, 20, buf, sizeof(buf), VM_ENV_READ) == 0);
+	CHECK(vm_unbind_env(vm, 16) == -1);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_load_store();
+	test_store_read_only();
+	test_outside();
+	test_straddle();
+	test_bind();
+
+	return failures != 0;
+}
@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <channel.h>
+#include <debug.h>
+#include <vm.h>
+#include "test.h"
+
+/* host pushes and pops after a clone must reach the next clone */
+static void test_clone_after_push(void)
+{
+	uint8_t code[] = {PUSH_u8, 5, HALT};
+	uint8_t v;
+	VM *vm = make_vm(code, 64, 16), *a, *b;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+
+	a = vm_clone(vm);
+	CHECK(a != NULL);
+	CHECK(vm_push_u8(vm, 9) == 0);
+
+	b = vm_clone(vm);
+	CHECK(b != NULL);
+	CHECK(b != NULL && vm_pop_u8(b, &v) == 0 && v == 9);
+	CHECK(a != NULL && vm_pop_u8(a, &v) == 0 && v == 5);
+
+	CHECK(vm_pop_u8(vm, &v) == 0 && vm_pop_u8(vm, &v) == 0);
+	free_vm(b);
+	b = vm_clone(vm);
+	CHECK(b != NULL && vm_pop_u8(b, &v) == -1);
+
+	free_vm(a);
+	free_vm(b);
+	free_vm(vm);
+}
+
+/* a call that blocks is suspended, and one that faults is dropped */
+static void test_call_status(void)
+{
+	uint8_t code[] = {
+		HALT,
+		PUSH_u8, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 4,
+		RECV,
+		PUSH_u8, 7,
+		RET_u8,
+		PUSH_u8, 200,
+		LOAD_u8,
+		RET_u8
+	};
+	Channel *c = make_channel(2, 1);
+	VM *vm = make_vm(code, 64, 16);
+	struct vm_regs regs;
+	uint64_t r = 0;
+	uint8_t v = 1;
+
+	CHECK(vm_attach_channel(vm, 0, c) == 0);
+	CHECK(vm_push_u8(vm, 3) == 0);
+
+	CHECK(vm_call(vm, 1, NULL, 0, &r) == VM_BLOCKED);
+	CHECK(vm_call(vm, 16, NULL, 0, &r) == -1);
+	CHECK(channel_send(c, &v) == 0);
+	CHECK(vm_call_resume(vm, vm_wait(vm), &r) == VM_RETURN && r == 7);
+	CHECK(vm_call_resume(vm, 1, &r) == -1);
+
+	vm_get_regs(vm, &regs);
+	CHECK(regs.sp == 1 && regs.fp == 0 && regs.csp == 0);
+
+	CHECK(vm_call(vm, 16, NULL, 0, &r) == VM_FAULT);
+	vm_get_regs(vm, &regs);
+	CHECK(regs.sp == 1 && regs.fp == 0 && regs.csp == 0);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 3);
+
+	free_vm(vm);
+	free_channel(c);
+}
+
+int main(void)
+{
+	test_clone_after_push();
+	test_call_status();
+
+	return failures != 0;
+}
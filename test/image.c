@@ -0,0 +1,142 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <port.h>
+#include <vm.h>
+#include "test.h"
+
+/* make test runs from the top directory */
+#define IMAGE "bin/test_image.img"
+
+/* overwrite the u64 header field at off */
+static void poke(size_t off, uint64_t v)
+{
+	FILE *f = fopen(IMAGE, "r+b");
+
+	fseek(f, off, SEEK_SET);
+	fwrite(&v, sizeof(v), 1, f);
+	fclose(f);
+}
+
+static void test_restore(void)
+{
+	uint8_t code[] = {PUSH_u8, 5, HALT};
+	uint8_t v;
+	VM *vm = make_vm(code, 64, 16), *copy;
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_snapshot(vm, IMAGE) == 0);
+
+	copy = vm_restore(IMAGE, code);
+	CHECK(copy != NULL);
+	if (copy != NULL) {
+		CHECK(vm_pop_u8(copy, &v) == 0 && v == 5);
+		free_vm(copy);
+	}
+
+	free_vm(vm);
+}
+
+/* corrupt sizes and offsets must not be trusted */
+static void test_corrupt(void)
+{
+	uint8_t code[] = {HALT};
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(vm_snapshot(vm, IMAGE) == 0);
+	poke(40, (uint64_t)1 << 40); /* csp */
+	CHECK(vm_restore(IMAGE, code) == NULL);
+
+	CHECK(vm_snapshot(vm, IMAGE) == 0);
+	poke(56, (uint64_t)1 << 20); /* env_size */
+	CHECK(vm_restore(IMAGE, code) == NULL);
+
+	CHECK(vm_snapshot(vm, IMAGE) == 0);
+	poke(72, (uint64_t)1 << 20); /* stack_off */
+	CHECK(vm_restore(IMAGE, code) == NULL);
+
+	free_vm(vm);
+	remove(IMAGE);
+}
+
+/* a suspended coroutine's stack isn't part of the image */
+static void test_coroutine(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		PUSH_u32, 0, 0, 1, 0,
+		CORO_NEW, 0, 0, 0, 13,
+		HALT,
+		PUSH_u8, 1,
+		RET_u8
+	};
+	uint32_t handle;
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_clone(vm) == NULL);
+	CHECK(vm_snapshot(vm, IMAGE) == -1);
+
+	CHECK(vm_pop_u32(vm, &handle) == 0 && handle == 0);
+
+	free_vm(vm);
+}
+
+/* a clone has none of vm's ports, so OUT faults rather than share one */
+static void test_clone_ports(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		PUSH_u32, 0, 0, 0, 1,
+		OUT,
+		HALT
+	};
+	Port *p = make_port(16, PORT_RAW);
+	VM *vm = make_vm(code, 64, 16), *clone;
+	uint8_t buf[2];
+
+	CHECK(vm_attach_port(vm, 0, p) == 0);
+	CHECK(vm_env_write(vm, 0, "x", 1) == 0);
+
+	clone = vm_clone(vm);
+	CHECK(clone != NULL);
+	if (clone != NULL) {
+		CHECK(run_vm(clone, code, 0) == VM_FAULT);
+		CHECK(port_read(p, buf, sizeof(buf)) == 0);
+		free_vm(clone);
+	}
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(port_read(p, buf, sizeof(buf)) == 1 && buf[0] == 'x');
+
+	free_vm(vm);
+	free_port(p);
+}
+
+int main(void)
+{
+	test_restore();
+	test_corrupt();
+	test_coroutine();
+	test_clone_ports();
+
+	return failures != 0;
+}
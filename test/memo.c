@@ -0,0 +1,176 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <memo.h>
+#include <vm.h>
+#include "test.h"
+
+/* a PURE function tail calling another leaves both pending on a frame */
+static void test_tail_call(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 10,
+		HALT,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8
+	};
+	Memo *m = make_memo(16);
+	VM *vm = make_vm(code, 256, 16);
+	struct memo_stats s;
+	uint8_t v;
+	int i;
+
+	vm_attach_memo(vm, m);
+
+	for (i=0; i<2; ++i) {
+		CHECK(run_vm(vm, code, 0) == VM_HALT);
+		CHECK(vm_pop_u8(vm, &v) == 0 && v == 6);
+		CHECK(vm_pop_u8(vm, &v) == -1);
+	}
+
+	/* the second run hits on the outer call, saved by the inner */
+	memo_stats(m, &s);
+	CHECK(s.misses == 2 && s.hits == 1);
+
+	free_vm(vm);
+	free_memo(m);
+}
+
+/* both pending calls are abandoned when the inner one throws */
+static void test_tail_call_throws(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 11,
+		HALT,
+		HALT,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PURE, 1,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 7,
+		THROW
+	};
+	struct try_entry tries[] = {{4, 9, 10, 0}};
+	Memo *m = make_memo(16);
+	VM *vm = make_vm(code, 256, 16);
+	uint64_t v;
+
+	vm_attach_memo(vm, m);
+	vm_set_try_table(vm, tries, 1);
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &v) == 0 && v == 7);
+
+	free_vm(vm);
+	free_memo(m);
+}
+
+/* programs sharing a memo don't see each other's results at one pc */
+static void test_shared(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 10,
+		HALT,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8
+	};
+	uint8_t other[sizeof(code)];
+	Memo *m = make_memo(16);
+	VM *a = make_vm(code, 256, 16), *b;
+	uint8_t v;
+
+	memcpy(other, code, sizeof(code));
+	other[16] = 2;
+	b = make_vm(other, 256, 16);
+
+	vm_attach_memo(a, m);
+	vm_attach_memo(b, m);
+
+	CHECK(run_vm(a, code, 0) == VM_HALT);
+	CHECK(vm_pop_u8(a, &v) == 0 && v == 6);
+	CHECK(run_vm(b, other, 0) == VM_HALT);
+	CHECK(vm_pop_u8(b, &v) == 0 && v == 7);
+	CHECK(run_vm(a, code, 0) == VM_HALT);
+	CHECK(vm_pop_u8(a, &v) == 0 && v == 6);
+
+	free_vm(a);
+	free_vm(b);
+	free_memo(m);
+}
+
+/* an image can't hold a PURE call still waiting on its result */
+static void test_snapshot_pending(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 0,
+		CALL_abs, 0, 0, 0, 8,
+		HALT,
+		PURE, 1,
+		HALT
+	};
+	const char *image = "bin/test_memo.img";
+	Memo *m = make_memo(16);
+	VM *vm = make_vm(code, 256, 16);
+
+	vm_attach_memo(vm, m);
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_snapshot(vm, image) == -1);
+	free_vm(vm);
+
+	vm = make_vm(code, 256, 16);
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_snapshot(vm, image) == 0);
+	free_vm(vm);
+
+	remove(image);
+	free_memo(m);
+}
+
+int main(void)
+{
+	test_tail_call();
+	test_tail_call_throws();
+	test_shared();
+	test_snapshot_pending();
+
+	return failures != 0;
+}
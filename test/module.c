@@ -0,0 +1,284 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <compact.h>
+#include <module.h>
+#include <vm.h>
+#include "test.h"
+
+#define MODULE "bin/test_module.mod"
+
+/* the header and the five sections' table come before the code */
+#define CODE_OFF (32 + 5*32)
+
+/* push env[0] from the data section, or throw at 5 to the handler */
+static uint8_t code[] = {
+	PUSH_u8, 0,
+	LOAD_u8,
+	HALT,
+	HALT,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 9,
+	THROW,
+	HALT
+};
+/* the same in the compact encoding, which only the PUSH_u64 shrinks */
+static uint8_t compact[] = {
+	PUSH_u8, 0,
+	LOAD_u8,
+	HALT,
+	HALT,
+	PUSH_u64, 9,
+	THROW,
+	HALT
+};
+static const uint8_t data[] = {42};
+static const struct symbol symbols[] = {
+	{"main", 0, SYMBOL_ENTRY},
+	{"throw", 5, SYMBOL_ENTRY},
+	{"local", 3, 0}
+};
+static const struct try_entry tries[] = {{5, 15, 15, 0}};
+static const struct try_entry compact_tries[] = {{5, 8, 8, 0}};
+
+static int write_test_module(uint32_t flags)
+{
+	struct module_desc desc;
+
+	desc.flags = flags;
+	desc.code = flags & MODULE_COMPACT ? compact : code;
+	desc.code_size = flags & MODULE_COMPACT ? sizeof(compact)
+		: sizeof(code);
+	desc.data = data;
+	desc.data_size = sizeof(data);
+	desc.symbols = symbols;
+	desc.symbol_count = 3;
+	desc.tries = flags & MODULE_COMPACT ? compact_tries : tries;
+	desc.try_count = 1;
+
+	return write_module(MODULE, &desc);
+}
+
+/* flip the bits of the byte at off */
+static void flip(long off)
+{
+	FILE *f = fopen(MODULE, "r+b");
+	int c;
+
+	fseek(f, off, SEEK_SET);
+	c = getc(f);
+	fseek(f, off, SEEK_SET);
+	putc(~c & 0xFF, f);
+	fclose(f);
+}
+
+/* cut the last n bytes off the module */
+static void truncate_module(long n)
+{
+	FILE *f = fopen(MODULE, "rb");
+	long size;
+	char *buf;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	buf = malloc(size);
+	fseek(f, 0, SEEK_SET);
+	CHECK(fread(buf, 1, size, f) == (size_t)size);
+	fclose(f);
+
+	f = fopen(MODULE, "wb");
+	fwrite(buf, 1, size - n, f);
+	fclose(f);
+	free(buf);
+}
+
+/* run m from its entry name, returning what it left on top */
+static uint64_t run_entry(Module *m, const char *name, int status)
+{
+	uint64_t v = 0;
+	size_t pc = 0;
+	VM *vm = make_module_vm(m, 64, 16);
+
+	CHECK(vm != NULL);
+	if (vm == NULL) return 0;
+
+	CHECK(module_entry(m, name, &pc) == 0);
+	CHECK(run_vm(vm, module_code(m, NULL), pc) == status);
+	if (status == VM_HALT) {
+		uint8_t b = 0;
+
+		CHECK(vm_pop_u8(vm, &b) == 0);
+		v = b;
+	} else {
+		CHECK(vm_pop_u64(vm, &v) == 0);
+	}
+	free_vm(vm);
+
+	return v;
+}
+
+static void test_round_trip(void)
+{
+	const struct try_entry *t;
+	size_t size, count;
+	Module *m;
+
+	CHECK(write_test_module(0) == 0);
+	m = load_module(MODULE);
+	CHECK(m != NULL);
+	if (m == NULL) return;
+
+	CHECK(module_code(m, &size) != NULL && size == sizeof(code));
+	CHECK(module_symbols(m, &count) != NULL && count == 3);
+	CHECK(module_entry(m, "local", &size) == -1);
+	t = module_tries(m, &count);
+	CHECK(count == 1 && t[0].handler == 15);
+
+	CHECK(run_entry(m, "main", VM_HALT) == 42);
+	CHECK(run_entry(m, "throw", VM_HALT) == 9);
+
+	free_module(m);
+}
+
+/* compact code is translated, with symbols and tries moved along */
+static void test_compact_round_trip(void)
+{
+	struct symbol moved[3];
+	const struct try_entry *t;
+	size_t count, pc;
+	Module *m;
+
+	CHECK(write_test_module(MODULE_COMPACT) == 0);
+	m = load_module(MODULE);
+	CHECK(m != NULL);
+	if (m == NULL) return;
+
+	CHECK(module_entry(m, "throw", &pc) == 0 && pc == 5);
+	memcpy(moved, module_symbols(m, &count), sizeof(moved));
+	CHECK(moved[2].pc == 3);
+	t = module_tries(m, &count);
+	CHECK(count == 1 && t[0].end == 15 && t[0].handler == 15);
+	CHECK(run_entry(m, "throw", VM_HALT) == 9);
+
+	free_module(m);
+}
+
+/* a corrupt section table or symbol fails the load */
+static void test_corrupt_table(void)
+{
+	CHECK(write_test_module(0) == 0);
+	flip(32 + 16);
+	CHECK(load_module(MODULE) == NULL);
+
+	CHECK(write_test_module(0) == 0);
+	flip(CODE_OFF + sizeof(code) + sizeof(data));
+	CHECK(load_module(MODULE) == NULL);
+}
+
+/* corrupt code or data loads, but is refused when it's used */
+static void test_corrupt_code(void)
+{
+	Module *m;
+
+	CHECK(write_test_module(0) == 0);
+	flip(CODE_OFF + 1);
+	m = load_module(MODULE);
+	CHECK(m != NULL);
+	if (m != NULL) {
+		CHECK(module_code(m, NULL) == NULL);
+		CHECK(make_module_vm(m, 64, 16) == NULL);
+		free_module(m);
+	}
+
+	CHECK(write_test_module(0) == 0);
+	flip(CODE_OFF + sizeof(code));
+	m = load_module(MODULE);
+	CHECK(m != NULL);
+	if (m != NULL) {
+		CHECK(module_code(m, NULL) != NULL);
+		CHECK(make_module_vm(m, 64, 16) == NULL);
+		free_module(m);
+	}
+
+	/* compact code is read on load */
+	CHECK(write_test_module(MODULE_COMPACT) == 0);
+	flip(CODE_OFF + 1);
+	CHECK(load_module(MODULE) == NULL);
+}
+
+static void test_truncated(void)
+{
+	CHECK(write_test_module(0) == 0);
+	truncate_module(1);
+	CHECK(load_module(MODULE) == NULL);
+
+	CHECK(write_test_module(0) == 0);
+	truncate_module(32*5 + 31);
+	CHECK(load_module(MODULE) == NULL);
+}
+
+/* rewrite the module over and over, counting the writes that failed */
+static void* rewrite(void *arg)
+{
+	long i, failed = 0;
+
+	for (i = 0; i < 200; ++i) {
+		if (write_test_module(arg != NULL ? MODULE_COMPACT : 0)) {
+			++failed;
+		}
+	}
+
+	return (void*)failed;
+}
+
+/* writers racing on one path each leave a whole module behind */
+static void test_concurrent_writes(void)
+{
+	pthread_t t;
+	void *failed;
+	Module *m;
+
+	CHECK(pthread_create(&t, NULL, rewrite, NULL) == 0);
+	CHECK(rewrite(&t) == NULL);
+	CHECK(pthread_join(t, &failed) == 0 && failed == NULL);
+
+	m = load_module(MODULE);
+	CHECK(m != NULL);
+	if (m != NULL) {
+		CHECK(run_entry(m, "main", VM_HALT) == 42);
+		free_module(m);
+	}
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_compact_round_trip();
+	test_corrupt_table();
+	test_corrupt_code();
+	test_truncated();
+	test_concurrent_writes();
+
+	remove(MODULE);
+
+	return failures != 0;
+}
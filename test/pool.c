@@ -0,0 +1,121 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <pool.h>
+#include <port.h>
+#include <vm.h>
+#include "test.h"
+
+#define HANDLER 27
+#define CHILD 28
+
+/* spawn a child that throws 99, and JOIN it inside a try region */
+static uint8_t code[] = {
+	PUSH_u8, 0,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 16,
+	SPAWN, 0, 0, 0, CHILD,
+	JOIN,
+	HALT,
+	HALT,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 99,
+	THROW
+};
+
+static const struct try_entry tries[] = {{25, 26, HANDLER, 0}};
+
+static void test_join_throws(Pool *pool)
+{
+	uint64_t v;
+	VM *vm = make_vm(code, 256, 16);
+
+	vm_attach_pool(vm, pool);
+	vm_set_try_table(vm, tries, 1);
+
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &v) == 0 && v == 99);
+
+	free_vm(vm);
+}
+
+/* children left unjoined must finish before their parent's env goes */
+static void test_free_unjoined(Pool *pool)
+{
+	uint8_t spawn_only[sizeof(code)];
+	size_t i;
+
+	/* halt where the JOIN was, leaving the child to run */
+	memcpy(spawn_only, code, sizeof(code));
+	spawn_only[25] = HALT;
+
+	for (i=0; i<16; ++i) {
+		VM *vm = make_vm(spawn_only, 256, 16);
+
+		vm_attach_pool(vm, pool);
+		CHECK(run_vm(vm, spawn_only, 0) == VM_HALT);
+		free_vm(vm);
+	}
+}
+
+/* a child has none of its parent's ports, so its OUT faults */
+static void test_child_ports(Pool *pool)
+{
+	uint8_t child[] = {
+		PUSH_u8, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		PUSH_u32, 0, 0, 0, 1,
+		OUT,
+		RET_u8
+	};
+	uint8_t out[CHILD + sizeof(child)];
+	Port *p = make_port(16, PORT_RAW);
+	VM *vm = make_vm(out, 256, 16);
+	uint8_t buf[2];
+	uint64_t v;
+
+	memcpy(out, code, CHILD);
+	memcpy(out + CHILD, child, sizeof(child));
+
+	vm_attach_pool(vm, pool);
+	vm_set_try_table(vm, tries, 1);
+	CHECK(vm_attach_port(vm, 0, p) == 0);
+
+	CHECK(run_vm(vm, out, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &v) == 0 && v == VM_ERR_FAULT);
+	CHECK(port_read(p, buf, sizeof(buf)) == 0);
+
+	free_vm(vm);
+	free_port(p);
+}
+
+int main(void)
+{
+	Pool *pool = make_pool(2);
+
+	test_join_throws(NULL);
+	test_join_throws(pool);
+	test_free_unjoined(pool);
+	test_child_ports(NULL);
+	test_child_ports(pool);
+
+	free_pool(pool);
+
+	return failures != 0;
+}
@@ -0,0 +1,300 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <analyze.h>
+#include <debug.h>
+#include <memo.h>
+#include <regvm.h>
+#include <vm.h>
+#include "test.h"
+
+/* a PURE function tail calling another, returning through the engine */
+static void test_pure_tail_call(void)
+{
+	uint8_t code[] = {
+		PUSH_u8, 5,
+		PUSH_u8, 1,
+		CALL_abs, 0, 0, 0, 10,
+		HALT,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		TCALL, 0, 0, 0, 5,
+		PURE, 1,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8
+	};
+	RegCode *rc = make_reg_code(code, sizeof(code));
+	Memo *m = make_memo(16);
+	VM *vm = make_vm(code, 256, 16);
+	uint8_t v;
+	int i;
+
+	CHECK(rc != NULL);
+	vm_attach_memo(vm, m);
+
+	for (i=0; i<2; ++i) {
+		CHECK(run_reg(vm, rc, 0) == VM_HALT);
+		CHECK(vm_pop_u8(vm, &v) == 0 && v == 6);
+		CHECK(vm_pop_u8(vm, &v) == -1);
+	}
+
+	free_vm(vm);
+	free_memo(m);
+	free_reg_code(rc);
+}
+
+static int traps;
+
+static int on_trap(VM *vm, size_t pc, void *arg)
+{
+	(void)vm;
+	(void)pc;
+	(void)arg;
+	++traps;
+
+	return DEBUG_CONTINUE;
+}
+
+/* breakpoints set after translation still stop the run */
+static void test_breakpoint(void)
+{
+	uint8_t code[] = {PUSH_u8, 1, PUSH_u8, 2, ADD_u8, HALT};
+	RegCode *rc = make_reg_code(code, sizeof(code));
+	Debugger *d = make_debugger(code, sizeof(code), on_trap, NULL);
+	VM *vm = make_vm(code, 64, 16);
+	uint16_t v;
+
+	vm_debug(vm, d, code);
+	CHECK(set_breakpoint(d, 4) == 0);
+
+	CHECK(run_reg(vm, rc, 0) == VM_HALT);
+	CHECK(traps == 1);
+	CHECK(vm_pop_u16(vm, &v) == 0 && v == 3);
+
+	free_vm(vm);
+	free_debugger(d);
+	free_reg_code(rc);
+}
+
+/* a VM moved to other code doesn't run the old translation */
+static void test_other_code(void)
+{
+	uint8_t code[] = {PUSH_u8, 1, PUSH_u8, 2, ADD_u8, HALT};
+	uint8_t other[sizeof(code)];
+	RegCode *rc = make_reg_code(code, sizeof(code));
+	VM *vm;
+	uint16_t v;
+
+	memcpy(other, code, sizeof(code));
+	other[3] = 40;
+	vm = make_vm(other, 64, 16);
+
+	CHECK(run_reg(vm, rc, 0) == VM_HALT);
+	CHECK(vm_pop_u16(vm, &v) == 0 && v == 41);
+
+	free_vm(vm);
+	free_reg_code(rc);
+}
+
+/* reg_call suspends and drops calls as vm_call does */
+static void test_call_status(void)
+{
+	uint8_t code[] = {
+		HALT,
+		PUSH_u8, 1,
+		ARG,
+		PUSH_u8, 1,
+		ADD_u8,
+		RET_u8,
+		PUSH_u8, 200,
+		LOAD_u8,
+		RET_u8
+	};
+	RegCode *rc = make_reg_code(code, sizeof(code));
+	VM *vm = make_vm(code, 64, 16);
+	uint8_t arg = 41, v;
+	uint64_t r = 0;
+
+	CHECK(vm_push_u8(vm, 3) == 0);
+	CHECK(reg_call(vm, rc, 1, &arg, 1, &r) == VM_RETURN && r == 42);
+	CHECK(reg_call(vm, rc, 8, NULL, 0, &r) == VM_FAULT);
+	CHECK(vm_pop_u8(vm, &v) == 0 && v == 3);
+	CHECK(vm_pop_u8(vm, &v) == -1);
+
+	free_vm(vm);
+	free_reg_code(rc);
+}
+
+/*
+ * run code from 0 on run_vm and the register engine, checking both stop
+ * with status and leave the same exception, stack and env
+ */
+static void check_same(uint8_t *code, size_t size, int status)
+{
+	RegCode *rc = make_reg_code(code, size);
+	VM *a = make_vm(code, 256, 16), *b = make_vm(code, 256, 16);
+	uint8_t env_a[16], env_b[16], x, y;
+	int ra, rb;
+
+	CHECK(rc != NULL);
+
+	/* env starts out as whatever malloc gave */
+	memset(env_a, 0, sizeof(env_a));
+	CHECK(vm_env_write(a, 0, env_a, sizeof(env_a)) == 0);
+	CHECK(vm_env_write(b, 0, env_a, sizeof(env_a)) == 0);
+
+	CHECK(run_vm(a, code, 0) == status);
+	CHECK(run_reg(b, rc, 0) == status);
+	if (status != VM_HALT) CHECK(vm_exception(a) == vm_exception(b));
+
+	do {
+		ra = vm_pop_u8(a, &x);
+		rb = vm_pop_u8(b, &y);
+		CHECK(ra == rb && (ra != 0 || x == y));
+	} while (ra == 0 && rb == 0);
+
+	CHECK(vm_env_read(a, 0, env_a, sizeof(env_a)) == 0);
+	CHECK(vm_env_read(b, 0, env_b, sizeof(env_b)) == 0);
+	CHECK(memcmp(env_a, env_b, sizeof(env_a)) == 0);
+
+	free_vm(a);
+	free_vm(b);
+	free_reg_code(rc);
+}
+
+/* both engines agree on loops, calls, faults and throws */
+static void test_same_as_run_vm(void)
+{
+	/* sum 10 down to 1 into env[1], counting down in env[0] */
+	uint8_t loop[] = {
+		PUSH_u8, 10, PUSH_u8, 0, STORE_u8,
+		PUSH_u8, 0, PUSH_u8, 1, STORE_u8,
+		PUSH_u8, 1, LOAD_u8,
+		PUSH_u8, 0, LOAD_u8,
+		ADD_u8,
+		PUSH_u8, 1, STORE_u8, POP_u8,
+		PUSH_u8, 0, LOAD_u8,
+		PUSH_u8, 1,
+		SUB_u8,
+		PUSH_u8, 0, STORE_u8, POP_u8,
+		PUSH_u8, 0, LOAD_u8,
+		JMPIF_abs, 0, 0, 0, 10,
+		PUSH_u8, 1, LOAD_u8,
+		HALT
+	};
+	/* fib(10) as a u64, recursing with CALL_abs */
+	uint8_t fib[] = {
+		PUSH_u16, 0, 10,
+		PUSH_u8, 2,
+		CALL_abs, 0, 0, 0, 11,
+		HALT,
+		PUSH_u8, 1, ARG,
+		PUSH_u8, 2,
+		LT_u8,
+		JMPIF_abs, 0, 0, 0, 50,
+		PUSH_u8, 1, ARG,
+		PUSH_u8, 1,
+		SUB_u8,
+		PUSH_u8, 2,
+		CALL_abs, 0, 0, 0, 11,
+		PUSH_u8, 1, ARG,
+		PUSH_u8, 2,
+		SUB_u8,
+		PUSH_u8, 2,
+		CALL_abs, 0, 0, 0, 11,
+		ADD_u64,
+		RET_u64,
+		PUSH_u32, 0, 0, 0, 0,
+		PUSH_u16, 0, 0,
+		PUSH_u8, 0,
+		PUSH_u8, 1, ARG,
+		RET_u64
+	};
+	/* ARGC and wide ARGs from a frame above the bottom of the stack */
+	uint8_t args[] = {
+		PUSH_u8, 0xEE,
+		PUSH_u32, 0x12, 0x34, 0x56, 0x78,
+		PUSH_u16, 0xAB, 0xCD,
+		PUSH_u8, 6,
+		CALL_abs, 0, 0, 0, 18,
+		HALT,
+		ARGC,
+		PUSH_u8, 1,
+		ARG_u16,
+		PUSH_u8, 3,
+		ARG_u32,
+		RETN, 7
+	};
+	uint8_t divide[] = {
+		PUSH_u8, 7, PUSH_u8, 3, STORE_u8,
+		PUSH_u32, 0, 0, 0, 7,
+		PUSH_u32, 0, 0, 0, 0,
+		DIV_u32,
+		HALT
+	};
+	uint8_t throw[] = {
+		PUSH_u8, 1, PUSH_u8, 2, ADD_u8,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 99,
+		THROW
+	};
+
+	check_same(loop, sizeof(loop), VM_HALT);
+	check_same(fib, sizeof(fib), VM_HALT);
+	check_same(args, sizeof(args), VM_HALT);
+	check_same(divide, sizeof(divide), VM_FAULT);
+	check_same(throw, sizeof(throw), VM_EXCEPTION);
+}
+
+/* translating saves the analysis to the cache for the next setup */
+static void test_code_info_dir(void)
+{
+	uint8_t code[] = {PUSH_u8, 1, PUSH_u8, 2, ADD_u8, HALT};
+	RegCode *rc;
+	CodeInfo *info;
+
+	/* make test runs from the top directory */
+	set_code_info_dir("bin");
+	rc = make_reg_code(code, sizeof(code));
+	set_code_info_dir(NULL);
+	CHECK(rc != NULL);
+
+	info = load_code_info(code, sizeof(code), "bin");
+	CHECK(info != NULL && code_info_cached(info));
+
+	if (info != NULL) free_code_info(info);
+	if (rc != NULL) free_reg_code(rc);
+}
+
+int main(void)
+{
+	test_pure_tail_call();
+	test_breakpoint();
+	test_other_code();
+	test_call_status();
+	test_same_as_run_vm();
+	test_code_info_dir();
+
+	return failures != 0;
+}
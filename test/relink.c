@@ -0,0 +1,117 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <analyze.h>
+#include <profile.h>
+#include <vm.h>
+#include "test.h"
+
+/* the prefix the relinked code is moved past, to show it doesn't mind */
+#define SHIFT 8
+
+/*
+ * push f(5) = 6 if env[0] is set, else 99; the profile only sees the
+ * first, so the relinked test block jumps to the moved cold one
+ */
+static uint8_t code[] = {
+	PUSH_u8, 0,
+	LOAD_u8,
+	JMPIF_rel, 0, 0, 0, 8,
+	PUSH_u8, 99,
+	HALT,
+	PUSH_u8, 5,
+	PUSH_u8, 1,
+	CALL_rel, 0, 0, 0, 6,
+	HALT,
+	PUSH_u8, 1,
+	ARG,
+	PUSH_u8, 1,
+	ADD_u8,
+	RET_u8
+};
+
+/* run code from pc with env[0] set to flag, returning the top byte */
+static int run(uint8_t *c, size_t pc, uint8_t flag, Debugger *d)
+{
+	VM *vm = make_vm(c, 256, 16);
+	uint8_t v = 0;
+
+	vm_env_write(vm, 0, &flag, 1);
+	if (d != NULL) vm_debug(vm, d, c);
+
+	CHECK(run_vm(vm, NULL, pc) == VM_HALT);
+	CHECK(vm_pop_u8(vm, &v) == 0);
+	free_vm(vm);
+
+	return v;
+}
+
+static void test_relink(void)
+{
+	size_t pcmap[sizeof(code) + 1], size;
+	uint8_t *out, *shifted;
+	CodeInfo *info;
+	Profile *p;
+	int flag;
+
+	/* make test runs from the top directory */
+	set_code_info_dir("bin");
+	p = make_profile(code, sizeof(code));
+	set_code_info_dir(NULL);
+	CHECK(p != NULL);
+	if (p == NULL) return;
+
+	info = load_code_info(code, sizeof(code), "bin");
+	CHECK(info != NULL && code_info_cached(info));
+	if (info != NULL) free_code_info(info);
+
+	CHECK(run(code, 0, 1, profile_debugger(p)) == 6);
+
+	out = relink_code(code, sizeof(code), profile_counts(p), &size,
+		pcmap);
+	CHECK(out != NULL);
+	if (out == NULL) goto cleanup;
+	CHECK(pcmap[0] == 0 && pcmap[sizeof(code)] == size);
+
+	shifted = malloc(SHIFT + size);
+	memset(shifted, HALT, SHIFT);
+	memcpy(shifted + SHIFT, out, size);
+
+	for (flag=0; flag<2; ++flag) {
+		int want = run(code, 0, flag, NULL);
+
+		CHECK(want == (flag ? 6 : 99));
+		CHECK(run(out, 0, flag, NULL) == want);
+		CHECK(run(shifted, SHIFT, flag, NULL) == want);
+	}
+
+	free(shifted);
+	free(out);
+cleanup:
+	free_profile(p);
+}
+
+int main(void)
+{
+	test_relink();
+
+	return failures != 0;
+}
@@ -0,0 +1,162 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <debug.h>
+#include <module.h>
+#include <reload.h>
+#include <vm.h>
+#include "test.h"
+
+#define MODULE "bin/test_reload.mod"
+
+/*
+ * get returns the version; start makes a coroutine and returns its u32
+ * handle, and next resumes the handle passed to it, returning what it
+ * yielded. The coroutine yields 0x10 + the version, then returns.
+ */
+static uint8_t code[] = {
+	PUSH_u8, 1,
+	RET_u8,
+	PUSH_u8, 0,
+	PUSH_u32, 0, 0, 1, 0,
+	CORO_NEW, 0, 0, 0, 22,
+	RET_u32,
+	PUSH_u8, 1,
+	ARG_u32,
+	RESUME,
+	POP_u8,
+	RET_u64,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0x11,
+	YIELD,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+	RET_u64
+};
+static const struct symbol symbols[] = {
+	{"get", 0, SYMBOL_ENTRY},
+	{"start", 3, SYMBOL_ENTRY},
+	{"next", 16, SYMBOL_ENTRY}
+};
+
+/* the module of the last version made */
+static Module *module;
+
+/* a Code of version n of the program */
+static Code* version(uint8_t n)
+{
+	struct module_desc desc = {0};
+	Module *m;
+	Code *c;
+
+	code[1] = n;
+	code[30] = 0x10 + n;
+
+	desc.code = code;
+	desc.code_size = sizeof(code);
+	desc.symbols = symbols;
+	desc.symbol_count = 3;
+
+	if (write_module(MODULE, &desc) != 0) return NULL;
+	module = m = load_module(MODULE);
+	if (m == NULL) return NULL;
+
+	c = make_code(m);
+	if (c == NULL) free_module(m);
+
+	return c;
+}
+
+static uint64_t call(VM *vm, const char *name, uint32_t arg)
+{
+	uint8_t args[4];
+	uint64_t result = 0;
+
+	args[0] = arg >> 24;
+	args[1] = arg >> 16;
+	args[2] = arg >> 8;
+	args[3] = arg;
+
+	if (vm_call_latest(vm, name, args, name[0] == 'n' ? 4 : 0, &result)
+		!= VM_RETURN) return (uint64_t)-1;
+
+	return result;
+}
+
+/* a parked coroutine keeps the VM on the version it was made in */
+static void test_parked_coroutine(void)
+{
+	CodeSlot *slot = make_code_slot(version(1));
+	VM *vm = make_slot_vm(slot, 256, 16);
+	uint64_t handle;
+
+	CHECK(call(vm, "get", 0) == 1);
+	handle = call(vm, "start", 0);
+	CHECK(handle == 0);
+
+	publish_code(slot, version(2));
+	CHECK(call(vm, "get", 0) == 1);
+	CHECK(call(vm, "next", handle) == 0x11);
+	CHECK(call(vm, "get", 0) == 1);
+
+	/* once it has returned, the next call moves on */
+	CHECK(call(vm, "next", handle) == 0);
+	CHECK(call(vm, "get", 0) == 2);
+
+	free_vm(vm);
+	free_code_slot(slot);
+}
+
+static int on_trap(VM *vm, size_t pc, void *arg)
+{
+	(void)vm;
+	(void)pc;
+	(void)arg;
+
+	return DEBUG_CONTINUE;
+}
+
+/* a debugged VM stays on the code its debugger patched */
+static void test_debugged(void)
+{
+	CodeSlot *slot = make_code_slot(version(1));
+	VM *vm = make_slot_vm(slot, 256, 16);
+	Debugger *d = make_debugger(code, sizeof(code), on_trap, NULL);
+	uint8_t *original = module_code(module, NULL);
+
+	vm_debug(vm, d, original);
+	publish_code(slot, version(2));
+	CHECK(call(vm, "get", 0) == 1);
+
+	vm_debug(vm, NULL, original);
+	CHECK(call(vm, "get", 0) == 2);
+
+	free_vm(vm);
+	free_debugger(d);
+	free_code_slot(slot);
+}
+
+int main(void)
+{
+	test_parked_coroutine();
+	test_debugged();
+
+	remove(MODULE);
+
+	return failures != 0;
+}
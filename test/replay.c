@@ -0,0 +1,137 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <sys/syscall.h>
+#include <pool.h>
+#include <replay.h>
+#include <vm.h>
+#include "test.h"
+
+#define LOG "bin/test_replay.log"
+#define CHILD_A 52
+#define CHILD_B 58
+
+static uint8_t call[] = {SYSCALL, HALT};
+
+/* run SYSCALL number with no arguments on vm, returning its result */
+static uint64_t run_syscall(VM *vm, uint8_t number)
+{
+	uint64_t ret = 0;
+
+	vm_push_u8(vm, number);
+	vm_push_u8(vm, 0);
+	CHECK(run_vm(vm, call, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &ret) == 0);
+
+	return ret;
+}
+
+/* VMs sharing a log replay their own calls in whatever order they run */
+static void test_roots_any_order(void)
+{
+	uint64_t pid, ppid;
+	SyscallLog *log = record_syscalls(LOG);
+	VM *a = make_vm(call, 256, 16), *b = make_vm(call, 256, 16);
+
+	vm_attach_syscall_log(a, log);
+	vm_attach_syscall_log(b, log);
+	pid = run_syscall(a, SYS_getpid);
+	ppid = run_syscall(b, SYS_getppid);
+	CHECK(close_syscall_log(log) == 0);
+
+	log = replay_syscalls(LOG);
+	CHECK(log != NULL);
+	vm_attach_syscall_log(a, log);
+	vm_attach_syscall_log(b, log);
+	CHECK(run_syscall(b, SYS_getppid) == ppid);
+	CHECK(run_syscall(a, SYS_getpid) == pid);
+
+	/* a has no more calls in the log */
+	vm_push_u8(a, SYS_getpid);
+	vm_push_u8(a, 0);
+	CHECK(run_vm(a, call, 0) == VM_FAULT);
+
+	free_vm(a);
+	free_vm(b);
+	close_syscall_log(log);
+}
+
+/* spawn two children making different calls, and JOIN the second */
+static uint8_t spawn[] = {
+	PUSH_u8, 0,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 8,
+	SPAWN, 0, 0, 0, CHILD_A,
+	PUSH_u8, 0,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 8,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 8,
+	SPAWN, 0, 0, 0, CHILD_B,
+	JOIN,
+	HALT,
+	PUSH_u8, SYS_getpid, PUSH_u8, 0, SYSCALL, RET_u64,
+	PUSH_u8, SYS_getppid, PUSH_u8, 0, SYSCALL, RET_u64
+};
+
+/* run spawn, then JOIN the first child too, returning both results */
+static void run_spawn(VM *vm, uint64_t *a, uint64_t *b)
+{
+	CHECK(run_vm(vm, spawn, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, b) == 0);
+	CHECK(run_vm(vm, spawn, 50) == VM_HALT);
+	CHECK(vm_pop_u64(vm, a) == 0);
+}
+
+/* children's calls replay whatever order a pool runs them in */
+static void test_spawn(Pool *record_pool, Pool *replay_pool)
+{
+	uint64_t pid = 0, ppid = 0, a = 0, b = 0;
+	SyscallLog *log = record_syscalls(LOG);
+	VM *vm = make_vm(spawn, 256, 16);
+
+	vm_attach_pool(vm, record_pool);
+	vm_attach_syscall_log(vm, log);
+	run_spawn(vm, &pid, &ppid);
+	CHECK(pid != ppid);
+	free_vm(vm);
+	CHECK(close_syscall_log(log) == 0);
+
+	log = replay_syscalls(LOG);
+	CHECK(log != NULL);
+	vm = make_vm(spawn, 256, 16);
+	vm_attach_pool(vm, replay_pool);
+	vm_attach_syscall_log(vm, log);
+	run_spawn(vm, &a, &b);
+	CHECK(a == pid && b == ppid);
+	free_vm(vm);
+	close_syscall_log(log);
+}
+
+int main(void)
+{
+	Pool *pool = make_pool(2);
+
+	test_roots_any_order();
+	test_spawn(pool, NULL);
+	test_spawn(pool, pool);
+	test_spawn(NULL, pool);
+
+	free_pool(pool);
+
+	return failures != 0;
+}
@@ -0,0 +1,178 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <segment.h>
+#include <vm.h>
+#include "test.h"
+
+#define RW (VM_ENV_READ | VM_ENV_WRITE)
+
+/* add 1 to the u64 at env 16, n times */
+static uint8_t count[] = {
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 1,
+	PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 16,
+	XADD_u64,
+	POP_u64,
+	HALT
+};
+
+static void add(VM *vm, int n)
+{
+	while (n-- > 0) {
+		if (run_vm(vm, count, 0) != VM_HALT) {
+			CHECK(!"XADD_u64 halts");
+			return;
+		}
+	}
+}
+
+/* two VMs attaching one segment see each other's stores */
+static void test_shared(void)
+{
+	uint8_t store[] = {
+		PUSH_u8, 7,
+		PUSH_u8, 40,
+		STORE_u8,
+		HALT
+	};
+	uint8_t load[] = {
+		PUSH_u8, 40,
+		LOAD_u8,
+		HALT
+	};
+	Segment *s = make_segment(NULL, 64);
+	VM *a = make_vm(store, 64, 16);
+	VM *b = make_vm(load, 64, 16);
+	uint8_t v;
+
+	CHECK(s != NULL && segment_size(s) == 64);
+	if (s == NULL) goto cleanup;
+
+	CHECK(vm_attach_segment(a, 16, s, RW) == 0);
+	CHECK(vm_attach_segment(b, 16, s, VM_ENV_READ) == 0);
+
+	CHECK(run_vm(a, store, 0) == VM_HALT);
+	CHECK(((uint8_t*)segment_base(s))[24] == 7);
+	CHECK(run_vm(b, load, 0) == VM_HALT);
+	CHECK(vm_pop_u8(b, &v) == 0 && v == 7);
+
+	/* b's window is read-only */
+	CHECK(run_vm(b, store, 0) == VM_FAULT);
+
+	free_segment(s);
+cleanup:
+	free_vm(a);
+	free_vm(b);
+}
+
+/* a segment passed on as a descriptor maps the same memory */
+static void test_fd(void)
+{
+	Segment *s = make_segment(NULL, 32), *t;
+
+	CHECK(s != NULL);
+	if (s == NULL) return;
+
+	t = open_segment_fd(dup(segment_fd(s)));
+	CHECK(t != NULL && segment_size(t) == 32);
+	if (t != NULL) {
+		memcpy(segment_base(s), "shared", 7);
+		CHECK(strcmp(segment_base(t), "shared") == 0);
+		CHECK(segment_base(t) != segment_base(s));
+		free_segment(t);
+	}
+
+	free_segment(s);
+}
+
+/* XADD from a forked process and its parent lands in one counter */
+static void test_fork(void)
+{
+	Segment *s = make_segment(NULL, 64);
+	VM *vm = make_vm(count, 64, 16);
+	int status = -1;
+	uint64_t n;
+	pid_t pid;
+
+	CHECK(s != NULL);
+	if (s == NULL) goto cleanup;
+	memset(segment_base(s), 0, 64);
+	CHECK(vm_attach_segment(vm, 16, s, RW) == 0);
+
+	pid = fork();
+	if (pid == 0) {
+		add(vm, 10000);
+		_exit(failures != 0);
+	}
+	CHECK(pid > 0);
+	add(vm, 10000);
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	CHECK(vm_env_read(vm, 16, &n, sizeof(n)) == 0 && n == 20000);
+
+	free_segment(s);
+cleanup:
+	free_vm(vm);
+}
+
+/* a named segment opens by name until it's unlinked */
+static void test_named(void)
+{
+	char name[64];
+	Segment *s, *t;
+
+	sprintf(name, "/stacker-test-%ld", (long)getpid());
+	s = make_segment(name, 128);
+	CHECK(s != NULL);
+	if (s == NULL) return;
+
+	/* names are created once */
+	CHECK(make_segment(name, 128) == NULL);
+
+	t = open_segment(name);
+	CHECK(t != NULL && segment_size(t) == 128);
+	if (t != NULL) {
+		((uint8_t*)segment_base(s))[100] = 5;
+		CHECK(((uint8_t*)segment_base(t))[100] == 5);
+		free_segment(t);
+	}
+
+	CHECK(unlink_segment(name) == 0);
+	CHECK(open_segment(name) == NULL);
+
+	/* unlinking leaves existing mappings alone */
+	CHECK(((uint8_t*)segment_base(s))[100] == 5);
+	free_segment(s);
+}
+
+int main(void)
+{
+	test_shared();
+	test_fd();
+	test_fork();
+	test_named();
+
+	return failures != 0;
+}
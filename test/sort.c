@@ -0,0 +1,229 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <vm.h>
+#include "test.h"
+
+#define KEY 0
+#define BASE 16
+
+static uint8_t code[2] = {HALT, HALT};
+
+/* run opcode over count elements at BASE, pushing key's address if used */
+static int run(VM *vm, uint8_t opcode, uint64_t count, uint8_t type)
+{
+	vm_push_u64(vm, BASE);
+	vm_push_u64(vm, count);
+	if (opcode == PARTITION || opcode == BSEARCH) vm_push_u64(vm, KEY);
+	vm_push_u8(vm, type);
+
+	code[0] = opcode;
+	return run_vm(vm, code, 0);
+}
+
+/* run PARTITION or BSEARCH with key, returning the index pushed */
+static uint64_t search(VM *vm, uint8_t opcode, uint64_t count, uint8_t type,
+	const void *key, size_t size)
+{
+	uint64_t i = (uint64_t)-1;
+
+	vm_env_write(vm, KEY, key, size);
+	if (run(vm, opcode, count, type) == VM_HALT) vm_pop_u64(vm, &i);
+
+	return i;
+}
+
+static void test_ints(void)
+{
+	int32_t v[] = {5, -3, 0, -2147483647 - 1, 7, -3, 2147483647};
+	int32_t sorted[] = {-2147483647 - 1, -3, -3, 0, 5, 7, 2147483647};
+	uint16_t u[] = {300, 2, 65535, 256, 0};
+	uint16_t usorted[] = {0, 2, 256, 300, 65535};
+	VM *vm = make_vm(code, 64, 256);
+
+	vm_env_write(vm, BASE, v, sizeof(v));
+	CHECK(run(vm, SORT, 7, TYPE_i32) == VM_HALT);
+	CHECK(vm_env_read(vm, BASE, v, sizeof(v)) == 0);
+	CHECK(memcmp(v, sorted, sizeof(v)) == 0);
+
+	vm_env_write(vm, BASE, u, sizeof(u));
+	CHECK(run(vm, SORT, 5, TYPE_u16) == VM_HALT);
+	CHECK(vm_env_read(vm, BASE, u, sizeof(u)) == 0);
+	CHECK(memcmp(u, usorted, sizeof(u)) == 0);
+
+	free_vm(vm);
+}
+
+/* signed zeros tie and keep their order, NaNs go last, as documented */
+static void test_floats(void)
+{
+	uint64_t d[] = {
+		UINT64_C(0x3FF0000000000000), /* 1 */
+		UINT64_C(0x0000000000000000), /* +0 */
+		UINT64_C(0x7FF8000000000001), /* NaN */
+		UINT64_C(0x8000000000000000), /* -0 */
+		UINT64_C(0xBFF0000000000000), /* -1 */
+		UINT64_C(0xFFF8000000000000), /* -NaN */
+		UINT64_C(0xFFF0000000000000), /* -inf */
+		UINT64_C(0x7FF0000000000000) /* +inf */
+	};
+	uint64_t dsorted[] = {
+		UINT64_C(0xFFF0000000000000),
+		UINT64_C(0xBFF0000000000000),
+		UINT64_C(0x0000000000000000),
+		UINT64_C(0x8000000000000000),
+		UINT64_C(0x3FF0000000000000),
+		UINT64_C(0x7FF0000000000000),
+		UINT64_C(0x7FF8000000000001),
+		UINT64_C(0xFFF8000000000000)
+	};
+	uint32_t f[] = {0x80000000, 0x3F800000, 0xFFC00000, 0x00000000};
+	uint32_t fsorted[] = {0x80000000, 0x00000000, 0x3F800000, 0xFFC00000};
+	uint64_t neg_zero = UINT64_C(0x8000000000000000);
+	VM *vm = make_vm(code, 64, 256);
+
+	vm_env_write(vm, BASE, d, sizeof(d));
+	CHECK(run(vm, SORT, 8, TYPE_d) == VM_HALT);
+	CHECK(vm_env_read(vm, BASE, d, sizeof(d)) == 0);
+	CHECK(memcmp(d, dsorted, sizeof(d)) == 0);
+
+	/* -0.0 finds the first zero, whichever sign it has */
+	CHECK(search(vm, BSEARCH, 8, TYPE_d, &neg_zero, 8) == 2);
+
+	vm_env_write(vm, BASE, f, sizeof(f));
+	CHECK(run(vm, SORT, 4, TYPE_f) == VM_HALT);
+	CHECK(vm_env_read(vm, BASE, f, sizeof(f)) == 0);
+	CHECK(memcmp(f, fsorted, sizeof(f)) == 0);
+
+	free_vm(vm);
+}
+
+/* records sort stably by the element at their offset */
+static void test_records(void)
+{
+	uint8_t r[5][4] = {
+		{'a', 0, 3, 0}, {'b', 0, 1, 0}, {'c', 0, 3, 0},
+		{'d', 0, 0, 1}, {'e', 0, 1, 0}
+	};
+	const char order[] = "beacd";
+	uint16_t key;
+	int i;
+	VM *vm = make_vm(code, 64, 256);
+
+	for (i=0; i<5; ++i) {
+		key = r[i][2] | r[i][3] << 8;
+		memcpy(r[i] + 2, &key, 2);
+	}
+	vm_env_write(vm, BASE, r, sizeof(r));
+
+	vm_push_u64(vm, BASE);
+	vm_push_u64(vm, 5);
+	vm_push_u32(vm, 4);
+	vm_push_u32(vm, 2);
+	vm_push_u8(vm, TYPE_u16);
+	code[0] = SORT_rec;
+	CHECK(run_vm(vm, code, 0) == VM_HALT);
+
+	CHECK(vm_env_read(vm, BASE, r, sizeof(r)) == 0);
+	for (i=0; i<5; ++i) CHECK(r[i][0] == order[i]);
+
+	/* the element must fit in the record */
+	vm_push_u64(vm, BASE);
+	vm_push_u64(vm, 5);
+	vm_push_u32(vm, 4);
+	vm_push_u32(vm, 3);
+	vm_push_u8(vm, TYPE_u16);
+	CHECK(run_vm(vm, code, 0) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+static void test_partition(void)
+{
+	uint8_t v[] = {9, 1, 5, 3, 7, 2, 5}, pivot = 5;
+	int8_t s[] = {3, -1, -128, 2, 0}, zero = 0;
+	uint64_t n;
+	int i;
+	VM *vm = make_vm(code, 64, 256);
+
+	vm_env_write(vm, BASE, v, sizeof(v));
+	n = search(vm, PARTITION, 7, TYPE_u8, &pivot, 1);
+	CHECK(n == 3);
+	CHECK(vm_env_read(vm, BASE, v, sizeof(v)) == 0);
+	for (i=0; i<7; ++i) CHECK((v[i] < pivot) == (i < 3));
+
+	vm_env_write(vm, BASE, s, sizeof(s));
+	n = search(vm, PARTITION, 5, TYPE_i8, &zero, 1);
+	CHECK(n == 2);
+	CHECK(vm_env_read(vm, BASE, s, sizeof(s)) == 0);
+	for (i=0; i<5; ++i) CHECK((s[i] < 0) == (i < 2));
+
+	free_vm(vm);
+}
+
+/* BSEARCH finds lower bounds, reading a read-only window */
+static void test_bsearch(void)
+{
+	uint64_t v[] = {2, 4, 4, 4, 9}, key;
+	VM *vm = make_vm(code, 64, 16);
+
+	CHECK(vm_bind_env(vm, BASE, v, sizeof(v), VM_ENV_READ) == 0);
+
+	key = 4;
+	CHECK(search(vm, BSEARCH, 5, TYPE_u64, &key, 8) == 1);
+	key = 1;
+	CHECK(search(vm, BSEARCH, 5, TYPE_u64, &key, 8) == 0);
+	key = 5;
+	CHECK(search(vm, BSEARCH, 5, TYPE_u64, &key, 8) == 4);
+	key = 10;
+	CHECK(search(vm, BSEARCH, 5, TYPE_u64, &key, 8) == 5);
+	CHECK(search(vm, BSEARCH, 0, TYPE_u64, &key, 8) == 0);
+
+	/* but nothing moves elements in one */
+	CHECK(run(vm, SORT, 5, TYPE_u64) == VM_FAULT);
+	CHECK(run(vm, PARTITION, 5, TYPE_u64) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+/* unknown types and arrays running past env fault */
+static void test_bad(void)
+{
+	VM *vm = make_vm(code, 64, 64);
+
+	CHECK(run(vm, SORT, 2, TYPE_d + 1) == VM_FAULT);
+	CHECK(run(vm, SORT, 48, TYPE_u8) == VM_HALT);
+	CHECK(run(vm, SORT, 49, TYPE_u8) == VM_FAULT);
+	CHECK(run(vm, SORT, UINT64_C(1) << 62, TYPE_u64) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_ints();
+	test_floats();
+	test_records();
+	test_partition();
+	test_bsearch();
+	test_bad();
+
+	return failures != 0;
+}
@@ -0,0 +1,261 @@
+/******************************************************************************
+ * Copyright (C) 2017 Sahil Kang <sahil.kang@asilaycomputing.com>
+ *
+ * This file is part of stacker-vm.
+ *
+ * stacker-vm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * stacker-vm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with stacker-vm.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <string.h>
+#include <vm.h>
+#include "test.h"
+
+/* a table of 4 slots of u32 keys and values at env 64, keys at 0 */
+#define TABLE 64
+#define TABLE_SIZE (24 + 4*9)
+#define VALUE 32
+
+static uint8_t code[2] = {HALT, HALT};
+
+/* run opcode on the operands already pushed */
+static int run(VM *vm, uint8_t opcode)
+{
+	code[0] = opcode;
+	return run_vm(vm, code, 0);
+}
+
+static int init(VM *vm, uint64_t addr)
+{
+	vm_push_u64(vm, 4);
+	vm_push_u16(vm, 4);
+	vm_push_u16(vm, 4);
+	vm_push_u64(vm, addr);
+
+	return run(vm, HT_INIT);
+}
+
+/* insert key with value, pushing whether it went in */
+static int insert(VM *vm, uint32_t key, uint32_t value)
+{
+	uint8_t v = 0;
+
+	vm_env_write(vm, 0, &key, sizeof(key));
+	vm_env_write(vm, VALUE, &value, sizeof(value));
+	vm_push_u64(vm, 0);
+	vm_push_u64(vm, VALUE);
+	vm_push_u64(vm, TABLE);
+	if (run(vm, HT_INSERT) != VM_HALT || vm_pop_u8(vm, &v) != 0) {
+		return -1;
+	}
+
+	return v;
+}
+
+/* the env address of key's value in the table at addr, or 0 */
+static uint64_t lookup(VM *vm, uint64_t addr, uint32_t key)
+{
+	uint64_t v = 0;
+
+	vm_env_write(vm, 0, &key, sizeof(key));
+	vm_push_u64(vm, 0);
+	vm_push_u64(vm, addr);
+	if (run(vm, HT_LOOKUP) != VM_HALT) return (uint64_t)-1;
+	vm_pop_u64(vm, &v);
+
+	return v;
+}
+
+static int delete(VM *vm, uint32_t key)
+{
+	uint8_t v = 0;
+
+	vm_env_write(vm, 0, &key, sizeof(key));
+	vm_push_u64(vm, 0);
+	vm_push_u64(vm, TABLE);
+	if (run(vm, HT_DELETE) != VM_HALT || vm_pop_u8(vm, &v) != 0) {
+		return -1;
+	}
+
+	return v;
+}
+
+static uint32_t value_at(VM *vm, uint64_t addr)
+{
+	uint32_t v = 0;
+
+	vm_env_read(vm, addr, &v, sizeof(v));
+
+	return v;
+}
+
+/* keys go in, come out, are replaced and deleted, until the table fills */
+static void test_table(void)
+{
+	VM *vm = make_vm(code, 64, 256);
+	uint64_t at;
+
+	CHECK(init(vm, TABLE) == VM_HALT);
+	CHECK(lookup(vm, TABLE, 1) == 0);
+
+	CHECK(insert(vm, 1, 100) == 1);
+	CHECK(insert(vm, 2, 200) == 1);
+	at = lookup(vm, TABLE, 1);
+	CHECK(at > TABLE && at < TABLE + TABLE_SIZE);
+	CHECK(value_at(vm, at) == 100);
+	CHECK(value_at(vm, lookup(vm, TABLE, 2)) == 200);
+
+	/* inserting again replaces the value in place */
+	CHECK(insert(vm, 1, 101) == 1);
+	CHECK(lookup(vm, TABLE, 1) == at && value_at(vm, at) == 101);
+
+	CHECK(delete(vm, 1) == 1);
+	CHECK(delete(vm, 1) == 0);
+	CHECK(lookup(vm, TABLE, 1) == 0);
+	CHECK(value_at(vm, lookup(vm, TABLE, 2)) == 200);
+
+	/* deleted slots are reused, then a full table refuses new keys */
+	CHECK(insert(vm, 3, 300) == 1);
+	CHECK(insert(vm, 4, 400) == 1);
+	CHECK(insert(vm, 5, 500) == 1);
+	CHECK(insert(vm, 6, 600) == 0);
+	CHECK(insert(vm, 5, 501) == 1);
+	CHECK(lookup(vm, TABLE, 6) == 0);
+	CHECK(value_at(vm, lookup(vm, TABLE, 5)) == 501);
+
+	free_vm(vm);
+}
+
+/* a table in a read-only window can be looked up but not changed */
+static void test_read_only(void)
+{
+	VM *vm = make_vm(code, 64, 256);
+	uint8_t ro[TABLE_SIZE];
+
+	CHECK(init(vm, TABLE) == VM_HALT);
+	CHECK(insert(vm, 7, 700) == 1);
+	CHECK(vm_env_read(vm, TABLE, ro, sizeof(ro)) == 0);
+	CHECK(vm_bind_env(vm, 512, ro, sizeof(ro), VM_ENV_READ) == 0);
+
+	CHECK(value_at(vm, lookup(vm, 512, 7)) == 700);
+	CHECK(lookup(vm, 512, 8) == 0);
+
+	vm_push_u64(vm, 0);
+	vm_push_u64(vm, VALUE);
+	vm_push_u64(vm, 512);
+	CHECK(run(vm, HT_INSERT) == VM_FAULT);
+	vm_push_u64(vm, 0);
+	vm_push_u64(vm, 512);
+	CHECK(run(vm, HT_DELETE) == VM_FAULT);
+	CHECK(init(vm, 512) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+/* a bad capacity, or a table running past env, faults */
+static void test_bad_tables(void)
+{
+	VM *vm = make_vm(code, 64, 256);
+
+	vm_push_u64(vm, 3);
+	vm_push_u16(vm, 4);
+	vm_push_u16(vm, 4);
+	vm_push_u64(vm, TABLE);
+	CHECK(run(vm, HT_INIT) == VM_FAULT);
+
+	CHECK(init(vm, 256 - TABLE_SIZE + 1) == VM_FAULT);
+	CHECK(init(vm, 256 - TABLE_SIZE) == VM_HALT);
+
+	/* a header claiming more slots than env holds */
+	CHECK(init(vm, TABLE) == VM_HALT);
+	vm_env_write(vm, TABLE, "\x40\0\0\0\0\0\0\0", 8);
+	CHECK(lookup(vm, TABLE, 1) == (uint64_t)-1);
+
+	free_vm(vm);
+}
+
+/* HASH_crc32c is the Castagnoli CRC and continues from a partial one */
+static void test_crc32c(void)
+{
+	uint8_t hash[] = {
+		PUSH_u32, 0, 0, 0, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 9,
+		HASH_crc32c,
+		HALT
+	};
+	uint8_t resume[] = {
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 4,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 5,
+		HASH_crc32c,
+		HALT
+	};
+	VM *vm = make_vm(hash, 64, 16);
+	uint32_t crc;
+
+	vm_env_write(vm, 0, "123456789", 9);
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &crc) == 0 && crc == 0xE3069283);
+
+	hash[22] = 4;
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(run_vm(vm, resume, 0) == VM_HALT);
+	CHECK(vm_pop_u32(vm, &crc) == 0 && crc == 0xE3069283);
+
+	hash[22] = 17;
+	CHECK(run_vm(vm, hash, 0) == VM_FAULT);
+
+	free_vm(vm);
+}
+
+/* HASH_u64 depends on the seed and every byte */
+static void test_hash64(void)
+{
+	uint8_t hash[] = {
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 0,
+		PUSH_u64, 0, 0, 0, 0, 0, 0, 0, 11,
+		HASH_u64,
+		HALT
+	};
+	VM *vm = make_vm(hash, 64, 16);
+	uint64_t a, b, c, d;
+
+	vm_env_write(vm, 0, "hello world", 11);
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &a) == 0);
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &b) == 0 && a == b);
+
+	hash[8] = 1;
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &c) == 0 && c != a);
+
+	hash[8] = 0;
+	vm_env_write(vm, 10, "D", 1);
+	CHECK(run_vm(vm, hash, 0) == VM_HALT);
+	CHECK(vm_pop_u64(vm, &d) == 0 && d != a && d != c);
+
+	free_vm(vm);
+}
+
+int main(void)
+{
+	test_table();
+	test_read_only();
+	test_bad_tables();
+	test_crc32c();
+	test_hash64();
+
+	return failures != 0;
+}